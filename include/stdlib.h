@@ -26,6 +26,8 @@
 #include <src/mem.h>
 
 #define malloc  mem_alloc
+#define calloc  mem_calloc
 #define free    mem_free
+#define realloc mem_realloc
 
 #endif /* STDLIB_H */
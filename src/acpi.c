@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <lib/macros.h>
+
+#include "acpi.h"
+#include "pmap.h"
+
+/*
+ * The RSDP is located either in the first kilobyte of the extended BIOS
+ * data area (EBDA), the segment of which is stored at a fixed location,
+ * or in the BIOS read-only memory area. In both cases, it's aligned on
+ * a 16 bytes boundary.
+ */
+#define ACPI_EBDA_SEG_ADDR      0x40e
+#define ACPI_EBDA_SEARCH_SIZE   1024
+#define ACPI_BIOS_START         0xe0000
+#define ACPI_BIOS_END           0x100000
+#define ACPI_RSDP_ALIGN         16
+
+#define ACPI_RSDP_SIGNATURE     "RSD PTR "
+#define ACPI_RSDT_SIGNATURE     "RSDT"
+
+/*
+ * Root system description pointer, as defined in the first revision of
+ * the specification, which is the part covered by its checksum.
+ */
+struct acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+} __packed;
+
+/*
+ * Root system description table, or NULL if ACPI isn't available.
+ *
+ * The table is followed by an array of 32-bits physical addresses.
+ */
+static const struct acpi_sdt_header *acpi_rsdt;
+
+static bool
+acpi_checksum_valid(const void *ptr, size_t size)
+{
+    const uint8_t *bytes;
+    uint8_t sum;
+
+    bytes = ptr;
+    sum = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        sum += bytes[i];
+    }
+
+    return sum == 0;
+}
+
+static const struct acpi_rsdp *
+acpi_search_rsdp(uintptr_t start, uintptr_t end)
+{
+    const struct acpi_rsdp *rsdp;
+
+    for (uintptr_t addr = start; addr < end; addr += ACPI_RSDP_ALIGN) {
+        rsdp = (const struct acpi_rsdp *)addr;
+
+        if ((memcmp(rsdp->signature, ACPI_RSDP_SIGNATURE,
+                    sizeof(rsdp->signature)) == 0)
+            && acpi_checksum_valid(rsdp, sizeof(*rsdp))) {
+            return rsdp;
+        }
+    }
+
+    return NULL;
+}
+
+static const struct acpi_rsdp *
+acpi_find_rsdp(void)
+{
+    const struct acpi_rsdp *rsdp;
+    uintptr_t ebda;
+    uint16_t seg;
+
+    /*
+     * The compiler considers dereferencing such a low constant address as
+     * undefined, hence the copy.
+     */
+    memcpy(&seg, (const void *)ACPI_EBDA_SEG_ADDR, sizeof(seg));
+    ebda = (uintptr_t)seg << 4;
+
+    if (ebda != 0) {
+        rsdp = acpi_search_rsdp(ebda, ebda + ACPI_EBDA_SEARCH_SIZE);
+
+        if (rsdp) {
+            return rsdp;
+        }
+    }
+
+    return acpi_search_rsdp(ACPI_BIOS_START, ACPI_BIOS_END);
+}
+
+/*
+ * Return the table at the given physical address, or NULL if it's
+ * outside the identity mapped memory, or invalid.
+ */
+static const struct acpi_sdt_header *
+acpi_get_table(uintptr_t pa)
+{
+    const struct acpi_sdt_header *table;
+
+    if ((pa == 0) || (pa > (PMAP_MEM_SIZE - sizeof(*table)))) {
+        return NULL;
+    }
+
+    table = (const struct acpi_sdt_header *)pa;
+
+    if ((table->length < sizeof(*table))
+        || (table->length > (PMAP_MEM_SIZE - pa))
+        || !acpi_checksum_valid(table, table->length)) {
+        return NULL;
+    }
+
+    return table;
+}
+
+const struct acpi_sdt_header *
+acpi_find_table(const char *signature)
+{
+    const struct acpi_sdt_header *table;
+    const uint32_t *entries;
+    size_t nr_entries;
+
+    if (!acpi_rsdt) {
+        return NULL;
+    }
+
+    entries = (const uint32_t *)(acpi_rsdt + 1);
+    nr_entries = (acpi_rsdt->length - sizeof(*acpi_rsdt)) / sizeof(*entries);
+
+    for (size_t i = 0; i < nr_entries; i++) {
+        table = acpi_get_table(entries[i]);
+
+        if (table && (memcmp(table->signature, signature,
+                             sizeof(table->signature)) == 0)) {
+            return table;
+        }
+    }
+
+    return NULL;
+}
+
+void
+acpi_setup(void)
+{
+    const struct acpi_sdt_header *rsdt;
+    const struct acpi_rsdp *rsdp;
+
+    rsdp = acpi_find_rsdp();
+
+    if (!rsdp) {
+        return;
+    }
+
+    /*
+     * Later revisions of the specification add an extended table with
+     * 64-bits pointers, but the RSDT remains available, and is enough for
+     * a 32-bits kernel.
+     */
+    rsdt = acpi_get_table(rsdp->rsdt_address);
+
+    if (!rsdt || (memcmp(rsdt->signature, ACPI_RSDT_SIGNATURE,
+                         sizeof(rsdt->signature)) != 0)) {
+        return;
+    }
+
+    acpi_rsdt = rsdt;
+}
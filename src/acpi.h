@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * Minimal ACPI table lookup.
+ *
+ * The firmware describes the platform through ACPI tables, located in
+ * memory. The root system description pointer (RSDP) is found by scanning
+ * well-known BIOS areas, and refers to the root system description table
+ * (RSDT), which is an array of pointers to all the other tables, each
+ * identified by a 4 characters signature.
+ *
+ * Only the tables located in the identity mapped physical memory are
+ * accessible. This module doesn't interpret AML code.
+ *
+ * See Advanced Configuration and Power Interface (ACPI) Specification,
+ * 5 ACPI Software Programming Model.
+ */
+
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+
+#include <lib/macros.h>
+
+/*
+ * Common header of all system description tables.
+ */
+struct acpi_sdt_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __packed;
+
+/*
+ * Generic address structure, describing the location of registers.
+ */
+#define ACPI_GAS_SPACE_MEMORY 0
+
+struct acpi_gas {
+    uint8_t space_id;
+    uint8_t bit_width;
+    uint8_t bit_offset;
+    uint8_t access_size;
+    uint64_t address;
+} __packed;
+
+/*
+ * Return the table with the given signature, or NULL if not found.
+ *
+ * The checksum of the returned table has been verified.
+ */
+const struct acpi_sdt_header * acpi_find_table(const char *signature);
+
+/*
+ * Initialize the acpi module.
+ */
+void acpi_setup(void);
+
+#endif /* ACPI_H */
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <lib/list.h>
+#include <lib/macros.h>
+
+#include "arena.h"
+
+/*
+ * Alignment of memory returned by arena_alloc().
+ *
+ * See the description of mem_alloc() in mem.h.
+ */
+#define ARENA_ALIGN 4
+
+/*
+ * Chunk header.
+ *
+ * Chunks are linked in the arena list, the current chunk, from which
+ * allocations are made, being the last one.
+ */
+struct arena_chunk {
+    struct list node;
+    char data[] __aligned(ARENA_ALIGN);
+};
+
+void
+arena_init(struct arena *arena, size_t chunk_size)
+{
+    assert(chunk_size != 0);
+
+    list_init(&arena->chunks);
+    arena->ptr = NULL;
+    arena->end = NULL;
+    arena->chunk_size = P2ROUND(chunk_size, ARENA_ALIGN);
+}
+
+static struct arena_chunk *
+arena_chunk_create(size_t size)
+{
+    if (size > (SIZE_MAX - sizeof(struct arena_chunk))) {
+        return NULL;
+    }
+
+    return malloc(sizeof(struct arena_chunk) + size);
+}
+
+static void
+arena_chunk_destroy(struct arena_chunk *chunk)
+{
+    free(chunk);
+}
+
+static void *
+arena_alloc_large(struct arena *arena, size_t size)
+{
+    struct arena_chunk *chunk;
+
+    chunk = arena_chunk_create(size);
+
+    if (!chunk) {
+        return NULL;
+    }
+
+    /*
+     * Insert dedicated chunks at the head of the list so that the current
+     * chunk, which may still have free space, remains the last one.
+     */
+    list_insert_head(&arena->chunks, &chunk->node);
+    return chunk->data;
+}
+
+void *
+arena_alloc(struct arena *arena, size_t size)
+{
+    struct arena_chunk *chunk;
+    void *ptr;
+
+    /*
+     * Reject sizes which would wrap around when rounded up.
+     */
+    if (size > (SIZE_MAX - ARENA_ALIGN + 1)) {
+        return NULL;
+    }
+
+    size = P2ROUND(size, ARENA_ALIGN);
+
+    if (size > arena->chunk_size) {
+        return arena_alloc_large(arena, size);
+    }
+
+    /*
+     * This is the fast path. Note that the comparison is made on the
+     * remaining size rather than by computing ptr + size, which could
+     * overflow.
+     */
+    if (size > (size_t)(arena->end - arena->ptr)) {
+        chunk = arena_chunk_create(arena->chunk_size);
+
+        if (!chunk) {
+            return NULL;
+        }
+
+        list_insert_tail(&arena->chunks, &chunk->node);
+        arena->ptr = chunk->data;
+        arena->end = chunk->data + arena->chunk_size;
+    }
+
+    ptr = arena->ptr;
+    arena->ptr += size;
+    return ptr;
+}
+
+void
+arena_reset(struct arena *arena)
+{
+    struct arena_chunk *chunk, *current;
+
+    if (list_empty(&arena->chunks)) {
+        return;
+    }
+
+    current = list_last_entry(&arena->chunks, struct arena_chunk, node);
+
+    /*
+     * The last chunk may be a dedicated chunk if the arena has only been
+     * used for large allocations, in which case all chunks are released.
+     */
+    if (current->data + arena->chunk_size != arena->end) {
+        arena_destroy(arena);
+        return;
+    }
+
+    while (list_first(&arena->chunks) != &current->node) {
+        chunk = list_first_entry(&arena->chunks, struct arena_chunk, node);
+        list_remove(&chunk->node);
+        arena_chunk_destroy(chunk);
+    }
+
+    arena->ptr = current->data;
+}
+
+void
+arena_destroy(struct arena *arena)
+{
+    struct arena_chunk *chunk;
+
+    while (!list_empty(&arena->chunks)) {
+        chunk = list_first_entry(&arena->chunks, struct arena_chunk, node);
+        list_remove(&chunk->node);
+        arena_chunk_destroy(chunk);
+    }
+
+    arena->ptr = NULL;
+    arena->end = NULL;
+}
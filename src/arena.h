@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * Arena allocator.
+ *
+ * An arena, also called a region or zone, is a simple allocator built on
+ * top of a general purpose allocator. Memory is obtained from the backing
+ * allocator in large chunks, and allocating from an arena merely consists
+ * in advancing a pointer inside the current chunk, an operation often
+ * called "bump allocation". Objects allocated from an arena can't be freed
+ * individually. Instead, all of them are released at once, by resetting
+ * or destroying the arena.
+ *
+ * Arenas are well suited to transient memory with a well-known lifetime,
+ * e.g. the temporary objects created while processing a request, which
+ * all become garbage at the same time once the request is complete.
+ * Allocation is then a few instructions, and releasing everything costs
+ * one call to mem_free() per chunk instead of one per object, avoiding
+ * the merging of boundary tags each time.
+ *
+ * Arenas aren't thread-safe. Users must provide their own synchronization
+ * if an arena is shared.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#include <lib/list.h>
+
+/*
+ * Arena type.
+ *
+ * All members are private.
+ */
+struct arena {
+    struct list chunks;
+    char *ptr;
+    char *end;
+    size_t chunk_size;
+};
+
+/*
+ * Initialize an arena.
+ *
+ * The chunk size is the size of the memory blocks the arena obtains from
+ * mem_alloc(). Chunks are only allocated when needed.
+ */
+void arena_init(struct arena *arena, size_t chunk_size);
+
+/*
+ * Allocate memory from an arena.
+ *
+ * The returned memory is uninitialized, and aligned like memory returned
+ * by mem_alloc(). Allocations larger than the chunk size are served from
+ * dedicated chunks.
+ *
+ * Return NULL if memory is exhausted.
+ */
+void * arena_alloc(struct arena *arena, size_t size);
+
+/*
+ * Release all the memory allocated from an arena.
+ *
+ * One chunk is kept, so that an arena used in a loop doesn't allocate
+ * and free a chunk on each iteration.
+ */
+void arena_reset(struct arena *arena);
+
+/*
+ * Release all the memory allocated from an arena, including all chunks.
+ *
+ * The arena may be used again after being destroyed.
+ */
+void arena_destroy(struct arena *arena);
+
+#endif /* ARENA_H */
@@ -21,12 +21,36 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <lib/macros.h>
 
 #include "boot.h"
 
+/*
+ * Maximum size of the saved kernel command line, including the null
+ * terminating character. Longer command lines are truncated.
+ */
+#define BOOT_CMDLINE_SIZE 256
+
+/*
+ * Multiboot information structure, as passed by the boot loader.
+ *
+ * Only the members up to the command line are defined. The other ones
+ * are only valid if the matching flags are set, and aren't used.
+ */
+#define BOOT_INFO_FLAG_CMDLINE 0x4
+
+struct boot_info {
+    uint32_t flags;
+    uint32_t mem_lower;
+    uint32_t mem_upper;
+    uint32_t boot_device;
+    uint32_t cmdline;
+};
+
 /*
  * This is the boot stack, used by the boot code to set the value of
  * the ESP register very early once control is passed to the kernel.
@@ -41,3 +65,64 @@
  * [1] http://www.sco.com/developers/devspecs/abi386-4.pdf
  */
 uint8_t boot_stack[BOOT_STACK_SIZE] __aligned(4);
+
+/*
+ * Physical address of the multiboot information structure.
+ *
+ * See the assembly code at the boot_start label in boot_asm.S.
+ */
+uint32_t boot_info_addr;
+
+static char boot_cmdline[BOOT_CMDLINE_SIZE];
+
+const char *
+boot_get_option(const char *name)
+{
+    const char *word;
+    size_t length;
+
+    length = strlen(name);
+    word = boot_cmdline;
+
+    for (;;) {
+        while (*word == ' ') {
+            word++;
+        }
+
+        if (*word == '\0') {
+            return NULL;
+        }
+
+        if ((strncmp(word, name, length) == 0) && (word[length] == '=')) {
+            return &word[length + 1];
+        }
+
+        while ((*word != ' ') && (*word != '\0')) {
+            word++;
+        }
+    }
+}
+
+void
+boot_setup(void)
+{
+    const struct boot_info *info;
+    const char *cmdline;
+    size_t i;
+
+    info = (const struct boot_info *)boot_info_addr;
+
+    if (!(info->flags & BOOT_INFO_FLAG_CMDLINE)) {
+        return;
+    }
+
+    cmdline = (const char *)info->cmdline;
+    i = 0;
+
+    while ((i < (sizeof(boot_cmdline) - 1)) && (cmdline[i] != '\0')) {
+        boot_cmdline[i] = cmdline[i];
+        i++;
+    }
+
+    boot_cmdline[i] = '\0';
+}
@@ -31,4 +31,31 @@
  */
 #define BOOT_STACK_SIZE 4096
 
+/*
+ * Preprocessor declarations may be included by assembly source files, but
+ * C declarations may not.
+ */
+#ifndef __ASSEMBLER__
+
+/*
+ * Return the value of an option passed on the kernel command line.
+ *
+ * Options are given as name=value words, separated by spaces. The returned
+ * string starts at the value, and isn't terminated at the end of the value,
+ * but the value always ends with either a space or a null character.
+ *
+ * Return NULL if the option isn't set.
+ */
+const char * boot_get_option(const char *name);
+
+/*
+ * Initialize the boot module.
+ *
+ * This function saves the kernel command line, and must be called before
+ * the memory holding the boot information may be reused.
+ */
+void boot_setup(void);
+
+#endif /* __ASSEMBLER__ */
+
 #endif /* BOOT_H */
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <lib/macros.h>
+
+#include "bootmem.h"
+#include "panic.h"
+
+/*
+ * Size of the boot area.
+ *
+ * It must be large enough for all objects created at boot time, mostly
+ * thread structures and module instances. Thread stacks are allocated
+ * from the stack area instead (see thread.c).
+ */
+#define BOOTMEM_SIZE    (64 * 1024)
+
+/*
+ * Default alignment, which is at least the one provided by mem_alloc().
+ */
+#define BOOTMEM_ALIGN   8
+
+static char bootmem_area[BOOTMEM_SIZE] __aligned(BOOTMEM_ALIGN);
+
+/*
+ * Offset of the first free byte in the boot area.
+ */
+static size_t bootmem_offset;
+
+static bool bootmem_is_sealed;
+
+void *
+bootmem_alloc(size_t size)
+{
+    void *ptr;
+
+    if (bootmem_is_sealed) {
+        panic("bootmem: error: allocation after boot");
+    }
+
+    /*
+     * The area and the offset are both aligned, so aligning the offset
+     * is enough. The comparison is made on the remaining size, since
+     * rounding up the requested size could overflow.
+     */
+    if (size > (BOOTMEM_SIZE - bootmem_offset)) {
+        return NULL;
+    }
+
+    ptr = &bootmem_area[bootmem_offset];
+    bootmem_offset = P2ROUND(bootmem_offset + size, BOOTMEM_ALIGN);
+    return ptr;
+}
+
+void
+bootmem_seal(void)
+{
+    assert(!bootmem_is_sealed);
+
+    bootmem_is_sealed = true;
+    printf("bootmem: %zu/%zu bytes used\n",
+           bootmem_offset, sizeof(bootmem_area));
+}
+
+bool
+bootmem_sealed(void)
+{
+    return bootmem_is_sealed;
+}
+
+bool
+bootmem_contains(const void *ptr)
+{
+    return ((const char *)ptr >= bootmem_area)
+           && ((const char *)ptr < &bootmem_area[sizeof(bootmem_area)]);
+}
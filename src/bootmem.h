@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * Boot memory allocator.
+ *
+ * Many objects are created at boot time and never released, e.g. the
+ * threads started by the main function and their stacks. Allocating them
+ * from the general purpose heap interleaves them with transient objects,
+ * which fragments the heap for no benefit, since they will never be
+ * merged back with neighbor free blocks.
+ *
+ * Instead, these permanent objects are allocated from a separate, static
+ * area, by merely advancing a pointer, a technique called bump allocation.
+ * Since the area only requires static initialization, it's usable right
+ * from the start, even before mem_setup() is called. Objects allocated
+ * from the boot allocator can never be freed.
+ *
+ * Once boot completes, the allocator is sealed, and any further allocation
+ * attempt is considered a bug, which makes the kernel panic. Boot is a
+ * sequential process, with the scheduler not yet enabled, so no
+ * synchronization is needed.
+ */
+
+#ifndef BOOTMEM_H
+#define BOOTMEM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Allocate permanent memory at boot time.
+ *
+ * The returned memory is uninitialized, and aligned at least like memory
+ * returned by mem_alloc().
+ *
+ * Return NULL if the boot area is exhausted.
+ */
+void * bootmem_alloc(size_t size);
+
+/*
+ * Seal the boot allocator.
+ *
+ * This function is called once boot is complete, and reports the amount of
+ * boot memory used.
+ */
+void bootmem_seal(void);
+
+/*
+ * Return true if the boot allocator is sealed.
+ */
+bool bootmem_sealed(void);
+
+/*
+ * Return true if the given address was allocated from the boot allocator.
+ */
+bool bootmem_contains(const void *ptr);
+
+#endif /* BOOTMEM_H */
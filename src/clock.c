@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <lib/macros.h>
+
+#include "clock.h"
+#include "cpu.h"
+#include "hpet.h"
+#include "i8254.h"
+#include "panic.h"
+
+#define CLOCK_NS_PER_SEC 1000000000
+#define CLOCK_FS_PER_NS  1000000
+
+/*
+ * Calibration duration, in i8254 counts, i.e. about 50ms.
+ *
+ * The longer the calibration, the more accurate the result, since the
+ * error caused by reading the counters is spread over more time.
+ */
+#define CLOCK_CALIBRATION_COUNT (I8254_FREQ / 20)
+
+/*
+ * Number of fractional bits used when converting i8254 counts.
+ */
+#define CLOCK_PIT_SHIFT 16
+
+/*
+ * Time sources, by order of preference.
+ */
+enum clock_source {
+    CLOCK_SOURCE_TSC,
+    CLOCK_SOURCE_HPET,
+    CLOCK_SOURCE_PIT,
+};
+
+static enum clock_source clock_source;
+
+/*
+ * Counter conversion parameters, for the TSC and the HPET.
+ *
+ * Converting counter units to nanoseconds requires a multiplication by
+ * the ratio of the nanosecond frequency to the counter frequency. To avoid
+ * slow 64-bits divisions, this ratio is stored as a fixed-point number,
+ * with the given number of fractional bits, i.e.
+ * ns = (units * mult) >> shift. This is the same technique as the one
+ * used by Linux clock sources.
+ *
+ * These variables are only written at boot, so reading them requires no
+ * synchronization.
+ */
+static uint64_t clock_base;
+static uint32_t clock_mult;
+static unsigned int clock_shift;
+
+/*
+ * i8254 state.
+ *
+ * The tick count is incremented by the i8254 interrupt handler. The base
+ * is the number of counts elapsed before the initial count of the i8254
+ * was last changed. The generation number is incremented on every update
+ * of these variables, so that readers may detect concurrent updates.
+ *
+ * The multiplier converts i8254 counts to nanoseconds, with
+ * CLOCK_PIT_SHIFT fractional bits.
+ *
+ * The last value returned is used to make the clock monotonic.
+ * Interrupts must be disabled when accessing it.
+ */
+static volatile unsigned long clock_pit_ticks;
+static uint64_t clock_pit_base;
+static volatile unsigned long clock_pit_gen;
+static uint32_t clock_pit_mult;
+static uint64_t clock_pit_last;
+
+static bool
+clock_tsc_invariant(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    cpu_cpuid(CPU_CPUID_LEAF_FEATURES, &eax, &ebx, &ecx, &edx);
+
+    if (!(edx & CPU_CPUID_EDX_TSC)) {
+        return false;
+    }
+
+    cpu_cpuid(CPU_CPUID_LEAF_EXT_MAX, &eax, &ebx, &ecx, &edx);
+
+    if (eax < CPU_CPUID_LEAF_EXT_POWER) {
+        return false;
+    }
+
+    cpu_cpuid(CPU_CPUID_LEAF_EXT_POWER, &eax, &ebx, &ecx, &edx);
+    return edx & CPU_CPUID_EDX_INVARIANT_TSC;
+}
+
+/*
+ * Compute the conversion parameters for a counter incrementing the given
+ * number of units in the given number of nanoseconds.
+ */
+static void
+clock_set_ratio(uint64_t ns, uint32_t units)
+{
+    /*
+     * Use as many fractional bits as possible, provided that the multiplier
+     * fits in 32 bits, i.e. that (ns << shift) / units < 2^32.
+     */
+    clock_shift = 32;
+
+    while ((ns << clock_shift) >= ((uint64_t)units << 32)) {
+        clock_shift--;
+    }
+
+    clock_mult = cpu_div64(ns << clock_shift, units);
+}
+
+static void
+clock_calibrate_tsc(void)
+{
+    uint64_t start, end, ns;
+    uint32_t cycles;
+
+    assert(!cpu_intr_enabled());
+
+    /*
+     * Synchronize with the counter first, so that measurement starts
+     * right at the beginning of an i8254 count.
+     */
+    i8254_wait(1);
+    start = cpu_get_tsc();
+    i8254_wait(CLOCK_CALIBRATION_COUNT);
+    end = cpu_get_tsc();
+
+    if ((end - start) > (uint32_t)-1) {
+        panic("clock: tsc frequency too high");
+    }
+
+    cycles = end - start;
+    ns = cpu_div64((uint64_t)CLOCK_CALIBRATION_COUNT * CLOCK_NS_PER_SEC,
+                   I8254_FREQ);
+    clock_set_ratio(ns, cycles);
+    clock_base = cpu_get_tsc();
+}
+
+/*
+ * The HPET reports its period, in femtoseconds, so that no calibration
+ * is needed. The period is at most 100ns, which keeps the ratio below
+ * 2^32 with a reasonable number of fractional bits.
+ */
+static void
+clock_setup_hpet(void)
+{
+    clock_set_ratio(hpet_get_period(), CLOCK_FS_PER_NS);
+    clock_base = hpet_get_counter();
+}
+
+/*
+ * Convert a number of counter units to nanoseconds.
+ *
+ * The product of the value and the multiplier could take up to 96 bits.
+ * Split the value into its high and low halves, so that the two partial
+ * products fit in 64 bits. The high product is aligned on bit 32, which
+ * is why it's shifted left by (32 - shift) instead of right by shift.
+ */
+static uint64_t
+clock_convert(uint64_t value, uint32_t mult, unsigned int shift)
+{
+    uint32_t high, low;
+
+    assert(shift <= 32);
+
+    high = value >> 32;
+    low = value;
+    return (((uint64_t)high * mult) << (32 - shift))
+           + (((uint64_t)low * mult) >> shift);
+}
+
+static uint64_t
+clock_tsc_read(void)
+{
+    return clock_convert(cpu_get_tsc() - clock_base, clock_mult, clock_shift);
+}
+
+static uint64_t
+clock_hpet_read(void)
+{
+    return clock_convert(hpet_get_counter() - clock_base,
+                         clock_mult, clock_shift);
+}
+
+static uint64_t
+clock_pit_read(void)
+{
+    unsigned int elapsed, initial_count;
+    unsigned long ticks, gen;
+    uint64_t counts, ns;
+    uint32_t eflags;
+
+    /*
+     * The tick count and the counter can't be read atomically without
+     * disabling interrupts. Instead, retry if a tick occurred, or if the
+     * initial count changed, in between. Reading the counter itself is
+     * made atomic by the i8254 module, since interrupt handlers may also
+     * read the clock.
+     */
+    do {
+        gen = clock_pit_gen;
+        barrier();
+        ticks = clock_pit_ticks;
+        counts = clock_pit_base;
+        initial_count = i8254_get_initial_count();
+        elapsed = initial_count - i8254_get_count();
+        barrier();
+    } while (gen != clock_pit_gen);
+
+    counts += ((uint64_t)ticks * initial_count) + elapsed;
+    ns = clock_convert(counts, clock_pit_mult, CLOCK_PIT_SHIFT);
+
+    /*
+     * If the counter was reloaded but its interrupt not handled yet, e.g.
+     * because interrupts are disabled, the value read lacks a whole tick.
+     * Never return less than the last value returned, so that durations
+     * computed from unsigned differences never wrap. This only requires
+     * disabling interrupts for a comparison and a 64-bits store.
+     */
+    eflags = cpu_intr_save();
+
+    if (ns < clock_pit_last) {
+        ns = clock_pit_last;
+    } else {
+        clock_pit_last = ns;
+    }
+
+    cpu_intr_restore(eflags);
+
+    return ns;
+}
+
+uint64_t
+clock_monotonic_ns(void)
+{
+    switch (clock_source) {
+    case CLOCK_SOURCE_TSC:
+        return clock_tsc_read();
+    case CLOCK_SOURCE_HPET:
+        return clock_hpet_read();
+    default:
+        return clock_pit_read();
+    }
+}
+
+bool
+clock_uses_i8254(void)
+{
+    return clock_source == CLOCK_SOURCE_PIT;
+}
+
+void
+clock_report_tick(void)
+{
+    assert(!cpu_intr_enabled());
+
+    clock_pit_ticks++;
+    clock_pit_gen++;
+}
+
+void
+clock_rebase_i8254(void)
+{
+    unsigned int initial_count;
+
+    assert(!cpu_intr_enabled());
+
+    /*
+     * Include the counts of the current, partial period, which would
+     * otherwise be lost when the counter is reloaded with the new count.
+     */
+    initial_count = i8254_get_initial_count();
+    clock_pit_base += ((uint64_t)clock_pit_ticks * initial_count)
+                      + (initial_count - i8254_get_count());
+    clock_pit_ticks = 0;
+    clock_pit_gen++;
+}
+
+void
+clock_setup(void)
+{
+    clock_pit_ticks = 0;
+    clock_pit_base = 0;
+    clock_pit_gen = 0;
+    clock_pit_last = 0;
+    clock_pit_mult = cpu_div64((uint64_t)CLOCK_NS_PER_SEC << CLOCK_PIT_SHIFT,
+                                 I8254_FREQ);
+
+    if (clock_tsc_invariant()) {
+        clock_source = CLOCK_SOURCE_TSC;
+        clock_calibrate_tsc();
+    } else if (hpet_available()) {
+        clock_source = CLOCK_SOURCE_HPET;
+        clock_setup_hpet();
+    } else {
+        clock_source = CLOCK_SOURCE_PIT;
+    }
+}
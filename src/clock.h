@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * Monotonic clock.
+ *
+ * The timer module counts time in ticks, at the scheduling frequency,
+ * which is much too coarse to measure short durations such as latencies.
+ * This module provides a clock with nanosecond units, meant to provide
+ * cheap, high resolution timestamps.
+ *
+ * The clock is normally derived from the time-stamp counter (TSC) of the
+ * processor, calibrated at boot against the i8254. Reading it is then only
+ * a matter of executing the RDTSC instruction and converting the result,
+ * without any shared state that could require disabling interrupts.
+ *
+ * The TSC is only used if it's invariant, i.e. if it runs at a constant
+ * rate regardless of processor frequency and idle states. Otherwise, the
+ * clock is derived from the main counter of the HPET, if available, which
+ * is slower to read but just as lock-free. As a last resort, the clock is
+ * derived from the number of i8254 interrupts and the current value of
+ * its counter, with a resolution of about 838ns.
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Return the time elapsed since boot, in nanoseconds.
+ *
+ * This function may be called from any context, and the returned value
+ * never decreases. Interrupts are never disabled, except when the clock
+ * is derived from the i8254, in which case they're briefly disabled to
+ * read its counter, and to compare with the last value returned. If read
+ * with interrupts disabled while the i8254 interrupt is pending, the value
+ * doesn't progress until the interrupt is handled.
+ */
+uint64_t clock_monotonic_ns(void);
+
+/*
+ * Return true if the clock is derived from the i8254.
+ *
+ * In that case, the i8254 interrupt must keep being raised, even if the
+ * i8254 isn't the tick source.
+ */
+bool clock_uses_i8254(void);
+
+/*
+ * Report a periodic tick to the clock module.
+ *
+ * This function is called by the i8254 interrupt handler.
+ */
+void clock_report_tick(void);
+
+/*
+ * Account for the time elapsed with the current initial count of the i8254.
+ *
+ * This function is called by the i8254 module, with interrupts disabled,
+ * before changing the initial count.
+ */
+void clock_rebase_i8254(void);
+
+/*
+ * Initialize the clock module.
+ *
+ * The i8254 and hpet modules must be initialized, and interrupts disabled,
+ * since calibration relies on polling the i8254 counter.
+ */
+void clock_setup(void);
+
+#endif /* CLOCK_H */
@@ -34,7 +34,10 @@
 
 #include "cpu.h"
 #include "i8259.h"
+#include "panic.h"
+#include "pmap.h"
 #include "thread.h"
+#include "timer.h"
 
 /*
  * Segment flags.
@@ -45,13 +48,22 @@
  *  - 3.5 System Descriptor Types
  */
 #define CPU_SEG_DATA_RW         0x00000200
+#define CPU_SEG_TASK_GATE       0x00000500
+#define CPU_SEG_TSS             0x00000900
 #define CPU_SEG_CODE_RX         0x00000900
 #define CPU_SEG_S               0x00001000
 #define CPU_SEG_P               0x00008000
 #define CPU_SEG_DB              0x00400000
 #define CPU_SEG_G               0x00800000
 
-#define CPU_IDT_SIZE (CPU_IDT_VECT_IRQ_BASE + I8259_NR_IRQ_VECTORS)
+/*
+ * Number of IRQs, i.e. vectors above the exceptions.
+ */
+#define CPU_NR_IRQS (CPU_IDT_SIZE - CPU_IDT_VECT_IRQ_BASE)
+
+#if CPU_NR_IRQS < I8259_NR_IRQ_VECTORS
+#error "IDT too small for the i8259 vectors"
+#endif
 
 /*
  * Segment descriptor.
@@ -115,6 +127,101 @@ struct cpu_pseudo_desc {
 static struct cpu_seg_desc cpu_gdt[CPU_GDT_SIZE] __aligned(8);
 static struct cpu_seg_desc cpu_idt[CPU_IDT_SIZE] __aligned(8);
 
+/*
+ * Task state segment (TSS).
+ *
+ * The processor provides hardware support for task switching, where the
+ * state of a task is saved to and restored from a TSS. Modern systems
+ * implement task switching in software, which is faster and more
+ * flexible, and this kernel is no exception (see thread_switch_context
+ * in thread_asm.S). Hardware task switching is still useful in one case :
+ * handling faults caused by the stack itself.
+ *
+ * Thread stacks are demand-paged, which means that pages are only mapped
+ * when first accessed (see thread.c). When a thread pushes data on an
+ * unmapped page of its stack, a page fault occurs, but the processor
+ * can't push the interrupt frame on the stack of the thread, since it
+ * would fault again. The processor then raises a double fault, and if the
+ * double fault handler also used the stack of the interrupted thread, the
+ * processor would raise a triple fault, which resets the machine. The only
+ * way to reliably switch stacks in this case on i386 is to use a task gate,
+ * which makes the processor switch to another task, with its own stack.
+ *
+ * Page faults are therefore handled by a dedicated task, which returns
+ * to the interrupted task once the page is mapped, making the processor
+ * restart the faulting instruction. Double faults, which may still occur
+ * e.g. because of a bug in the page fault handler, are also handled by a
+ * dedicated task, since that task may be busy at that time.
+ *
+ * As a result, three TSS are used : the main one, into which the processor
+ * saves the state of the interrupted task, and the page fault and double
+ * fault TSS, from which the processor loads the state of the handlers.
+ * Note that, on return to the interrupted task, the processor reloads
+ * the page directory from the main TSS, which must therefore be valid.
+ *
+ * See Intel 64 and IA-32 Architecture Software Developer's Manual, Volume 3
+ * System Programming Guide :
+ *  - 7.2.1 Task-State Segment (TSS)
+ *  - 6.15 Exception and Interrupt Reference, Interrupt 8 Double Fault
+ *    Exception (#DF)
+ */
+struct cpu_tss {
+    uint16_t link;
+    uint16_t reserved0;
+    uint32_t esp0;
+    uint16_t ss0;
+    uint16_t reserved1;
+    uint32_t esp1;
+    uint16_t ss1;
+    uint16_t reserved2;
+    uint32_t esp2;
+    uint16_t ss2;
+    uint16_t reserved3;
+    uint32_t cr3;
+    uint32_t eip;
+    uint32_t eflags;
+    uint32_t eax;
+    uint32_t ecx;
+    uint32_t edx;
+    uint32_t ebx;
+    uint32_t esp;
+    uint32_t ebp;
+    uint32_t esi;
+    uint32_t edi;
+    uint16_t es;
+    uint16_t reserved4;
+    uint16_t cs;
+    uint16_t reserved5;
+    uint16_t ss;
+    uint16_t reserved6;
+    uint16_t ds;
+    uint16_t reserved7;
+    uint16_t fs;
+    uint16_t reserved8;
+    uint16_t gs;
+    uint16_t reserved9;
+    uint16_t ldt;
+    uint16_t reserved10;
+    uint16_t trap_bit;
+    uint16_t iobp;
+} __packed;
+
+#define CPU_TASK_STACK_SIZE 4096
+
+static struct cpu_tss cpu_tss;
+static struct cpu_tss cpu_df_tss;
+static struct cpu_tss cpu_pf_tss;
+static uint8_t cpu_df_stack[CPU_TASK_STACK_SIZE] __aligned(4);
+static uint8_t cpu_pf_stack[CPU_TASK_STACK_SIZE] __aligned(4);
+
+/*
+ * Interrupt stack.
+ *
+ * It's global so that the low level interrupt handler can switch to it
+ * (see cpu_asm.S), but it's considered private to the cpu module.
+ */
+uint8_t cpu_intr_stack[CPU_INTR_STACK_SIZE] __aligned(4);
+
 /*
  * Handler for external interrupt requests.
  */
@@ -128,7 +235,7 @@ struct cpu_irq_handler {
  *
  * Interrupts and preemption must be disabled when accessing the handlers.
  */
-static struct cpu_irq_handler cpu_irq_handlers[I8259_NR_IRQ_VECTORS];
+static struct cpu_irq_handler cpu_irq_handlers[CPU_NR_IRQS];
 
 /*
  * The interrupt frame is the stack content forged by interrupt handlers.
@@ -167,7 +274,13 @@ uint32_t cpu_get_eflags(void);
 void cpu_set_eflags(uint32_t eflags);
 void cpu_load_gdt(const struct cpu_pseudo_desc *desc);
 void cpu_load_idt(const struct cpu_pseudo_desc *desc);
+void cpu_load_tr(uint16_t selector);
+uint32_t cpu_get_cr2(void);
+uint32_t cpu_get_cr3(void);
 void cpu_intr_main(const struct cpu_intr_frame *frame);
+void cpu_intr_exit(void);
+void cpu_double_fault_main(uint32_t error) __attribute__((noreturn));
+void cpu_page_fault_main(uint32_t error);
 
 /*
  * Low level interrupt service routines.
@@ -177,6 +290,8 @@ void cpu_intr_main(const struct cpu_intr_frame *frame);
  */
 void cpu_isr_divide_error(void);
 void cpu_isr_general_protection(void);
+void cpu_isr_page_fault(void);
+void cpu_isr_double_fault(void);
 void cpu_isr_32(void);
 void cpu_isr_33(void);
 void cpu_isr_34(void);
@@ -193,6 +308,8 @@ void cpu_isr_44(void);
 void cpu_isr_45(void);
 void cpu_isr_46(void);
 void cpu_isr_47(void);
+void cpu_isr_lapic_timer(void);
+void cpu_isr_lapic_spurious(void);
 
 uint32_t
 cpu_intr_save(void)
@@ -232,8 +349,7 @@ cpu_halt(void)
 static void
 cpu_default_intr_handler(void)
 {
-    printf("cpu: error: unhandled interrupt\n");
-    cpu_halt();
+    panic("cpu: error: unhandled interrupt");
 }
 
 static void
@@ -288,6 +404,29 @@ cpu_seg_desc_init_intr_gate(struct cpu_seg_desc *desc,
                  | 0xe00;
 }
 
+static void
+cpu_seg_desc_init_tss(struct cpu_seg_desc *desc, const struct cpu_tss *tss)
+{
+    uint32_t base, limit;
+
+    base = (uint32_t)tss;
+    limit = sizeof(*tss) - 1;
+
+    desc->low = ((base & 0xffff) << 16) | (limit & 0xffff);
+    desc->high = (base & 0xff000000)
+                 | (limit & 0xf0000)
+                 | CPU_SEG_P
+                 | CPU_SEG_TSS
+                 | ((base >> 16) & 0xff);
+}
+
+static void
+cpu_seg_desc_init_task_gate(struct cpu_seg_desc *desc, uint16_t selector)
+{
+    desc->low = selector << 16;
+    desc->high = CPU_SEG_P | CPU_SEG_TASK_GATE;
+}
+
 static void
 cpu_pseudo_desc_init(struct cpu_pseudo_desc *desc,
                      const void *addr, size_t size)
@@ -343,6 +482,9 @@ cpu_setup_gdt(void)
     cpu_seg_desc_init_null(cpu_get_gdt_entry(CPU_GDT_SEL_NULL));
     cpu_seg_desc_init_code(cpu_get_gdt_entry(CPU_GDT_SEL_CODE));
     cpu_seg_desc_init_data(cpu_get_gdt_entry(CPU_GDT_SEL_DATA));
+    cpu_seg_desc_init_tss(cpu_get_gdt_entry(CPU_GDT_SEL_TSS), &cpu_tss);
+    cpu_seg_desc_init_tss(cpu_get_gdt_entry(CPU_GDT_SEL_DF_TSS), &cpu_df_tss);
+    cpu_seg_desc_init_tss(cpu_get_gdt_entry(CPU_GDT_SEL_PF_TSS), &cpu_pf_tss);
 
     cpu_pseudo_desc_init(&pseudo_desc, cpu_gdt, sizeof(cpu_gdt));
     cpu_load_gdt(&pseudo_desc);
@@ -363,8 +505,12 @@ cpu_setup_idt(void)
 
     cpu_seg_desc_init_intr_gate(&cpu_idt[CPU_IDT_VECT_DIV],
                                 cpu_isr_divide_error);
+    cpu_seg_desc_init_task_gate(&cpu_idt[CPU_IDT_VECT_DF],
+                                CPU_GDT_SEL_DF_TSS);
     cpu_seg_desc_init_intr_gate(&cpu_idt[CPU_IDT_VECT_GP],
                                 cpu_isr_general_protection);
+    cpu_seg_desc_init_task_gate(&cpu_idt[CPU_IDT_VECT_PF],
+                                CPU_GDT_SEL_PF_TSS);
     cpu_seg_desc_init_intr_gate(&cpu_idt[32], cpu_isr_32);
     cpu_seg_desc_init_intr_gate(&cpu_idt[33], cpu_isr_33);
     cpu_seg_desc_init_intr_gate(&cpu_idt[34], cpu_isr_34);
@@ -381,6 +527,10 @@ cpu_setup_idt(void)
     cpu_seg_desc_init_intr_gate(&cpu_idt[45], cpu_isr_45);
     cpu_seg_desc_init_intr_gate(&cpu_idt[46], cpu_isr_46);
     cpu_seg_desc_init_intr_gate(&cpu_idt[47], cpu_isr_47);
+    cpu_seg_desc_init_intr_gate(&cpu_idt[CPU_IDT_VECT_LAPIC_TIMER],
+                                cpu_isr_lapic_timer);
+    cpu_seg_desc_init_intr_gate(&cpu_idt[CPU_IDT_VECT_LAPIC_SPURIOUS],
+                                cpu_isr_lapic_spurious);
 
     cpu_pseudo_desc_init(&pseudo_desc, cpu_idt, sizeof(cpu_idt));
     cpu_load_idt(&pseudo_desc);
@@ -400,6 +550,50 @@ cpu_print_frame(const struct cpu_intr_frame *frame)
            (unsigned int)frame->esi, (unsigned int)frame->edi);
 }
 
+static void
+cpu_tss_init_task(struct cpu_tss *tss, void (*fn)(void), uint8_t *stack)
+{
+    tss->cr3 = cpu_get_cr3();
+    tss->eip = (uint32_t)fn;
+    tss->eflags = 0;
+    tss->esp = (uint32_t)&stack[CPU_TASK_STACK_SIZE];
+    tss->cs = CPU_GDT_SEL_CODE;
+    tss->ss = CPU_GDT_SEL_DATA;
+    tss->ds = CPU_GDT_SEL_DATA;
+    tss->es = CPU_GDT_SEL_DATA;
+    tss->fs = CPU_GDT_SEL_DATA;
+    tss->gs = CPU_GDT_SEL_DATA;
+    tss->iobp = sizeof(*tss);
+}
+
+static void
+cpu_setup_tss(void)
+{
+    /*
+     * The main TSS only serves as storage for the state of the interrupted
+     * task. Loading the task register is still required, so that the
+     * processor knows where to save that state.
+     */
+    cpu_tss.cr3 = cpu_get_cr3();
+    cpu_tss.iobp = sizeof(cpu_tss);
+    cpu_load_tr(CPU_GDT_SEL_TSS);
+
+    cpu_tss_init_task(&cpu_df_tss, cpu_isr_double_fault, cpu_df_stack);
+    cpu_tss_init_task(&cpu_pf_tss, cpu_isr_page_fault, cpu_pf_stack);
+}
+
+static void
+cpu_report_fault_addr(uintptr_t addr)
+{
+    printf("cpu: fault address: %08lx, eip: %08x, esp: %08x, thread: %s\n",
+           (unsigned long)addr, (unsigned int)cpu_tss.eip,
+           (unsigned int)cpu_tss.esp, thread_name(thread_self()));
+
+    if (thread_stack_guard_contains(addr)) {
+        panic("cpu: stack overflow");
+    }
+}
+
 static void
 cpu_exc_main(const struct cpu_intr_frame *frame)
 {
@@ -417,15 +611,64 @@ cpu_exc_main(const struct cpu_intr_frame *frame)
     }
 }
 
+void
+cpu_double_fault_main(uint32_t error)
+{
+    /*
+     * This function runs in the context of the double fault task, using
+     * its own stack. The state of the interrupted task was saved into the
+     * main TSS. Note that, for the sake of simplicity, the scheduler
+     * state still refers to the interrupted thread, which is what makes
+     * reporting it possible.
+     */
+    thread_preempt_disable();
+    printf("cpu: double fault, error: %x\n", (unsigned int)error);
+    cpu_report_fault_addr(cpu_get_cr2());
+    panic("cpu: double fault");
+}
+
+void
+cpu_page_fault_main(uint32_t error)
+{
+    uintptr_t addr;
+
+    /*
+     * Like the double fault handler, this function runs in the context of
+     * a dedicated task. Interrupts are disabled, since the EFLAGS value
+     * of the task is loaded from its TSS. Task switches also set the TS
+     * flag in CR0, which only affects floating point instructions, and is
+     * ignored since the kernel doesn't use the FPU.
+     *
+     * This function must never trigger a thread context switch, since the
+     * state of the interrupted thread is saved in the main TSS, and not on
+     * its stack. That's why preemption is disabled for good before printing
+     * anything on the fatal path, as re-enabling preemption could otherwise
+     * cause a reschedule.
+     */
+    addr = cpu_get_cr2();
+
+    if (thread_handle_stack_fault(addr)) {
+        return;
+    }
+
+    thread_preempt_disable();
+    printf("cpu: page fault, error: %x\n", (unsigned int)error);
+    cpu_report_fault_addr(addr);
+    panic("cpu: page fault");
+}
+
 void
 cpu_intr_main(const struct cpu_intr_frame *frame)
 {
     struct cpu_irq_handler *handler;
     unsigned int irq;
+    bool preemptible;
 
     assert(!cpu_intr_enabled());
     assert(frame->vector < ARRAY_SIZE(cpu_idt));
 
+    preemptible = thread_preempt_enabled();
+
     /*
      * Interrupt handlers may call functions that may in turn yield the
      * processor. When running in interrupt context, as opposed to thread
@@ -443,9 +686,12 @@ cpu_intr_main(const struct cpu_intr_frame *frame)
 
         /*
          * Acknowledge the IRQ as early as possible to allow another one to
-         * be raised.
+         * be raised. Local APIC interrupts are acknowledged by their
+         * handler.
          */
-        i8259_irq_eoi(irq);
+        if (irq < I8259_NR_IRQ_VECTORS) {
+            i8259_irq_eoi(irq);
+        }
 
         handler = cpu_lookup_irq_handler(irq);
 
@@ -454,15 +700,38 @@ cpu_intr_main(const struct cpu_intr_frame *frame)
         } else {
             handler->fn(handler->arg);
         }
+
+        /*
+         * Timers are processed after the handler, since it may have
+         * reported a tick, and before reenabling preemption, so that
+         * the processing is done before returning to the interrupted
+         * thread.
+         */
+        timer_softirq(preemptible);
     }
 
     /*
-     * On entry, preemption could have been either enabled or disabled.
-     * If it was enabled, this call will reenable it. As a side effect,
-     * it will check if the current thread was marked for yielding, e.g.
-     * because the interrupt handler has awaken a higher priority thread,
-     * in which case a context switch is triggerred. Such context switches
-     * are called involuntary.
+     * Preemption is reenabled by cpu_intr_exit(), once back on the stack
+     * of the interrupted context.
+     */
+}
+
+void
+cpu_intr_exit(void)
+{
+    /*
+     * On entry to cpu_intr_main(), preemption could have been either
+     * enabled or disabled. If it was enabled, this call will reenable it.
+     * As a side effect, it will check if the current thread was marked for
+     * yielding, e.g. because the interrupt handler has awaken a higher
+     * priority thread, in which case a context switch is triggerred. Such
+     * context switches are called involuntary.
+     *
+     * This function runs on the stack of the interrupted context, since
+     * the context of a thread is saved on its own stack on switch, whereas
+     * the interrupt stack is shared. Nested interrupts can't trigger a
+     * context switch here, since they only occur while timers are processed,
+     * with preemption disabled by the outer interrupt.
      *
      * Here is what the stack looks like when such a context switch occurs :
      *
@@ -476,7 +745,7 @@ cpu_intr_main(const struct cpu_intr_frame *frame)
      * |                                 |
      * +---------------------------------+
      * |                                 |
-     * | cpu_intr_main stack frame       |
+     * | cpu_intr_exit stack frame       |
      * |                                 |
      * +---------------------------------+
      * |                                 |
@@ -491,6 +760,28 @@ cpu_intr_main(const struct cpu_intr_frame *frame)
     thread_preempt_enable();
 }
 
+uint64_t
+cpu_div64(uint64_t n, uint32_t d)
+{
+    uint32_t high, low, rem;
+
+    assert(d != 0);
+
+    /*
+     * The DIV instruction divides the 64-bits number stored in edx:eax,
+     * but raises an exception if the quotient doesn't fit in 32 bits.
+     * The division is therefore performed in two steps, like long division
+     * by hand, so that the remainder of the high half, which is less than
+     * the divisor, makes the second quotient fit.
+     */
+    high = (uint32_t)(n >> 32) / d;
+    rem = (uint32_t)(n >> 32) % d;
+    asm("divl %4"
+        : "=a" (low), "=d" (rem)
+        : "a" ((uint32_t)n), "d" (rem), "rm" (d));
+    return ((uint64_t)high << 32) | low;
+}
+
 void
 cpu_irq_register(unsigned int irq, cpu_irq_handler_fn_t fn, void *arg)
 {
@@ -502,7 +793,10 @@ cpu_irq_register(unsigned int irq, cpu_irq_handler_fn_t fn, void *arg)
 
     handler = cpu_lookup_irq_handler(irq);
     cpu_irq_handler_set_fn(handler, fn, arg);
-    i8259_irq_enable(irq);
+
+    if (irq < I8259_NR_IRQ_VECTORS) {
+        i8259_irq_enable(irq);
+    }
 
     thread_preempt_enable();
     cpu_intr_restore(eflags);
@@ -513,4 +807,6 @@ cpu_setup(void)
 {
     cpu_setup_gdt();
     cpu_setup_idt();
+    pmap_setup();
+    cpu_setup_tss();
 }
@@ -39,6 +39,30 @@
  */
 #define CPU_EFL_IF      0x200   /* Enable maskable hardware interrupts */
 
+/*
+ * Control register flags.
+ *
+ * See Intel 64 and IA-32 Architecture Software Developer's Manual, Volume 3
+ * System Programming Guide, 2.5 Control Registers.
+ */
+#define CPU_CR0_PG      0x80000000  /* Paging */
+#define CPU_CR4_PSE     0x00000010  /* Page size extensions */
+
+/*
+ * CPUID leaves and feature flags.
+ *
+ * See Intel 64 and IA-32 Architecture Software Developer's Manual, Volume 2
+ * Instruction Set Reference, 3.2 Instructions (A-L), CPUID.
+ */
+#define CPU_CPUID_LEAF_FEATURES     1
+#define CPU_CPUID_EDX_PSE           0x00000008
+#define CPU_CPUID_EDX_TSC           0x00000010
+#define CPU_CPUID_EDX_APIC          0x00000200
+#define CPU_CPUID_ECX_TSC_DEADLINE  0x01000000
+#define CPU_CPUID_LEAF_EXT_MAX      0x80000000
+#define CPU_CPUID_LEAF_EXT_POWER    0x80000007
+#define CPU_CPUID_EDX_INVARIANT_TSC 0x00000100
+
 /*
  * GDT segment descriptor indexes, in bytes.
  *
@@ -48,7 +72,10 @@
 #define CPU_GDT_SEL_NULL    0x00
 #define CPU_GDT_SEL_CODE    0x08
 #define CPU_GDT_SEL_DATA    0x10
-#define CPU_GDT_SIZE        3
+#define CPU_GDT_SEL_TSS     0x18
+#define CPU_GDT_SEL_DF_TSS  0x20
+#define CPU_GDT_SEL_PF_TSS  0x28
+#define CPU_GDT_SIZE        6
 
 /*
  * IDT segment descriptor indexes (exception and interrupt vectors).
@@ -60,8 +87,21 @@
  * System Programming Guide, 6.3 Sources of Interrupts.
  */
 #define CPU_IDT_VECT_DIV            0   /* Divide error */
+#define CPU_IDT_VECT_DF             8   /* Double fault */
 #define CPU_IDT_VECT_GP             13  /* General protection fault */
+#define CPU_IDT_VECT_PF             14  /* Page fault */
 #define CPU_IDT_VECT_IRQ_BASE       32  /* Base vector for external IRQs */
+#define CPU_IDT_VECT_LAPIC_TIMER    48  /* Local APIC timer */
+#define CPU_IDT_VECT_LAPIC_SPURIOUS 63  /* Local APIC spurious interrupt */
+#define CPU_IDT_SIZE                64
+
+/*
+ * Size of the stack dedicated to interrupt handling.
+ *
+ * Interrupt handlers, softirq timer callbacks, and nested interrupts run
+ * on this stack, which must be large enough for all of them.
+ */
+#define CPU_INTR_STACK_SIZE 8192
 
 /*
  * Preprocessor declarations may be included by assembly source files, but
@@ -118,11 +158,60 @@ void cpu_idle(void);
  */
 void cpu_halt(void) __attribute__((noreturn));
 
+/*
+ * Execute the CPUID instruction for the given leaf.
+ *
+ * The subleaf, passed in ECX, is always 0.
+ */
+void cpu_cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx,
+               uint32_t *ecx, uint32_t *edx);
+
+/*
+ * Return the value of the time-stamp counter.
+ *
+ * The TSC is a 64-bits counter incremented at a constant rate on modern
+ * processors, and read with the unprivileged RDTSC instruction, making
+ * it a very cheap time source.
+ */
+uint64_t cpu_get_tsc(void);
+
+/*
+ * Read/write a model-specific register.
+ */
+uint64_t cpu_get_msr(uint32_t msr);
+void cpu_set_msr(uint32_t msr, uint64_t value);
+
+/*
+ * Divide a 64-bits number by a 32-bits number.
+ *
+ * 64-bits divisions are normally implemented by libgcc on i386, using
+ * a slow generic algorithm. This function directly uses the processor
+ * division instruction.
+ */
+uint64_t cpu_div64(uint64_t n, uint32_t d);
+
+/*
+ * Enable paging, using the given page directory.
+ *
+ * Large pages are enabled as well.
+ */
+void cpu_enable_paging(uintptr_t pdir);
+
+/*
+ * Invalidate the TLB entry for the given virtual address.
+ */
+void cpu_tlb_flush(uintptr_t va);
+
 /*
  * Register an IRQ handler.
  *
  * When the given IRQ is raised, the handler function is called with the
  * given argument.
+ *
+ * IRQs are numbered from their vector, starting at CPU_IDT_VECT_IRQ_BASE.
+ * The first ones are routed through the i8259, which is acknowledged
+ * before calling the handler. The others are raised by the local APIC,
+ * and the handler is responsible for acknowledging them.
  */
 void cpu_irq_register(unsigned int irq, cpu_irq_handler_fn_t fn, void *arg);
 
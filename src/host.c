@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * Host environment for the allocator programs.
+ *
+ * This file isn't part of the kernel. It provides the few kernel
+ * interfaces used by the allocator and the programs built on top of it,
+ * i.e. the benchmark (see membench_host.c) and the tests (see
+ * memtest_host.c), on top of the C library and POSIX threads, so that
+ * they may be built as regular Linux programs.
+ *
+ * The kernel mutex interface is implemented with a single POSIX mutex
+ * shared by all kernel mutexes. This is enough because the allocator
+ * mutex is the only one used in this environment. Interfaces that are
+ * only used by shell commands are stubs, since there is no shell.
+ *
+ * Note that the host is a 64-bits system, where pointers and sizes are
+ * larger, and the allocator only guarantees 4-byte alignment, which x86
+ * tolerates.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <lib/shell.h>
+
+#include "main.h"
+#include "memprof.h"
+#include "mutex.h"
+#include "panic.h"
+#include "thread.h"
+#include "tick.h"
+#include "timer.h"
+
+struct thread {
+    pthread_t pthread;
+    thread_fn_t fn;
+    void *arg;
+};
+
+static pthread_mutex_t host_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void
+panic(const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    abort();
+}
+
+void
+mutex_init(struct mutex *mutex)
+{
+    (void)mutex;
+}
+
+void
+mutex_lock(struct mutex *mutex)
+{
+    (void)mutex;
+    pthread_mutex_lock(&host_mutex);
+}
+
+int
+mutex_trylock(struct mutex *mutex)
+{
+    (void)mutex;
+    return pthread_mutex_trylock(&host_mutex) ? EBUSY : 0;
+}
+
+void
+mutex_unlock(struct mutex *mutex)
+{
+    (void)mutex;
+    pthread_mutex_unlock(&host_mutex);
+}
+
+static void *
+host_thread_main(void *arg)
+{
+    struct thread *thread;
+
+    thread = arg;
+    thread->fn(thread->arg);
+    return NULL;
+}
+
+int
+thread_create(struct thread **threadp, thread_fn_t fn, void *arg,
+              const char *name, size_t stack_size, unsigned int priority)
+{
+    struct thread *thread;
+    int error;
+
+    (void)name;
+    (void)stack_size;
+    (void)priority;
+
+    thread = malloc(sizeof(*thread));
+
+    if (!thread) {
+        return ENOMEM;
+    }
+
+    thread->fn = fn;
+    thread->arg = arg;
+
+    error = pthread_create(&thread->pthread, NULL,
+                           host_thread_main, thread);
+
+    if (error) {
+        free(thread);
+        return error;
+    }
+
+    *threadp = thread;
+    return 0;
+}
+
+void
+thread_join(struct thread *thread)
+{
+    pthread_join(thread->pthread, NULL);
+    free(thread);
+}
+
+void
+thread_yield(void)
+{
+    sched_yield();
+}
+
+/*
+ * There is no preemption to control on the host, where the idle zeroing
+ * path isn't exercised anyway.
+ */
+void
+thread_preempt_disable(void)
+{
+}
+
+void
+thread_preempt_enable(void)
+{
+}
+
+unsigned int
+tick_get_freq(void)
+{
+    return TICK_DEFAULT_FREQ;
+}
+
+unsigned long
+timer_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * TICK_DEFAULT_FREQ)
+           + (ts.tv_nsec / (1000000000 / TICK_DEFAULT_FREQ));
+}
+
+void
+memprof_alloc(const void *ptr, size_t size)
+{
+    (void)ptr;
+    (void)size;
+}
+
+void
+memprof_free(const void *ptr)
+{
+    (void)ptr;
+}
+
+struct shell_cmd_set *
+main_get_shell_cmd_set(void)
+{
+    return NULL;
+}
+
+int
+shell_cmd_set_register(struct shell_cmd_set *cmd_set, struct shell_cmd *cmd)
+{
+    (void)cmd_set;
+    (void)cmd;
+    return 0;
+}
+
+void
+shell_printf(struct shell *shell, const char *format, ...)
+{
+    (void)shell;
+    (void)format;
+}
@@ -0,0 +1,512 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lib/macros.h>
+
+#include "acpi.h"
+#include "cpu.h"
+#include "hpet.h"
+#include "i8254.h"
+#include "pmap.h"
+#include "thread.h"
+
+#define HPET_TABLE_SIGNATURE        "HPET"
+
+/*
+ * Register offsets, in bytes.
+ *
+ * All registers are 64-bits wide, but are accessed as pairs of 32-bits
+ * registers on this architecture.
+ */
+#define HPET_REG_CAP                0x000
+#define HPET_REG_PERIOD             0x004
+#define HPET_REG_CONF               0x010
+#define HPET_REG_COUNTER_LOW        0x0f0
+#define HPET_REG_COUNTER_HIGH       0x0f4
+#define HPET_REG_TIMER_CONF(id)     (0x100 + ((id) * 0x20))
+#define HPET_REG_TIMER_ROUTE(id)    (0x104 + ((id) * 0x20))
+#define HPET_REG_TIMER_CMP(id)      (0x108 + ((id) * 0x20))
+
+#define HPET_CAP_NR_TIMERS_MASK     0x00001f00
+#define HPET_CAP_NR_TIMERS_SHIFT    8
+#define HPET_CAP_COUNTER_64         0x00002000
+#define HPET_CAP_LEGACY             0x00008000
+
+#define HPET_CONF_ENABLE            0x00000001
+#define HPET_CONF_LEGACY            0x00000002
+
+#define HPET_TIMER_INT_ENABLE       0x00000004
+#define HPET_TIMER_PERIODIC         0x00000008
+#define HPET_TIMER_PERIODIC_CAP     0x00000010
+#define HPET_TIMER_VAL_SET          0x00000040
+#define HPET_TIMER_32BITS           0x00000100
+#define HPET_TIMER_ROUTE_SHIFT      9
+
+/*
+ * The period of the main counter is at most 100ns, i.e. its frequency
+ * is at least 10 MHz.
+ */
+#define HPET_MAX_PERIOD             100000000
+
+#define HPET_FS_PER_NS              1000000
+#define HPET_FS_PER_SEC             1000000000000000ULL
+
+#define HPET_MAX_TIMERS             32
+
+#define HPET_TICK_TIMER             0
+
+/*
+ * IRQ lines of the comparators in legacy replacement mode.
+ */
+#define HPET_LEGACY_IRQ0            0
+#define HPET_LEGACY_IRQ1            8
+
+/*
+ * Maximum one-shot delay, in nanoseconds.
+ *
+ * This bounds the product of the delay and the number of femtoseconds
+ * per nanosecond to 64 bits.
+ */
+#define HPET_TIMER_MAX_NS           ((uint64_t)1 << 32)
+
+/*
+ * Maximum one-shot delay, in counter units.
+ *
+ * Comparators are used in 32-bits mode, so that they can be written
+ * atomically, and the counter and comparator values are compared as
+ * signed 32-bits numbers.
+ */
+#define HPET_TIMER_MAX_COUNT        ((uint32_t)1 << 30)
+
+/*
+ * ACPI table describing the HPET.
+ */
+struct hpet_table {
+    struct acpi_sdt_header header;
+    uint32_t block_id;
+    struct acpi_gas address;
+    uint8_t number;
+    uint16_t min_tick;
+    uint8_t page_protection;
+} __packed;
+
+/*
+ * Comparator.
+ *
+ * Interrupts must be disabled when accessing the handler.
+ */
+struct hpet_timer {
+    unsigned int id;
+    unsigned int irq;
+    bool routed;
+    bool periodic;
+    cpu_irq_handler_fn_t fn;
+    void *arg;
+};
+
+/*
+ * i8259 IRQ lines which are usually free on PC systems, by order of
+ * preference. IRQ0, IRQ2 and IRQ4 are used by the i8254, the cascade
+ * of the i8259 slave, and the UART respectively.
+ */
+static const unsigned int hpet_free_irqs[] = { 8, 11, 10, 5, 7, 3 };
+
+static volatile uint32_t *hpet_regs;
+static uint32_t hpet_period;
+
+/*
+ * True if legacy replacement mode is used once the HPET becomes the tick
+ * source.
+ */
+static bool hpet_legacy;
+
+/*
+ * Mask of the IRQ lines assigned to comparators.
+ */
+static uint32_t hpet_used_irqs;
+
+static struct hpet_timer hpet_timers[HPET_MAX_TIMERS];
+static unsigned int hpet_nr_timers;
+
+static uint32_t
+hpet_read(unsigned int reg)
+{
+    return hpet_regs[reg / sizeof(*hpet_regs)];
+}
+
+static void
+hpet_write(unsigned int reg, uint32_t value)
+{
+    hpet_regs[reg / sizeof(*hpet_regs)] = value;
+}
+
+static void
+hpet_timer_intr(void *arg)
+{
+    struct hpet_timer *timer;
+
+    timer = arg;
+
+    /*
+     * Comparators raise edge-triggered interrupts, which don't need to
+     * be acknowledged at the HPET level.
+     */
+    if (timer->fn) {
+        timer->fn(timer->arg);
+    }
+}
+
+static void
+hpet_tick_intr(void *arg)
+{
+    (void)arg;
+    thread_report_tick();
+}
+
+static struct hpet_timer *
+hpet_lookup_timer(unsigned int id)
+{
+    struct hpet_timer *timer;
+
+    if (!hpet_available() || (id == HPET_TICK_TIMER)
+        || (id >= hpet_nr_timers)) {
+        return NULL;
+    }
+
+    timer = &hpet_timers[id];
+    return timer->routed ? timer : NULL;
+}
+
+/*
+ * Arm a comparator to expire after the given number of counter units.
+ *
+ * Comparators only match when the counter is equal to their value. If the
+ * counter goes past the comparator while it's being written, the interrupt
+ * would only be raised after the counter wraps around. In that case, try
+ * again with a larger delay.
+ */
+static void
+hpet_timer_arm(const struct hpet_timer *timer, uint32_t counts)
+{
+    uint32_t cmp;
+
+    for (;;) {
+        cmp = hpet_read(HPET_REG_COUNTER_LOW) + counts;
+        hpet_write(HPET_REG_TIMER_CMP(timer->id), cmp);
+
+        if ((int32_t)(cmp - hpet_read(HPET_REG_COUNTER_LOW)) > 0) {
+            break;
+        }
+
+        counts *= 2;
+    }
+}
+
+static void
+hpet_timer_route(struct hpet_timer *timer)
+{
+    uint32_t route_cap;
+    unsigned int irq;
+
+    if (hpet_legacy && (timer->id == 0)) {
+        /*
+         * IRQ0 belongs to the i8254, the interrupt handler of which keeps
+         * reporting ticks when the HPET raises IRQ0 in its place.
+         */
+        timer->irq = HPET_LEGACY_IRQ0;
+        timer->routed = true;
+        return;
+    }
+
+    if (hpet_legacy && (timer->id == 1)) {
+        /*
+         * In legacy replacement mode, comparator 1 raises IRQ8 whatever
+         * its route. Since that mode is only enabled when the HPET becomes
+         * the tick source, also route it to IRQ8 if possible, so that it's
+         * usable before. Otherwise, it becomes usable at that time.
+         */
+        timer->irq = HPET_LEGACY_IRQ1;
+        route_cap = hpet_read(HPET_REG_TIMER_ROUTE(timer->id));
+        timer->routed = route_cap & (1U << timer->irq);
+
+        if (timer->routed) {
+            hpet_write(HPET_REG_TIMER_CONF(timer->id),
+                       timer->irq << HPET_TIMER_ROUTE_SHIFT);
+        }
+    } else {
+        route_cap = hpet_read(HPET_REG_TIMER_ROUTE(timer->id));
+
+        for (size_t i = 0; i < ARRAY_SIZE(hpet_free_irqs); i++) {
+            irq = hpet_free_irqs[i];
+
+            if (!(route_cap & (1U << irq)) || (hpet_used_irqs & (1U << irq))) {
+                continue;
+            }
+
+            timer->irq = irq;
+            timer->routed = true;
+            hpet_write(HPET_REG_TIMER_CONF(timer->id),
+                       irq << HPET_TIMER_ROUTE_SHIFT);
+            break;
+        }
+
+        if (!timer->routed) {
+            return;
+        }
+    }
+
+    hpet_used_irqs |= (1U << timer->irq);
+    cpu_irq_register(timer->irq, hpet_timer_intr, timer);
+}
+
+bool
+hpet_available(void)
+{
+    return hpet_regs != NULL;
+}
+
+uint64_t
+hpet_get_counter(void)
+{
+    uint32_t high, low;
+
+    assert(hpet_available());
+
+    /*
+     * The two halves of the counter can't be read atomically. Read the
+     * high half again after the low half, and retry if it changed, i.e.
+     * if the low half wrapped around in between.
+     */
+    do {
+        high = hpet_read(HPET_REG_COUNTER_HIGH);
+        low = hpet_read(HPET_REG_COUNTER_LOW);
+    } while (high != hpet_read(HPET_REG_COUNTER_HIGH));
+
+    return ((uint64_t)high << 32) | low;
+}
+
+uint32_t
+hpet_get_period(void)
+{
+    assert(hpet_available());
+    return hpet_period;
+}
+
+int
+hpet_timer_set_handler(unsigned int id, cpu_irq_handler_fn_t fn, void *arg)
+{
+    struct hpet_timer *timer;
+    uint32_t eflags;
+
+    timer = hpet_lookup_timer(id);
+
+    if (!timer) {
+        return ENODEV;
+    }
+
+    eflags = cpu_intr_save();
+    timer->fn = fn;
+    timer->arg = arg;
+    cpu_intr_restore(eflags);
+    return 0;
+}
+
+int
+hpet_timer_set_oneshot(unsigned int id, uint64_t ns)
+{
+    struct hpet_timer *timer;
+    uint32_t eflags, conf;
+    uint64_t counts;
+
+    timer = hpet_lookup_timer(id);
+
+    if (!timer) {
+        return ENODEV;
+    }
+
+    if (ns > HPET_TIMER_MAX_NS) {
+        ns = HPET_TIMER_MAX_NS;
+    }
+
+    counts = cpu_div64((ns * HPET_FS_PER_NS) + hpet_period - 1, hpet_period);
+
+    if (counts == 0) {
+        counts = 1;
+    } else if (counts > HPET_TIMER_MAX_COUNT) {
+        counts = HPET_TIMER_MAX_COUNT;
+    }
+
+    eflags = cpu_intr_save();
+    conf = hpet_read(HPET_REG_TIMER_CONF(id)) & ~HPET_TIMER_PERIODIC;
+    hpet_write(HPET_REG_TIMER_CONF(id), conf | HPET_TIMER_INT_ENABLE
+                                        | HPET_TIMER_32BITS);
+    hpet_timer_arm(timer, counts);
+    cpu_intr_restore(eflags);
+    return 0;
+}
+
+void
+hpet_timer_stop(unsigned int id)
+{
+    uint32_t eflags, conf;
+
+    if (!hpet_lookup_timer(id)) {
+        return;
+    }
+
+    eflags = cpu_intr_save();
+    conf = hpet_read(HPET_REG_TIMER_CONF(id));
+    conf &= ~(HPET_TIMER_INT_ENABLE | HPET_TIMER_PERIODIC);
+    hpet_write(HPET_REG_TIMER_CONF(id), conf);
+    cpu_intr_restore(eflags);
+}
+
+int
+hpet_start_tick(unsigned int freq)
+{
+    struct hpet_timer *timer;
+    uint32_t eflags, conf, counts;
+
+    if (!hpet_available()) {
+        return ENODEV;
+    }
+
+    timer = &hpet_timers[HPET_TICK_TIMER];
+
+    if (!timer->routed || !timer->periodic) {
+        return ENODEV;
+    }
+
+    counts = cpu_div64(cpu_div64(HPET_FS_PER_SEC, freq), hpet_period);
+
+    eflags = cpu_intr_save();
+
+    timer->fn = hpet_tick_intr;
+    timer->arg = NULL;
+
+    /*
+     * Legacy replacement mode disconnects the i8254 from IRQ0, and the
+     * real time clock from IRQ8, which is why it's only enabled now.
+     */
+    if (hpet_legacy) {
+        hpet_write(HPET_REG_CONF, hpet_read(HPET_REG_CONF) | HPET_CONF_LEGACY);
+
+        if (hpet_nr_timers > 1) {
+            hpet_timers[1].routed = true;
+        }
+    }
+
+    /*
+     * In periodic mode, the comparator is incremented by the period on
+     * each expiration. Setting the value-set flag allows the following
+     * write to set the first expiration time, and the next one to set
+     * the period.
+     */
+    conf = hpet_read(HPET_REG_TIMER_CONF(timer->id));
+    hpet_write(HPET_REG_TIMER_CONF(timer->id), conf | HPET_TIMER_INT_ENABLE
+                                               | HPET_TIMER_PERIODIC
+                                               | HPET_TIMER_VAL_SET
+                                               | HPET_TIMER_32BITS);
+    hpet_write(HPET_REG_TIMER_CMP(timer->id),
+               hpet_read(HPET_REG_COUNTER_LOW) + counts);
+    hpet_write(HPET_REG_TIMER_CMP(timer->id), counts);
+
+    cpu_intr_restore(eflags);
+
+    if (!hpet_legacy) {
+        i8254_disable_tick();
+    }
+
+    return 0;
+}
+
+void
+hpet_setup(void)
+{
+    const struct hpet_table *table;
+    struct hpet_timer *timer;
+    uint32_t cap;
+    uintptr_t pa;
+
+    table = (const struct hpet_table *)acpi_find_table(HPET_TABLE_SIGNATURE);
+
+    if (!table || (table->header.length < sizeof(*table))
+        || (table->address.space_id != ACPI_GAS_SPACE_MEMORY)
+        || (table->address.address > (uintptr_t)-1)
+        || (table->address.address < (PMAP_STACK_AREA_START
+                                      + PMAP_STACK_AREA_SIZE))) {
+        return;
+    }
+
+    pa = table->address.address;
+    pmap_map_device(pa);
+    hpet_regs = (volatile uint32_t *)pa;
+
+    cap = hpet_read(HPET_REG_CAP);
+    hpet_period = hpet_read(HPET_REG_PERIOD);
+
+    if (!(cap & HPET_CAP_COUNTER_64)
+        || (hpet_period == 0) || (hpet_period > HPET_MAX_PERIOD)) {
+        hpet_regs = NULL;
+        return;
+    }
+
+    /*
+     * Halt the counter while reprogramming the HPET, and restart it
+     * from 0, so that it doesn't wrap around in practice.
+     */
+    hpet_write(HPET_REG_CONF, 0);
+    hpet_write(HPET_REG_COUNTER_LOW, 0);
+    hpet_write(HPET_REG_COUNTER_HIGH, 0);
+
+    hpet_nr_timers = ((cap & HPET_CAP_NR_TIMERS_MASK)
+                      >> HPET_CAP_NR_TIMERS_SHIFT) + 1;
+
+    for (unsigned int i = 0; i < hpet_nr_timers; i++) {
+        timer = &hpet_timers[i];
+        timer->id = i;
+        timer->periodic = hpet_read(HPET_REG_TIMER_CONF(i))
+                          & HPET_TIMER_PERIODIC_CAP;
+        hpet_write(HPET_REG_TIMER_CONF(i), 0);
+    }
+
+    /*
+     * Legacy replacement mode disconnects the i8254 from IRQ0, so it's
+     * only used if comparator 0 can replace it as a periodic source. It's
+     * enabled by hpet_start_tick(), since the HPET may never become the
+     * tick source.
+     */
+    hpet_legacy = (cap & HPET_CAP_LEGACY)
+                  && hpet_timers[HPET_TICK_TIMER].periodic;
+
+    for (unsigned int i = 0; i < hpet_nr_timers; i++) {
+        hpet_timer_route(&hpet_timers[i]);
+    }
+
+    hpet_write(HPET_REG_CONF, HPET_CONF_ENABLE);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * High Precision Event Timer (HPET) driver.
+ *
+ * The HPET is a chipset timer made of a main counter, incremented at a
+ * constant rate of at least 10 MHz, and a set of comparators, each raising
+ * an interrupt when the main counter reaches its value. It's found through
+ * its ACPI table, and accessed through memory-mapped registers.
+ *
+ * Only HPETs with a 64-bits main counter are supported. The counter then
+ * never wraps around in practice, and is used by the clock module as its
+ * time source when the TSC isn't invariant.
+ *
+ * Comparator 0 is reserved for the tick. Whenever possible, the HPET is
+ * put in legacy replacement mode when it becomes the tick source, where
+ * comparator 0 raises IRQ0 in place of the i8254, and comparator 1 raises
+ * IRQ8 in place of the real time clock. Other comparators, or all of them
+ * if legacy replacement isn't supported, are routed to a free i8259 IRQ
+ * line, if any.
+ *
+ * See IA-PC HPET (High Precision Event Timers) Specification, revision 1.0a.
+ */
+
+#ifndef HPET_H
+#define HPET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cpu.h"
+
+/*
+ * Return true if the HPET is available.
+ */
+bool hpet_available(void);
+
+/*
+ * Return the value of the main counter.
+ *
+ * This function may be called from any context, and never disables
+ * interrupts. The HPET must be available.
+ */
+uint64_t hpet_get_counter(void);
+
+/*
+ * Return the period of the main counter, in femtoseconds.
+ *
+ * The HPET must be available.
+ */
+uint32_t hpet_get_period(void);
+
+/*
+ * Set the function called when the given comparator expires.
+ *
+ * The function is called in interrupt context.
+ *
+ * Return ENODEV if the comparator doesn't exist or can't raise interrupts.
+ */
+int hpet_timer_set_handler(unsigned int id, cpu_irq_handler_fn_t fn,
+                           void *arg);
+
+/*
+ * Arm the given comparator, to expire once after the given delay, in
+ * nanoseconds.
+ *
+ * The delay is rounded up to the resolution of the counter, and capped
+ * to a few seconds.
+ *
+ * Return ENODEV if the comparator doesn't exist or can't raise interrupts.
+ */
+int hpet_timer_set_oneshot(unsigned int id, uint64_t ns);
+
+/*
+ * Disarm the given comparator.
+ */
+void hpet_timer_stop(unsigned int id);
+
+/*
+ * Make the HPET the tick source, using comparator 0 in periodic mode, at
+ * the given frequency, in Hz.
+ *
+ * This function may be called again to change the frequency.
+ *
+ * Return ENODEV if the HPET isn't available, or if comparator 0 doesn't
+ * support periodic mode or can't raise interrupts.
+ */
+int hpet_start_tick(unsigned int freq);
+
+/*
+ * Initialize the hpet module.
+ *
+ * The acpi module must be initialized.
+ */
+void hpet_setup(void);
+
+#endif /* HPET_H */
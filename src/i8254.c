@@ -20,43 +20,164 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
 #include <lib/macros.h>
 
+#include "clock.h"
 #include "cpu.h"
 #include "i8254.h"
+#include "i8259.h"
 #include "io.h"
 #include "thread.h"
-
-#define I8254_FREQ                  1193182
+#include "tick.h"
 
 #define I8254_PORT_CHANNEL0         0x40
 #define I8254_PORT_MODE             0x43
 
 #define I8254_CONTROL_BINARY        0x00
+#define I8254_CONTROL_LATCH         0x00
 #define I8254_CONTROL_RATE_GEN      0x04
 #define I8254_CONTROL_RW_LSB        0x10
 #define I8254_CONTROL_RW_MSB        0x20
 #define I8254_CONTROL_COUNTER0      0x00
 
-#define I8254_INITIAL_COUNT         DIV_CEIL(I8254_FREQ, THREAD_SCHED_FREQ)
+#define I8254_MAX_INITIAL_COUNT     0xffff
 
 #define I8254_IRQ                   0
 
+/*
+ * Value from which the counter of the scheduling timer is decremented.
+ *
+ * Interrupts must be disabled when changing this variable.
+ */
+static unsigned int i8254_initial_count;
+
+/*
+ * True if the i8254 is the tick source.
+ *
+ * Interrupts must be disabled when accessing this variable.
+ */
+static bool i8254_tick_enabled;
+
 static void
 i8254_irq_handler(void *arg)
 {
     (void)arg;
-    thread_report_tick();
+
+    clock_report_tick();
+
+    if (i8254_tick_enabled) {
+        thread_report_tick();
+    }
+}
+
+/*
+ * Return the number of counts elapsed since the given previous counter
+ * value, and update it.
+ *
+ * The counter is decremented down to 1, at which point it's reloaded with
+ * its initial count. It must be read at least once per period.
+ */
+static unsigned int
+i8254_elapsed(unsigned int *prev)
+{
+    unsigned int count, elapsed;
+
+    count = i8254_get_count();
+
+    if (count <= *prev) {
+        elapsed = *prev - count;
+    } else {
+        elapsed = *prev + (i8254_initial_count - count);
+    }
+
+    *prev = count;
+    return elapsed;
+}
+
+unsigned int
+i8254_get_initial_count(void)
+{
+    return i8254_initial_count;
+}
+
+unsigned int
+i8254_get_count(void)
+{
+    uint8_t low, high;
+    uint32_t eflags;
+
+    /*
+     * The counter is constantly decremented, and its two bytes can't be
+     * read at once. Latching copies the counter into an output register,
+     * which then holds that value until completely read.
+     *
+     * The output register and the flip-flop selecting the byte to read
+     * next are shared, so an interrupt handler reading the counter in
+     * the middle of this sequence would make both readers get mixed
+     * bytes, and leave the flip-flop out of phase for later reads. The
+     * sequence only takes three port accesses, which is why it's simply
+     * made atomic by disabling interrupts.
+     */
+    eflags = cpu_intr_save();
+    io_write(I8254_PORT_MODE, I8254_CONTROL_COUNTER0 | I8254_CONTROL_LATCH);
+    low = io_read(I8254_PORT_CHANNEL0);
+    high = io_read(I8254_PORT_CHANNEL0);
+    cpu_intr_restore(eflags);
+
+    return ((unsigned int)high << 8) | low;
 }
 
 void
-i8254_setup(void)
+i8254_wait(unsigned int counts)
+{
+    unsigned int prev, elapsed;
+
+    assert(!cpu_intr_enabled());
+
+    prev = i8254_get_count();
+    elapsed = 0;
+
+    while (elapsed < counts) {
+        elapsed += i8254_elapsed(&prev);
+    }
+}
+
+void
+i8254_disable_tick(void)
+{
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+
+    i8254_tick_enabled = false;
+
+    if (!clock_uses_i8254()) {
+        i8259_irq_disable(I8254_IRQ);
+    }
+
+    cpu_intr_restore(eflags);
+}
+
+void
+i8254_set_freq(unsigned int freq)
 {
-    uint16_t value;
+    unsigned int count;
+    uint32_t eflags;
+
+    count = DIV_CEIL(I8254_FREQ, freq);
+    assert((count != 0) && (count <= I8254_MAX_INITIAL_COUNT));
+
+    eflags = cpu_intr_save();
 
     /*
-     * Program the timer to raise an interrupt at the scheduling frequency.
+     * The clock may count time from the initial count, which is why it
+     * must take into account the time elapsed with the previous one first.
      */
+    clock_rebase_i8254();
 
     io_write(I8254_PORT_MODE, I8254_CONTROL_COUNTER0
                               | I8254_CONTROL_RW_MSB
@@ -64,9 +185,23 @@ i8254_setup(void)
                               | I8254_CONTROL_RATE_GEN
                               | I8254_CONTROL_BINARY);
 
-    value = I8254_INITIAL_COUNT;
-    io_write(I8254_PORT_CHANNEL0, value & 0xff);
-    io_write(I8254_PORT_CHANNEL0, value >> 8);
+    i8254_initial_count = count;
+    io_write(I8254_PORT_CHANNEL0, count & 0xff);
+    io_write(I8254_PORT_CHANNEL0, count >> 8);
+
+    cpu_intr_restore(eflags);
+}
+
+void
+i8254_setup(void)
+{
+    /*
+     * Program the timer to raise an interrupt at the default scheduling
+     * frequency. The tick module reprograms it if it's the tick source,
+     * and another frequency was selected.
+     */
+    i8254_tick_enabled = true;
+    i8254_set_freq(TICK_DEFAULT_FREQ);
 
     cpu_irq_register(I8254_IRQ, i8254_irq_handler, NULL);
 }
@@ -26,6 +26,54 @@
 #ifndef _I8254_H
 #define _I8254_H
 
+/*
+ * Frequency of the input clock of the counters, in Hz.
+ */
+#define I8254_FREQ 1193182
+
+/*
+ * Return the value from which the counter of the scheduling timer is
+ * decremented, down to 1, before being reloaded and raising an interrupt.
+ */
+unsigned int i8254_get_initial_count(void);
+
+/*
+ * Return the current value of the counter of the scheduling timer.
+ *
+ * This function may be called from any context. Interrupts are disabled
+ * while the counter is read.
+ */
+unsigned int i8254_get_count(void);
+
+/*
+ * Busy-wait until the counter has been decremented at least the given
+ * number of times.
+ *
+ * Since the counter is polled, this function may be used to measure time
+ * before interrupts are enabled, e.g. to calibrate other timers. A wait of
+ * one count returns right after a decrement, which allows synchronizing
+ * with the counter before starting a measurement.
+ *
+ * Interrupts must be disabled when calling this function.
+ */
+void i8254_wait(unsigned int counts);
+
+/*
+ * Stop raising the tick interrupt.
+ *
+ * This function is called when another timer replaces the i8254 as the
+ * tick source. The counter keeps running, and may still be read. The
+ * interrupt is only masked if the clock module doesn't depend on it.
+ */
+void i8254_disable_tick(void);
+
+/*
+ * Set the frequency of the tick interrupt, in Hz.
+ *
+ * The frequency must be within the range allowed by the tick module.
+ */
+void i8254_set_freq(unsigned int freq);
+
 /*
  * Initialize the i8254 module.
  */
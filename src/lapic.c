@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "i8254.h"
+#include "lapic.h"
+#include "pmap.h"
+#include "thread.h"
+
+/*
+ * Model-specific registers.
+ */
+#define LAPIC_MSR_BASE              0x01b
+#define LAPIC_MSR_TSC_DEADLINE      0x6e0
+
+#define LAPIC_MSR_BASE_ENABLE       0x00000800
+#define LAPIC_MSR_BASE_ADDR_MASK    0xfffff000
+
+/*
+ * Register offsets, in bytes.
+ */
+#define LAPIC_REG_TPR               0x080
+#define LAPIC_REG_EOI               0x0b0
+#define LAPIC_REG_SVR               0x0f0
+#define LAPIC_REG_LVT_TIMER         0x320
+#define LAPIC_REG_LVT_LINT0         0x350
+#define LAPIC_REG_LVT_LINT1         0x360
+#define LAPIC_REG_TIMER_ICR         0x380
+#define LAPIC_REG_TIMER_CCR         0x390
+#define LAPIC_REG_TIMER_DCR         0x3e0
+
+#define LAPIC_SVR_ENABLE            0x00000100
+
+/*
+ * Local vector table (LVT) entry flags.
+ */
+#define LAPIC_LVT_DELIVERY_NMI      0x00000400
+#define LAPIC_LVT_DELIVERY_EXTINT   0x00000700
+#define LAPIC_LVT_MASKED            0x00010000
+#define LAPIC_LVT_TIMER_ONESHOT     0x00000000
+#define LAPIC_LVT_TIMER_PERIODIC    0x00020000
+#define LAPIC_LVT_TIMER_DEADLINE    0x00040000
+
+/*
+ * Divide configuration, selecting a division of the bus frequency by 16.
+ */
+#define LAPIC_TIMER_DCR_DIV16       0x3
+
+#define LAPIC_NS_PER_SEC            1000000000
+
+/*
+ * Maximum one-shot delay, in nanoseconds.
+ *
+ * This bounds the product of the delay and the timer frequency to 64 bits.
+ */
+#define LAPIC_TIMER_MAX_NS          ((uint64_t)1 << 32)
+
+/*
+ * Calibration duration, in i8254 counts, i.e. about 10ms.
+ */
+#define LAPIC_CALIBRATION_COUNT     (I8254_FREQ / 100)
+
+static volatile uint32_t *lapic_regs;
+static bool lapic_tsc_deadline;
+
+/*
+ * Timer frequency, in Hz, and expiration handler.
+ *
+ * Interrupts must be disabled when accessing the handler.
+ */
+static uint32_t lapic_timer_freq;
+static cpu_irq_handler_fn_t lapic_timer_fn;
+static void *lapic_timer_arg;
+
+static uint32_t
+lapic_read(unsigned int reg)
+{
+    return lapic_regs[reg / sizeof(*lapic_regs)];
+}
+
+static void
+lapic_write(unsigned int reg, uint32_t value)
+{
+    lapic_regs[reg / sizeof(*lapic_regs)] = value;
+}
+
+static bool
+lapic_available(void)
+{
+    return lapic_regs != NULL;
+}
+
+static void
+lapic_eoi(void)
+{
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+static void
+lapic_timer_intr(void *arg)
+{
+    (void)arg;
+
+    lapic_eoi();
+
+    if (lapic_timer_fn) {
+        lapic_timer_fn(lapic_timer_arg);
+    }
+}
+
+static void
+lapic_spurious_intr(void *arg)
+{
+    (void)arg;
+
+    /*
+     * Spurious interrupts occur when an interrupt is retracted before
+     * being accepted by the processor. They must not be acknowledged.
+     */
+}
+
+static void
+lapic_tick_intr(void *arg)
+{
+    (void)arg;
+    thread_report_tick();
+}
+
+static void
+lapic_timer_calibrate(void)
+{
+    uint32_t count;
+
+    assert(!cpu_intr_enabled());
+
+    lapic_write(LAPIC_REG_TIMER_DCR, LAPIC_TIMER_DCR_DIV16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED
+                                     | LAPIC_LVT_TIMER_ONESHOT
+                                     | CPU_IDT_VECT_LAPIC_TIMER);
+
+    i8254_wait(1);
+    lapic_write(LAPIC_REG_TIMER_ICR, (uint32_t)-1);
+    i8254_wait(LAPIC_CALIBRATION_COUNT);
+    count = (uint32_t)-1 - lapic_read(LAPIC_REG_TIMER_CCR);
+    lapic_write(LAPIC_REG_TIMER_ICR, 0);
+
+    lapic_timer_freq = cpu_div64((uint64_t)count * I8254_FREQ,
+                                 LAPIC_CALIBRATION_COUNT);
+}
+
+/*
+ * Program the timer.
+ *
+ * Writing the initial count starts the timer, which is why it's done last.
+ */
+static void
+lapic_timer_program(uint32_t mode, uint32_t count)
+{
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+    lapic_write(LAPIC_REG_LVT_TIMER, mode | CPU_IDT_VECT_LAPIC_TIMER);
+    lapic_write(LAPIC_REG_TIMER_ICR, count);
+    cpu_intr_restore(eflags);
+}
+
+void
+lapic_timer_set_handler(cpu_irq_handler_fn_t fn, void *arg)
+{
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+    lapic_timer_fn = fn;
+    lapic_timer_arg = arg;
+    cpu_intr_restore(eflags);
+}
+
+int
+lapic_timer_set_periodic(unsigned int freq)
+{
+    uint32_t count;
+
+    assert(freq != 0);
+
+    if (!lapic_available()) {
+        return ENODEV;
+    }
+
+    count = lapic_timer_freq / freq;
+
+    if (count == 0) {
+        count = 1;
+    }
+
+    lapic_timer_program(LAPIC_LVT_TIMER_PERIODIC, count);
+    return 0;
+}
+
+int
+lapic_timer_set_oneshot(uint64_t ns)
+{
+    uint64_t count;
+
+    if (!lapic_available()) {
+        return ENODEV;
+    }
+
+    if (ns > LAPIC_TIMER_MAX_NS) {
+        ns = LAPIC_TIMER_MAX_NS;
+    }
+
+    count = cpu_div64((ns * lapic_timer_freq) + LAPIC_NS_PER_SEC - 1,
+                      LAPIC_NS_PER_SEC);
+
+    if (count == 0) {
+        count = 1;
+    } else if (count > (uint32_t)-1) {
+        count = (uint32_t)-1;
+    }
+
+    lapic_timer_program(LAPIC_LVT_TIMER_ONESHOT, count);
+    return 0;
+}
+
+int
+lapic_timer_set_deadline(uint64_t tsc)
+{
+    uint32_t eflags;
+
+    if (!lapic_available() || !lapic_tsc_deadline) {
+        return ENODEV;
+    }
+
+    /*
+     * In TSC-deadline mode, the initial count register is ignored, and
+     * the timer is armed by writing the deadline MSR instead.
+     */
+    eflags = cpu_intr_save();
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_TIMER_DEADLINE
+                                     | CPU_IDT_VECT_LAPIC_TIMER);
+    cpu_set_msr(LAPIC_MSR_TSC_DEADLINE, tsc);
+    cpu_intr_restore(eflags);
+    return 0;
+}
+
+void
+lapic_timer_stop(void)
+{
+    uint32_t eflags;
+
+    if (!lapic_available()) {
+        return;
+    }
+
+    eflags = cpu_intr_save();
+
+    if (lapic_tsc_deadline) {
+        cpu_set_msr(LAPIC_MSR_TSC_DEADLINE, 0);
+    }
+
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED
+                                     | CPU_IDT_VECT_LAPIC_TIMER);
+    lapic_write(LAPIC_REG_TIMER_ICR, 0);
+    cpu_intr_restore(eflags);
+}
+
+int
+lapic_start_tick(unsigned int freq)
+{
+    int error;
+
+    lapic_timer_set_handler(lapic_tick_intr, NULL);
+    error = lapic_timer_set_periodic(freq);
+
+    if (error) {
+        lapic_timer_set_handler(NULL, NULL);
+        return error;
+    }
+
+    i8254_disable_tick();
+    return 0;
+}
+
+void
+lapic_setup(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    uint64_t base;
+    uintptr_t pa;
+
+    cpu_cpuid(CPU_CPUID_LEAF_FEATURES, &eax, &ebx, &ecx, &edx);
+
+    if (!(edx & CPU_CPUID_EDX_APIC)) {
+        return;
+    }
+
+    lapic_tsc_deadline = ecx & CPU_CPUID_ECX_TSC_DEADLINE;
+
+    base = cpu_get_msr(LAPIC_MSR_BASE);
+    cpu_set_msr(LAPIC_MSR_BASE, base | LAPIC_MSR_BASE_ENABLE);
+
+    pa = base & LAPIC_MSR_BASE_ADDR_MASK;
+    pmap_map_device(pa);
+    lapic_regs = (volatile uint32_t *)pa;
+
+    cpu_irq_register(CPU_IDT_VECT_LAPIC_TIMER - CPU_IDT_VECT_IRQ_BASE,
+                     lapic_timer_intr, NULL);
+    cpu_irq_register(CPU_IDT_VECT_LAPIC_SPURIOUS - CPU_IDT_VECT_IRQ_BASE,
+                     lapic_spurious_intr, NULL);
+
+    /*
+     * Software-enable the local APIC, and keep receiving the interrupts of
+     * the i8259 through LINT0, in what is called virtual wire mode.
+     */
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | CPU_IDT_VECT_LAPIC_SPURIOUS);
+    lapic_write(LAPIC_REG_LVT_LINT0, LAPIC_LVT_DELIVERY_EXTINT);
+    lapic_write(LAPIC_REG_LVT_LINT1, LAPIC_LVT_DELIVERY_NMI);
+
+    lapic_timer_calibrate();
+}
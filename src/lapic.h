@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * Local APIC driver.
+ *
+ * Each processor has a local APIC (advanced programmable interrupt
+ * controller), which, among other things, includes a timer. Unlike the
+ * i8254, which is reached through I/O ports and the i8259, the local APIC
+ * is accessed through memory-mapped registers, which makes reprogramming
+ * and acknowledging its interrupts much cheaper.
+ *
+ * The timer counts down from an initial count at a rate derived from the
+ * bus frequency, which is unknown, and is therefore calibrated at boot
+ * against the i8254. It supports three modes :
+ *  - periodic, where the initial count is reloaded on expiration,
+ *  - one-shot, where the timer stops on expiration,
+ *  - TSC-deadline, where the timer expires when the TSC reaches a given
+ *    value, if supported by the processor.
+ *
+ * When available, the local APIC timer is the preferred tick source, in
+ * periodic mode.
+ *
+ * See Intel 64 and IA-32 Architecture Software Developer's Manual, Volume 3
+ * System Programming Guide, 10 Advanced Programmable Interrupt Controller
+ * (APIC).
+ */
+
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+/*
+ * Set the function called on timer expiration.
+ *
+ * The function is called in interrupt context, after the interrupt has
+ * been acknowledged.
+ */
+void lapic_timer_set_handler(cpu_irq_handler_fn_t fn, void *arg);
+
+/*
+ * Start the timer in periodic mode, at the given frequency, in Hz.
+ *
+ * Return ENODEV if the local APIC isn't available.
+ */
+int lapic_timer_set_periodic(unsigned int freq);
+
+/*
+ * Start the timer in one-shot mode, to expire after the given delay,
+ * in nanoseconds.
+ *
+ * The delay is rounded up to the resolution of the timer, and capped to
+ * its range, which is at least a few seconds.
+ *
+ * Return ENODEV if the local APIC isn't available.
+ */
+int lapic_timer_set_oneshot(uint64_t ns);
+
+/*
+ * Start the timer in TSC-deadline mode, to expire when the TSC reaches
+ * the given value.
+ *
+ * Return ENODEV if the local APIC or the TSC-deadline mode isn't available.
+ */
+int lapic_timer_set_deadline(uint64_t tsc);
+
+/*
+ * Stop the timer.
+ */
+void lapic_timer_stop(void);
+
+/*
+ * Make the local APIC timer the tick source, in periodic mode, at the
+ * given frequency, in Hz.
+ *
+ * This function may be called again to change the frequency.
+ *
+ * Return ENODEV if the local APIC isn't available.
+ */
+int lapic_start_tick(unsigned int freq);
+
+/*
+ * Initialize the lapic module.
+ *
+ * The i8254 must be initialized, and interrupts disabled, since
+ * calibration relies on polling its counter.
+ */
+void lapic_setup(void);
+
+#endif /* LAPIC_H */
@@ -29,14 +29,24 @@
 #include <lib/macros.h>
 #include <lib/shell.h>
 
+#include "acpi.h"
+#include "boot.h"
+#include "bootmem.h"
+#include "clock.h"
 #include "cpu.h"
+#include "hpet.h"
 #include "i8254.h"
 #include "i8259.h"
+#include "lapic.h"
 #include "main.h"
 #include "mem.h"
+#include "membench.h"
+#include "mempool.h"
+#include "memprof.h"
 #include "panic.h"
 #include "sw.h"
 #include "thread.h"
+#include "tick.h"
 #include "timer.h"
 #include "uart.h"
 
@@ -105,19 +115,38 @@ main_setup_shell(void)
 void
 main(void)
 {
+    boot_setup();
     thread_bootstrap();
     cpu_setup();
     i8259_setup();
     i8254_setup();
     uart_setup();
+    acpi_setup();
+    hpet_setup();
+    clock_setup();
+    lapic_setup();
+    tick_setup();
     mem_setup();
     thread_setup();
     timer_setup();
+    mempool_setup();
     main_setup_shell();
+    mem_setup_shell();
+    timer_setup_shell();
+    tick_setup_shell();
+    memprof_setup();
+    membench_setup();
     sw_setup();
 
+    bootmem_seal();
+
     printf("X1 " QUOTE(VERSION) "\n\n");
 
+    /*
+     * Interrupts are enabled when the scheduler starts running threads.
+     */
+    uart_set_polled(false);
+
     thread_enable_scheduler();
 
     /* Never reached */
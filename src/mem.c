@@ -43,51 +43,47 @@
  * this implementation :
  *
  *   allocated block              free block
- * +------+-----------------+   +------+-----------------+
- * | size | allocation flag |   | size | allocation flag | <- header boundary
- * +------+-----------------+   +------+-----------------+    tag
+ * +------+-------+---------+   +------+-------+---------+
+ * | size | flags (A=1, P)  |   | size | flags (A=0, P)  | <- header boundary
+ * +------+-------+---------+   +------+-------+---------+    tag
  * |                        |   | free list node (prev   | <- payload or
  * .       payload          .   | and next pointers)     |    free list node
  * .                        .   +------------------------+
  * .                        .   .                        .
  * .                        .   .                        .
- * .                        .   .                        .
- * +------+-----------------+   +------+-----------------+
- * | size | allocation flag |   | size | allocation flag | <- footer boundary
- * +------+-----------------+   +------+-----------------+    tag
+ * .                        .   +------------------------+
+ * .                        .   |          size          | <- footer boundary
+ * +------------------------+   +------------------------+    tag
+ *
+ * A is the allocation flag, and P is the "previous block free" flag.
  *
  * Here is a view of multiple contiguous blocks :
  *
  * +------+-----------------+ <--+
- * | size | allocation flag |    |
- * +------+-----------------+    +- single block
+ * | size | A=1, P=0        |    |
+ * +------+-----------------+    +- single (allocated) block
  * |                        |    |
  * .       payload          .    |
  * .                        .    |
  * .                        .    |
- * +------+-----------------+    |
- * | size | allocation flag |    |
- * +------+-----------------+ <--+
+ * +------------------------+ <--+
  * +------+-----------------+
- * | size | allocation flag |
+ * | size | A=0, P=0        |
  * +------+-----------------+
- * |                        |
- * .       payload          .
+ * | free list node         |
+ * +------------------------+
  * .                        .
- * .                        .
- * +------+-----------------+
- * | size | allocation flag |
+ * +------------------------+
+ * |          size          |
+ * +------------------------+
  * +------+-----------------+
- * +------+-----------------+
- * | size | allocation flag |
+ * | size | A=1, P=1        |
  * +------+-----------------+
  * |                        |
  * .       payload          .
  * .                        .
  * .                        .
- * +------+-----------------+
- * | size | allocation flag |
- * +------+-----------------+
+ * +------------------------+
  *
  * The reason for the footer boundary tag is merging on liberation. When
  * called, the mem_free() function is given a pointer to a payload. Since
@@ -100,6 +96,59 @@
  * the block. But without a footer boundary tag, finding the address of
  * the previous block is computationally expensive.
  *
+ * However, the footer is only needed when the previous block is free,
+ * since allocated blocks are never merged. Knuth's original algorithm
+ * stores a footer in all blocks, but a common optimization, described
+ * e.g. in "Dynamic Storage Allocation: A Survey and Critical Review" by
+ * Wilson et al., is to only store it in free blocks, and to record in
+ * the header of each block whether the previous one is free. When that
+ * flag is set, the previous footer is valid and gives the size of the
+ * previous block. Otherwise, the previous block is allocated, and the
+ * memory right before the header belongs to its payload. This halves
+ * the overhead of allocated blocks, which matters most for the small
+ * allocations that dominate typical workloads. The price is that the
+ * flag of the next block must be maintained whenever a block changes
+ * state.
+ *
+ * Zeroed memory
+ * -------------
+ * Users often need zeroed memory, which mem_calloc() provides. Zeroing
+ * is expensive, proportional to the size of the allocation, and is better
+ * done in advance, when the processor has nothing else to do. In this
+ * allocator, the idle thread zeroes free blocks in the background (see
+ * mem_idle_zero()), and each free block tracks how much of its payload
+ * is known to be zero. The word right before the footer records the dirty
+ * end of the payload, above which all bytes are zero, up to that word :
+ *
+ * +------+-----------------+
+ * | size | A=0, P          |
+ * +------+-----------------+
+ * | free list node         | <- always dirty
+ * +------------------------+
+ * .       dirty            .
+ * +------------------------+ <- dirty end
+ * .       clean            .
+ * +------------------------+ <- clean end
+ * |       dirty end        | <- always dirty
+ * +------------------------+
+ * |          size          | <- always dirty
+ * +------------------------+
+ *
+ * Storing the dirty end there rather than in the free list node keeps the
+ * minimum block size unchanged, which matters for the small allocations
+ * that dominate typical workloads. Blocks too small to hold the dirty end
+ * have no clean part, i.e. their clean end is right after the free list
+ * node, and they're considered clean, since there is nothing to zero in
+ * advance.
+ *
+ * A block is clean when its dirty end is right after the free list node.
+ * When a clean block is allocated with mem_calloc(), only the free list
+ * node and the bytes from the clean end need to be zeroed, making the
+ * allocation as cheap as a plain one. Clean memory is preserved when
+ * blocks are split, and when a free block is merged with a clean
+ * successor, by zeroing the few bytes between them. Blocks released by
+ * users are dirty.
+ *
  * Alignment
  * ---------
  * The word "aligned" and references to "alignment" in general can be
@@ -123,15 +172,23 @@
  */
 
 #include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
 #include <lib/list.h>
 #include <lib/macros.h>
+#include <lib/shell.h>
 
+#include "main.h"
 #include "mem.h"
+#include "memprof.h"
 #include "mutex.h"
+#include "panic.h"
+#include "thread.h"
 
 /*
  * Total size of the backing storage heap.
@@ -156,11 +213,23 @@
 /*
  * Minimum size of a block.
  *
- * When free, the payload of a block is used as storage for the free list node.
+ * When free, the payload of a block is used as storage for the free list node,
+ * and the block needs both its boundary tags. Since allocated blocks only
+ * have a header, a block of the minimum size can hold a larger payload when
+ * allocated.
  */
 #define MEM_BLOCK_MIN_SIZE  P2ROUND(((sizeof(struct mem_btag) * 2) \
                                     + sizeof(struct mem_free_node)), MEM_ALIGN)
 
+/*
+ * Minimum size of a free block tracking its clean part.
+ *
+ * The dirty end is stored right before the footer, which requires room
+ * beyond the minimum block size.
+ */
+#define MEM_BLOCK_MIN_TRACKED_SIZE (MEM_BLOCK_MIN_SIZE \
+                                    + P2ROUND(sizeof(char *), MEM_ALIGN))
+
 /*
  * The heap itself must be aligned, so that the first block is also aligned.
  * Assuming all blocks have an aligned size, the last block must also end on
@@ -179,10 +248,46 @@
 #endif
 
 /*
- * Masks applied on boundary tags to extract the size and the allocation flag.
+ * Boundary tags store two flags in the least significant bits of the size.
+ */
+#if MEM_ALIGN < 4
+#error "invalid alignment"
+#endif
+
+/*
+ * The fragmentation index is computed as a percentage, by multiplying
+ * sizes, bounded by the heap size, by 100. Make sure this can't overflow.
+ */
+#if MEM_HEAP_SIZE > (0xffffffff / 100)
+#error "heap size too large for statistics"
+#endif
+
+/*
+ * Number of entries in the allocation size histogram.
+ *
+ * Entry i counts allocation requests of sizes in the [2^i, 2^(i + 1))
+ * range, so that there is one entry per bit in a size.
+ */
+#define MEM_STATS_HISTOGRAM_SIZE (sizeof(size_t) * CHAR_BIT)
+
+/*
+ * Maximum number of bytes zeroed per call to mem_idle_zero().
+ *
+ * Chunks are zeroed with preemption disabled, so this bounds the
+ * scheduling latency added by background zeroing.
+ */
+#define MEM_IDLE_ZERO_CHUNK_SIZE 4096
+
+/*
+ * Masks applied on boundary tags to extract the size and the flags.
+ *
+ * Flags are only meaningful in headers. Footers only store sizes.
  */
 #define MEM_BTAG_ALLOCATED_MASK ((size_t)0x1)
-#define MEM_BTAG_SIZE_MASK      (~MEM_BTAG_ALLOCATED_MASK)
+#define MEM_BTAG_PREV_FREE_MASK ((size_t)0x2)
+#define MEM_BTAG_FLAGS_MASK     (MEM_BTAG_ALLOCATED_MASK \
+                                 | MEM_BTAG_PREV_FREE_MASK)
+#define MEM_BTAG_SIZE_MASK      (~MEM_BTAG_FLAGS_MASK)
 
 /*
  * Boundary tag.
@@ -192,7 +297,8 @@
  * This is a check that would best be performed with C11 static assertions.
  *
  * In addition, the alignment constraint implies that the least significant
- * bit is always 0. Therefore, this bit is used to store the allocation flag.
+ * bits are always 0. Therefore, these bits are used to store the allocation
+ * and "previous block free" flags.
  */
 struct mem_btag {
     size_t value __aligned(MEM_ALIGN);
@@ -223,13 +329,40 @@ struct mem_free_node {
 /*
  * List of free nodes.
  *
- * Here is an example of a TODO entry, a method used to store and retrieve
- * pending tasks using source code only :
- *
- * TODO Statistics counters.
+ * In addition to the list itself, the number of free blocks and their total
+ * size are tracked. Since blocks are always added to and removed from the
+ * free list as they're split and merged, maintaining these counters only
+ * costs an addition per operation.
  */
 struct mem_free_list {
     struct list free_nodes;
+    size_t nr_blocks;
+    size_t size;
+};
+
+/*
+ * Allocator statistics.
+ *
+ * The allocated size includes boundary tags, and is the complement of
+ * the free list size. Sizes in the histogram are allocation request
+ * sizes, as passed by users.
+ *
+ * Contentions are counted each time a thread finds the allocator mutex
+ * locked. This is a good hint of how much the single global lock hurts.
+ *
+ * Zeroed allocations are clean when the block was entirely zeroed in
+ * advance, and only needed its free list node and footer cleared.
+ */
+struct mem_stats {
+    size_t peak_allocated;
+    unsigned long nr_allocs;
+    unsigned long nr_zeroed_allocs;
+    unsigned long nr_clean_allocs;
+    unsigned long nr_failed_allocs;
+    unsigned long nr_frees;
+    unsigned long nr_reallocs;
+    unsigned long nr_contentions;
+    unsigned long histogram[MEM_STATS_HISTOGRAM_SIZE];
 };
 
 /*
@@ -259,6 +392,13 @@ static struct mem_free_list mem_free_list;
  */
 static struct mutex mem_mutex;
 
+/*
+ * Allocator statistics.
+ *
+ * The allocator mutex must be locked when accessing statistics.
+ */
+static struct mem_stats mem_stats;
+
 static bool
 mem_aligned(size_t value)
 {
@@ -289,6 +429,24 @@ mem_btag_clear_allocated(struct mem_btag *btag)
     btag->value &= ~MEM_BTAG_ALLOCATED_MASK;
 }
 
+static bool
+mem_btag_prev_free(const struct mem_btag *btag)
+{
+    return btag->value & MEM_BTAG_PREV_FREE_MASK;
+}
+
+static void
+mem_btag_set_prev_free(struct mem_btag *btag)
+{
+    btag->value |= MEM_BTAG_PREV_FREE_MASK;
+}
+
+static void
+mem_btag_clear_prev_free(struct mem_btag *btag)
+{
+    btag->value &= ~MEM_BTAG_PREV_FREE_MASK;
+}
+
 static size_t
 mem_btag_size(const struct mem_btag *btag)
 {
@@ -302,6 +460,13 @@ mem_btag_init(struct mem_btag *btag, size_t size)
     mem_btag_set_allocated(btag);
 }
 
+static void
+mem_btag_set_size(struct mem_btag *btag, size_t size)
+{
+    assert((size & MEM_BTAG_FLAGS_MASK) == 0);
+    btag->value = (btag->value & MEM_BTAG_FLAGS_MASK) | size;
+}
+
 static size_t
 mem_block_size(const struct mem_block *block)
 {
@@ -360,6 +525,12 @@ mem_block_header_btag(struct mem_block *block)
     return &block->btag;
 }
 
+/*
+ * Return the footer of a block.
+ *
+ * Only free blocks have a footer. In allocated blocks, this memory is part
+ * of the payload.
+ */
 static struct mem_btag *
 mem_block_footer_btag(struct mem_block *block)
 {
@@ -383,16 +554,25 @@ mem_block_footer_btag(struct mem_block *block)
     return &btag[-1];
 }
 
+/*
+ * Return the previous block, if free.
+ *
+ * The footer of the previous block is only valid if that block is free.
+ * Since merging is the only reason to look up the previous block, NULL
+ * is returned if it's allocated.
+ */
 static struct mem_block *
-mem_block_prev(struct mem_block *block)
+mem_block_prev_free(struct mem_block *block)
 {
     struct mem_btag *btag;
 
-    if ((char *)block == mem_heap) {
+    btag = mem_block_header_btag(block);
+
+    if (!mem_btag_prev_free(btag)) {
         return NULL;
     }
 
-    btag = mem_block_header_btag(block);
+    assert((char *)block != mem_heap);
     return (struct mem_block *)((char *)block - mem_btag_size(&btag[-1]));
 }
 
@@ -414,25 +594,65 @@ mem_block_allocated(struct mem_block *block)
     return mem_btag_allocated(mem_block_header_btag(block));
 }
 
+/*
+ * Mark a block allocated.
+ *
+ * The footer of the block becomes part of the payload, and the next block
+ * is updated to reflect that its predecessor isn't free any more.
+ */
 static void
 mem_block_set_allocated(struct mem_block *block)
 {
+    struct mem_block *next;
+
     mem_btag_set_allocated(mem_block_header_btag(block));
-    mem_btag_set_allocated(mem_block_footer_btag(block));
+    next = mem_block_next(block);
+
+    if (next) {
+        mem_btag_clear_prev_free(mem_block_header_btag(next));
+    }
 }
 
+/*
+ * Mark a block free.
+ *
+ * The footer of the block is written, and the next block is updated to
+ * reflect that its predecessor is free.
+ */
 static void
 mem_block_clear_allocated(struct mem_block *block)
 {
+    struct mem_block *next;
+
     mem_btag_clear_allocated(mem_block_header_btag(block));
-    mem_btag_clear_allocated(mem_block_footer_btag(block));
+    mem_block_footer_btag(block)->value = mem_block_size(block);
+    next = mem_block_next(block);
+
+    if (next) {
+        mem_btag_set_prev_free(mem_block_header_btag(next));
+    }
 }
 
+/*
+ * Initialize a new allocated block.
+ *
+ * New blocks are created at the beginning of the heap, or by splitting,
+ * in which case the previous block is allocated.
+ */
 static void
 mem_block_init(struct mem_block *block, size_t size)
 {
     mem_btag_init(mem_block_header_btag(block), size);
-    mem_btag_init(mem_block_footer_btag(block), size);
+}
+
+/*
+ * Change the size of an allocated block, preserving its flags.
+ */
+static void
+mem_block_resize(struct mem_block *block, size_t size)
+{
+    assert(mem_block_allocated(block));
+    mem_btag_set_size(mem_block_header_btag(block), size);
 }
 
 static void *
@@ -448,6 +668,104 @@ mem_block_get_free_node(struct mem_block *block)
     return mem_block_payload(block);
 }
 
+/*
+ * Return the address where the clean part of a block may start.
+ *
+ * The block may be allocated, since this function is also used to compute
+ * which bytes to zero when a free block is allocated.
+ */
+static char *
+mem_block_clean_start(struct mem_block *block)
+{
+    return (char *)mem_block_payload(block) + sizeof(struct mem_free_node);
+}
+
+static bool
+mem_block_tracked(struct mem_block *block)
+{
+    return mem_block_size(block) >= MEM_BLOCK_MIN_TRACKED_SIZE;
+}
+
+/*
+ * Return the storage of the dirty end of a free block, right before its
+ * footer.
+ *
+ * The block must be large enough to track its clean part.
+ */
+static char **
+mem_block_dirty_end_slot(struct mem_block *block)
+{
+    assert(!mem_block_allocated(block));
+    assert(mem_block_tracked(block));
+    return (char **)mem_block_footer_btag(block) - 1;
+}
+
+/*
+ * Return the address where the clean part of a block ends.
+ *
+ * Bytes from this address up to the end of the block are always dirty.
+ * The block may be allocated, since this function is also used to compute
+ * which bytes to zero when a free block is allocated.
+ */
+static char *
+mem_block_clean_end(struct mem_block *block)
+{
+    if (!mem_block_tracked(block)) {
+        return mem_block_clean_start(block);
+    }
+
+    return (char *)mem_block_footer_btag(block) - sizeof(char *);
+}
+
+static char *
+mem_block_dirty_end(struct mem_block *block)
+{
+    if (!mem_block_tracked(block)) {
+        return mem_block_clean_start(block);
+    }
+
+    return *mem_block_dirty_end_slot(block);
+}
+
+/*
+ * Set the dirty end of a free block.
+ *
+ * The given address may be lower than the start of the clean part of the
+ * block, e.g. when inherited from a larger block that was split, in which
+ * case the block is entirely clean. It's ignored for blocks too small to
+ * track their clean part.
+ */
+static void
+mem_block_set_dirty_end(struct mem_block *block, char *dirty_end)
+{
+    char *clean_start;
+
+    if (!mem_block_tracked(block)) {
+        return;
+    }
+
+    clean_start = mem_block_clean_start(block);
+
+    if (dirty_end < clean_start) {
+        dirty_end = clean_start;
+    }
+
+    assert(dirty_end <= mem_block_clean_end(block));
+    *mem_block_dirty_end_slot(block) = dirty_end;
+}
+
+static bool
+mem_block_clean(struct mem_block *block)
+{
+    return mem_block_dirty_end(block) == mem_block_clean_start(block);
+}
+
+static size_t
+mem_block_clean_size(struct mem_block *block)
+{
+    return mem_block_clean_end(block) - mem_block_dirty_end(block);
+}
+
 static bool
 mem_block_inside_heap(const struct mem_block *block)
 {
@@ -467,6 +785,7 @@ mem_free_list_add(struct mem_free_list *list, struct mem_block *block)
     assert(mem_block_allocated(block));
 
     mem_block_clear_allocated(block);
+    mem_block_set_dirty_end(block, mem_block_clean_end(block));
     free_node = mem_block_get_free_node(block);
 
     /*
@@ -481,6 +800,8 @@ mem_free_list_add(struct mem_free_list *list, struct mem_block *block)
      * to memory. This is an example of inexpensive micro-optimization.
      */
     list_insert_head(&list->free_nodes, &free_node->node);
+    list->nr_blocks++;
+    list->size += mem_block_size(block);
 }
 
 static void
@@ -488,13 +809,16 @@ mem_free_list_remove(struct mem_free_list *list, struct mem_block *block)
 {
     struct mem_free_node *free_node;
 
-    (void)list;
-
     assert(!mem_block_allocated(block));
 
     free_node = mem_block_get_free_node(block);
     list_remove(&free_node->node);
     mem_block_set_allocated(block);
+
+    assert(list->nr_blocks != 0);
+    assert(list->size >= mem_block_size(block));
+    list->nr_blocks--;
+    list->size -= mem_block_size(block);
 }
 
 static struct mem_block *
@@ -525,10 +849,159 @@ mem_free_list_find(struct mem_free_list *list, size_t size)
     return NULL;
 }
 
+static struct mem_block *
+mem_free_list_find_dirty(struct mem_free_list *list)
+{
+    struct mem_free_node *free_node;
+    struct mem_block *block;
+
+    /*
+     * Blocks released by users are inserted at the head of the list, which
+     * is where dirty blocks are most likely to be found.
+     */
+    list_for_each_entry(&list->free_nodes, free_node, node) {
+        block = mem_block_from_payload(free_node);
+
+        if (!mem_block_clean(block)) {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+static size_t
+mem_free_list_clean_size(const struct mem_free_list *list)
+{
+    struct mem_free_node *free_node;
+    size_t size;
+
+    size = 0;
+
+    list_for_each_entry(&list->free_nodes, free_node, node) {
+        size += mem_block_clean_size(mem_block_from_payload(free_node));
+    }
+
+    return size;
+}
+
+static size_t
+mem_free_list_largest(const struct mem_free_list *list)
+{
+    struct mem_free_node *free_node;
+    struct mem_block *block;
+    size_t largest;
+
+    largest = 0;
+
+    list_for_each_entry(&list->free_nodes, free_node, node) {
+        block = mem_block_from_payload(free_node);
+
+        if (mem_block_size(block) > largest) {
+            largest = mem_block_size(block);
+        }
+    }
+
+    return largest;
+}
+
 static void
 mem_free_list_init(struct mem_free_list *list)
 {
     list_init(&list->free_nodes);
+    list->nr_blocks = 0;
+    list->size = 0;
+}
+
+static size_t
+mem_allocated_size(void)
+{
+    return sizeof(mem_heap) - mem_free_list.size;
+}
+
+static unsigned int
+mem_stats_histogram_index(size_t size)
+{
+    assert(size != 0);
+
+    /*
+     * The index is the position of the most significant bit set, i.e. the
+     * base 2 logarithm of the size, rounded down. The builtin function
+     * counts leading zeroes, and is normally implemented with a single
+     * instruction (BSR on x86).
+     */
+    return (MEM_STATS_HISTOGRAM_SIZE - 1) - __builtin_clzl(size);
+}
+
+static void
+mem_stats_update_peak(struct mem_stats *stats)
+{
+    size_t allocated;
+
+    allocated = mem_allocated_size();
+
+    if (allocated > stats->peak_allocated) {
+        stats->peak_allocated = allocated;
+    }
+}
+
+static void
+mem_stats_record_alloc(struct mem_stats *stats, size_t size, bool success)
+{
+    stats->nr_allocs++;
+    stats->histogram[mem_stats_histogram_index(size)]++;
+
+    if (success) {
+        mem_stats_update_peak(stats);
+    } else {
+        stats->nr_failed_allocs++;
+    }
+}
+
+static void
+mem_stats_record_zeroed_alloc(struct mem_stats *stats, bool clean)
+{
+    stats->nr_zeroed_allocs++;
+
+    if (clean) {
+        stats->nr_clean_allocs++;
+    }
+}
+
+static void
+mem_stats_record_free(struct mem_stats *stats)
+{
+    stats->nr_frees++;
+}
+
+static void
+mem_stats_record_realloc(struct mem_stats *stats)
+{
+    stats->nr_reallocs++;
+    mem_stats_update_peak(stats);
+}
+
+static void
+mem_lock(void)
+{
+    int error;
+
+    /*
+     * Try to lock first, in order to detect contention. This only adds
+     * a few instructions to the uncontended case.
+     */
+    error = mutex_trylock(&mem_mutex);
+
+    if (error) {
+        mutex_lock(&mem_mutex);
+        mem_stats.nr_contentions++;
+    }
+}
+
+static void
+mem_unlock(void)
+{
+    mutex_unlock(&mem_mutex);
 }
 
 static bool
@@ -558,7 +1031,7 @@ mem_block_split(struct mem_block *block, size_t size)
     }
 
     total_size = mem_block_size(block);
-    mem_block_init(block, size);
+    mem_block_resize(block, size);
     block2 = mem_block_end(block);
     mem_block_init(block2, total_size - size);
 
@@ -568,6 +1041,8 @@ mem_block_split(struct mem_block *block, size_t size)
 static struct mem_block *
 mem_block_merge(struct mem_block *block1, struct mem_block *block2)
 {
+    struct mem_block *upper;
+    char *dirty_end, *boundary, *clean_start;
     size_t size;
 
     assert(!mem_block_overlap(block1, block2));
@@ -576,19 +1051,119 @@ mem_block_merge(struct mem_block *block1, struct mem_block *block2)
         return NULL;
     }
 
-    mem_free_list_remove(&mem_free_list, block1);
-    mem_free_list_remove(&mem_free_list, block2);
-    size = mem_block_size(block1) + mem_block_size(block2);
-
     if (block1 > block2) {
+        upper = block1;
         block1 = block2;
+    } else {
+        upper = block2;
     }
 
-    mem_block_init(block1, size);
+    /*
+     * The merged block is clean from the dirty end of the upper block,
+     * unless the upper block is clean, in which case the memory between
+     * both clean parts is zeroed, so that the merged block is clean from
+     * the dirty end of the lower block.
+     */
+    boundary = mem_block_clean_end(block1);
+    clean_start = mem_block_clean_start(upper);
+
+    if (mem_block_clean(upper)) {
+        dirty_end = mem_block_dirty_end(block1);
+    } else {
+        dirty_end = mem_block_dirty_end(upper);
+        boundary = NULL;
+    }
+
+    mem_free_list_remove(&mem_free_list, block1);
+    mem_free_list_remove(&mem_free_list, upper);
+    size = mem_block_size(block1) + mem_block_size(upper);
+    mem_block_resize(block1, size);
     mem_free_list_add(&mem_free_list, block1);
+
+    if (boundary) {
+        memset(boundary, 0, clean_start - boundary);
+    }
+
+    mem_block_set_dirty_end(block1, dirty_end);
     return block1;
 }
 
+static size_t
+mem_block_payload_size(const struct mem_block *block)
+{
+    return mem_block_size(block) - sizeof(struct mem_btag);
+}
+
+/*
+ * Release the tail of an allocated block so that only size bytes remain.
+ *
+ * The tail, if large enough to form a block, is returned to the free list
+ * and merged with its successor, if free. Since the successor of an
+ * allocated block can't be merged with anything else (free blocks are
+ * always fully merged), a single merge is enough.
+ */
+static void
+mem_block_shrink(struct mem_block *block, size_t size)
+{
+    struct mem_block *block2, *next;
+
+    block2 = mem_block_split(block, size);
+
+    if (block2 == NULL) {
+        return;
+    }
+
+    mem_free_list_add(&mem_free_list, block2);
+    next = mem_block_next(block2);
+
+    if (next) {
+        mem_block_merge(block2, next);
+    }
+}
+
+/*
+ * Attempt to grow an allocated block in place, by absorbing its successor.
+ *
+ * Return true on success, in which case the block is at least size bytes
+ * large.
+ */
+static bool
+mem_block_grow(struct mem_block *block, size_t size)
+{
+    struct mem_block *next, *block2;
+    size_t total_size;
+    char *dirty_end;
+
+    next = mem_block_next(block);
+
+    if ((next == NULL) || mem_block_allocated(next)) {
+        return false;
+    }
+
+    total_size = mem_block_size(block) + mem_block_size(next);
+
+    if (total_size < size) {
+        return false;
+    }
+
+    /*
+     * The successor of a free block is always allocated, so the tail of
+     * the grown block, if any, can't be merged, and simply keeps the clean
+     * part of the absorbed block.
+     */
+    dirty_end = mem_block_dirty_end(next);
+    mem_free_list_remove(&mem_free_list, next);
+    mem_block_resize(block, total_size);
+    block2 = mem_block_split(block, size);
+
+    if (block2 != NULL) {
+        mem_free_list_add(&mem_free_list, block2);
+        mem_block_set_dirty_end(block2, dirty_end);
+    }
+
+    return true;
+}
+
 void
 mem_setup(void)
 {
@@ -598,19 +1173,36 @@ mem_setup(void)
     mem_block_init(block, sizeof(mem_heap));
     mem_free_list_init(&mem_free_list);
     mem_free_list_add(&mem_free_list, block);
+
+    /*
+     * The heap is allocated out of the bss section, and is initially
+     * filled with zeroes.
+     */
+    mem_block_set_dirty_end(block, mem_block_clean_start(block));
+
     mutex_init(&mem_mutex);
 }
 
+/*
+ * Convert an allocation request size into a block size.
+ *
+ * Return 0 if the request is so large that the block size would wrap
+ * around, in which case the request must fail.
+ */
 static size_t
 mem_convert_to_block_size(size_t size)
 {
+    if (size > (SIZE_MAX - MEM_ALIGN - sizeof(struct mem_btag))) {
+        return 0;
+    }
+
     /*
      * Make sure all blocks have a correctly aligned size. That, and the fact
      * that the heap address is also aligned, means all block addresses are
      * aligned.
      */
     size = P2ROUND(size, MEM_ALIGN);
-    size += sizeof(struct mem_btag) * 2;
+    size += sizeof(struct mem_btag);
 
     if (size < MEM_BLOCK_MIN_SIZE) {
         size = MEM_BLOCK_MIN_SIZE;
@@ -619,60 +1211,188 @@ mem_convert_to_block_size(size_t size)
     return size;
 }
 
-void *
-mem_alloc(size_t size)
+/*
+ * Common allocation function.
+ *
+ * If zero is true, the payload of the allocated block is zeroed. Only the
+ * part that isn't already known to be zero is actually written, outside
+ * the critical section, since the block is owned by the caller at that
+ * point.
+ */
+static void *
+mem_alloc_common(size_t size, bool zero)
 {
     struct mem_block *block, *block2;
+    char *dirty_end, *clean_end, *end;
+    size_t block_size;
     void *ptr;
 
     if (size == 0) {
         return NULL;
     }
 
-    size = mem_convert_to_block_size(size);
+    block_size = mem_convert_to_block_size(size);
+
+    if (block_size == 0) {
+        return NULL;
+    }
 
-    mutex_lock(&mem_mutex);
+    mem_lock();
 
-    block = mem_free_list_find(&mem_free_list, size);
+    block = mem_free_list_find(&mem_free_list, block_size);
 
     if (block == NULL) {
-        mutex_unlock(&mem_mutex);
+        mem_stats_record_alloc(&mem_stats, size, false);
+        mem_unlock();
         return NULL;
     }
 
+    dirty_end = mem_block_dirty_end(block);
+    clean_end = mem_block_clean_end(block);
     mem_free_list_remove(&mem_free_list, block);
-    block2 = mem_block_split(block, size);
+    block2 = mem_block_split(block, block_size);
 
     if (block2 != NULL) {
         mem_free_list_add(&mem_free_list, block2);
+        mem_block_set_dirty_end(block2, dirty_end);
     }
 
-    mutex_unlock(&mem_mutex);
+    mem_stats_record_alloc(&mem_stats, size, true);
+
+    if (zero) {
+        mem_stats_record_zeroed_alloc(&mem_stats, dirty_end
+                                      == mem_block_clean_start(block));
+    }
+
+    mem_unlock();
 
     ptr = mem_block_payload(block);
     assert(mem_aligned((uintptr_t)ptr));
+
+    if (zero) {
+        end = mem_block_end(block);
+
+        /*
+         * When the block isn't split, the bytes from its clean end, always
+         * dirty, become part of the payload.
+         */
+        if (block2 == NULL) {
+            memset(clean_end, 0, end - clean_end);
+        }
+
+        memset(ptr, 0, MIN(dirty_end, end) - (char *)ptr);
+    }
+
     return ptr;
 }
 
-void
-mem_free(void *ptr)
+void *
+mem_alloc(size_t size)
 {
-    struct mem_block *block, *tmp;
+    void *ptr;
 
-    if (!ptr) {
-        return;
+    ptr = mem_alloc_common(size, false);
+
+    if (ptr) {
+        memprof_alloc(ptr, size);
     }
 
-    assert(mem_aligned((uintptr_t)ptr));
+    return ptr;
+}
 
-    block = mem_block_from_payload(ptr);
-    assert(mem_block_inside_heap(block));
+void *
+mem_calloc(size_t nmemb, size_t size)
+{
+    void *ptr;
+
+    /*
+     * Only the multiplication is checked here. Products too large to be
+     * converted into a block size are rejected like any other request.
+     */
+    if ((size != 0) && (nmemb > (SIZE_MAX / size))) {
+        return NULL;
+    }
+
+    ptr = mem_alloc_common(nmemb * size, true);
+
+    if (ptr) {
+        memprof_alloc(ptr, nmemb * size);
+    }
+
+    return ptr;
+}
+
+bool
+mem_idle_zero(void)
+{
+    struct mem_block *block;
+    char *start, *end;
+    int error;
+
+    /*
+     * The idle thread may never sleep, since the scheduler expects it to
+     * always be ready to run, hence the trylock.
+     *
+     * In addition, the idle thread only runs when no other thread can,
+     * and mutexes don't implement priority inheritance, so if it were
+     * preempted while holding the allocator lock, all allocating threads
+     * would have to wait until the system becomes idle again. Preemption
+     * is therefore disabled while holding the lock, which keeps it for
+     * the bounded time needed to zero one chunk.
+     */
+    thread_preempt_disable();
+
+    error = mutex_trylock(&mem_mutex);
+
+    if (error) {
+        thread_preempt_enable();
+        return false;
+    }
+
+    block = mem_free_list_find_dirty(&mem_free_list);
+
+    if (block == NULL) {
+        mem_unlock();
+        thread_preempt_enable();
+        return false;
+    }
+
+    /*
+     * Zero the block backwards, from its dirty end, so that progress is
+     * recorded by simply moving the dirty end down. Large blocks are zeroed
+     * in chunks, to keep the allocator lock held only briefly.
+     */
+    start = mem_block_clean_start(block);
+    end = mem_block_dirty_end(block);
+
+    if ((size_t)(end - start) > MEM_IDLE_ZERO_CHUNK_SIZE) {
+        start = end - MEM_IDLE_ZERO_CHUNK_SIZE;
+    }
+
+    memset(start, 0, end - start);
+    mem_block_set_dirty_end(block, start);
+
+    mem_unlock();
+    thread_preempt_enable();
+    return true;
+}
+
+/*
+ * Common release function.
+ *
+ * Like mem_alloc_common(), it doesn't report to the profiler, which is
+ * left to the callers.
+ */
+static void
+mem_free_common(struct mem_block *block)
+{
+    struct mem_block *tmp;
 
-    mutex_lock(&mem_mutex);
+    mem_lock();
 
     mem_free_list_add(&mem_free_list, block);
 
-    tmp = mem_block_prev(block);
+    tmp = mem_block_prev_free(block);
 
     if (tmp) {
         tmp = mem_block_merge(block, tmp);
@@ -688,5 +1408,244 @@ mem_free(void *ptr)
         mem_block_merge(block, tmp);
     }
 
-    mutex_unlock(&mem_mutex);
+    mem_stats_record_free(&mem_stats);
+
+    mem_unlock();
+}
+
+void
+mem_free(void *ptr)
+{
+    struct mem_block *block;
+
+    if (!ptr) {
+        return;
+    }
+
+    assert(mem_aligned((uintptr_t)ptr));
+
+    block = mem_block_from_payload(ptr);
+    assert(mem_block_inside_heap(block));
+
+    memprof_free(ptr);
+    mem_free_common(block);
+}
+
+void *
+mem_realloc(void *ptr, size_t size)
+{
+    struct mem_block *block;
+    size_t block_size;
+    void *new_ptr;
+    bool resized;
+
+    /*
+     * Report allocations directly from this function rather than through
+     * mem_alloc(), so that the profiler records the backtrace of the caller.
+     */
+    if (!ptr) {
+        new_ptr = mem_alloc_common(size, false);
+        memprof_alloc(new_ptr, size);
+        return new_ptr;
+    }
+
+    if (size == 0) {
+        mem_free(ptr);
+        return NULL;
+    }
+
+    assert(mem_aligned((uintptr_t)ptr));
+
+    block = mem_block_from_payload(ptr);
+    assert(mem_block_inside_heap(block));
+
+    block_size = mem_convert_to_block_size(size);
+
+    if (block_size == 0) {
+        return NULL;
+    }
+
+    mem_lock();
+
+    /*
+     * Resizing in place is always preferred, since it avoids copying the
+     * payload, and keeps the address of the block stable, which is friendly
+     * to the processor cache. Shrinking can always be done in place, and
+     * growing is possible when the next block is free and large enough.
+     */
+    if (block_size <= mem_block_size(block)) {
+        mem_block_shrink(block, block_size);
+        resized = true;
+    } else {
+        resized = mem_block_grow(block, block_size);
+    }
+
+    if (resized) {
+        mem_stats_record_realloc(&mem_stats);
+    }
+
+    mem_unlock();
+
+    /*
+     * The block changed size, so consider it freed from the point of view
+     * of the profiler, and allocated again.
+     */
+    if (resized) {
+        memprof_free(ptr);
+        memprof_alloc(ptr, size);
+        return ptr;
+    }
+
+    /*
+     * As a last resort, allocate a new block and copy the payload. Note that
+     * the old block is only released once the copy is complete, so it can't
+     * be merged with a free predecessor to form the new block, as a more
+     * elaborate implementation could do with memmove().
+     *
+     * The profiler is only told about the change once it's known to succeed,
+     * so that a failed request leaves the original block profiled.
+     */
+    new_ptr = mem_alloc_common(size, false);
+
+    if (!new_ptr) {
+        return NULL;
+    }
+
+    memcpy(new_ptr, ptr, mem_block_payload_size(block));
+    memprof_free(ptr);
+    mem_free_common(block);
+    memprof_alloc(new_ptr, size);
+    return new_ptr;
+}
+
+static void
+mem_get_usage_locked(struct mem_usage *usage)
+{
+    usage->heap_size = sizeof(mem_heap);
+    usage->allocated = mem_allocated_size();
+    usage->free_size = mem_free_list.size;
+    usage->nr_free_blocks = mem_free_list.nr_blocks;
+    usage->largest_free_block = mem_free_list_largest(&mem_free_list);
+    usage->clean_size = mem_free_list_clean_size(&mem_free_list);
+
+    if (usage->free_size == 0) {
+        usage->fragmentation = 0;
+    } else {
+        usage->fragmentation = ((usage->free_size - usage->largest_free_block)
+                                * 100) / usage->free_size;
+    }
+}
+
+void
+mem_get_usage(struct mem_usage *usage)
+{
+    mem_lock();
+    mem_get_usage_locked(usage);
+    mem_unlock();
+}
+
+static void
+mem_info(bool raw)
+{
+    struct mem_stats stats;
+    struct mem_usage usage;
+
+    /*
+     * Take a snapshot of the statistics while holding the lock, and print
+     * them after releasing it, since printing to the console is slow.
+     */
+    mem_lock();
+    stats = mem_stats;
+    mem_get_usage_locked(&usage);
+    mem_unlock();
+
+    if (raw) {
+        printf("heap_size %zu\n"
+               "allocated %zu\n"
+               "peak_allocated %zu\n"
+               "free %zu\n"
+               "nr_free_blocks %zu\n"
+               "largest_free_block %zu\n"
+               "fragmentation %u\n"
+               "clean %zu\n"
+               "nr_allocs %lu\n"
+               "nr_failed_allocs %lu\n"
+               "nr_zeroed_allocs %lu\n"
+               "nr_clean_allocs %lu\n"
+               "nr_frees %lu\n"
+               "nr_reallocs %lu\n"
+               "nr_contentions %lu\n",
+               usage.heap_size, usage.allocated, stats.peak_allocated,
+               usage.free_size, usage.nr_free_blocks, usage.largest_free_block,
+               usage.fragmentation, usage.clean_size, stats.nr_allocs,
+               stats.nr_failed_allocs, stats.nr_zeroed_allocs,
+               stats.nr_clean_allocs, stats.nr_frees, stats.nr_reallocs,
+               stats.nr_contentions);
+
+        for (size_t i = 0; i < ARRAY_SIZE(stats.histogram); i++) {
+            printf("histogram_%zu %lu\n", i, stats.histogram[i]);
+        }
+
+        return;
+    }
+
+    printf("mem: heap size:          %zu\n"
+           "mem: allocated:          %zu (peak: %zu)\n"
+           "mem: free:               %zu in %zu block(s)\n"
+           "mem: largest free block: %zu\n"
+           "mem: fragmentation:      %u%%\n"
+           "mem: clean free memory:  %zu\n"
+           "mem: allocations:        %lu (failed: %lu)\n"
+           "mem: zeroed allocations: %lu (clean: %lu)\n"
+           "mem: frees:              %lu\n"
+           "mem: reallocations:      %lu\n"
+           "mem: lock contentions:   %lu\n"
+           "mem: allocation sizes:\n",
+           usage.heap_size, usage.allocated, stats.peak_allocated,
+           usage.free_size, usage.nr_free_blocks, usage.largest_free_block,
+           usage.fragmentation, usage.clean_size, stats.nr_allocs,
+           stats.nr_failed_allocs, stats.nr_zeroed_allocs,
+           stats.nr_clean_allocs, stats.nr_frees, stats.nr_reallocs,
+           stats.nr_contentions);
+
+    for (size_t i = 0; i < ARRAY_SIZE(stats.histogram); i++) {
+        if (stats.histogram[i] == 0) {
+            continue;
+        }
+
+        printf("mem:   %10zu - %-10zu %lu\n",
+               (size_t)1 << i, ((size_t)1 << i) + (((size_t)1 << i) - 1),
+               stats.histogram[i]);
+    }
+}
+
+static void
+mem_shell_info(struct shell *shell, int argc, char **argv)
+{
+    bool raw;
+
+    if (argc == 1) {
+        raw = false;
+    } else if ((argc == 2) && (strcmp(argv[1], "-r") == 0)) {
+        raw = true;
+    } else {
+        shell_printf(shell, "meminfo: error: invalid arguments\n");
+        return;
+    }
+
+    mem_info(raw);
+}
+
+static struct shell_cmd mem_shell_cmds[] = {
+    SHELL_CMD_INITIALIZER2("meminfo", mem_shell_info,
+        "meminfo [-r]",
+        "display memory allocator statistics",
+        "Options:\n"
+        "  -r  raw mode, one \"name value\" pair per line, for scripts"),
+};
+
+void
+mem_setup_shell(void)
+{
+    SHELL_REGISTER_CMDS(mem_shell_cmds, main_get_shell_cmd_set());
 }
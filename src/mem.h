@@ -30,13 +30,41 @@
 #ifndef MEM_H
 #define MEM_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
+/*
+ * Heap usage summary.
+ *
+ * Sizes include boundary tags. The fragmentation index is the percentage
+ * of free memory that can't be used to serve an allocation request of the
+ * largest possible size. A value of 0 means all free memory is available
+ * as a single block. The clean size is the amount of free memory known
+ * to be filled with zeroes (see mem_calloc()).
+ */
+struct mem_usage {
+    size_t heap_size;
+    size_t allocated;
+    size_t free_size;
+    size_t nr_free_blocks;
+    size_t largest_free_block;
+    unsigned int fragmentation;
+    size_t clean_size;
+};
+
 /*
  * Initialize the mem module.
  */
 void mem_setup(void);
 
+/*
+ * Register the shell commands of the mem module.
+ *
+ * This function may only be called once the main shell command set is
+ * initialized.
+ */
+void mem_setup_shell(void);
+
 /*
  * Allocate memory.
  *
@@ -89,4 +117,53 @@ void * mem_alloc(size_t size);
  */
 void mem_free(void *ptr);
 
+/*
+ * Allocate zeroed memory.
+ *
+ * This function conforms to the specification of the standard calloc()
+ * function, i.e. it allocates an array of nmemb elements of the given
+ * size, filled with zeroes. If the total size overflows, NULL is returned.
+ *
+ * Free memory is zeroed in the background by the idle thread, so that
+ * zeroing is usually skipped for most of the allocated block.
+ */
+void * mem_calloc(size_t nmemb, size_t size);
+
+/*
+ * Resize memory.
+ *
+ * This function conforms to the specification of the standard realloc()
+ * function, i.e. :
+ *  - If ptr is NULL, it behaves like mem_alloc().
+ *  - If size is 0 and ptr isn't NULL, it behaves like mem_free(), and
+ *    returns NULL.
+ *  - Otherwise, the content of the block is preserved up to the minimum
+ *    of the old and new sizes, and the returned value is the address of
+ *    the resized block, which may differ from ptr.
+ *  - If resizing fails, NULL is returned and the original block is left
+ *    untouched.
+ *
+ * The block is resized in place whenever possible, i.e. when shrinking,
+ * or when growing into a free neighbor block. Copying only occurs when
+ * a new block must be allocated.
+ */
+void * mem_realloc(void *ptr, size_t size);
+
+/*
+ * Obtain a summary of the current heap usage.
+ *
+ * Obtaining the size of the largest free block requires walking the free
+ * list, so this function is linear in the number of free blocks.
+ */
+void mem_get_usage(struct mem_usage *usage);
+
+/*
+ * Zero a chunk of free memory.
+ *
+ * This function is meant to be called by the idle thread. It never blocks,
+ * and returns false if there was nothing to do, or if the allocator is
+ * busy, in which case the caller may idle the processor.
+ */
+bool mem_idle_zero(void);
+
 #endif /* MEM_H */
@@ -0,0 +1,560 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <lib/macros.h>
+#include <lib/shell.h>
+
+#include "main.h"
+#include "mem.h"
+#include "membench.h"
+#include "panic.h"
+#include "thread.h"
+#include "tick.h"
+#include "timer.h"
+
+#define MEMBENCH_NR_SLOTS       512
+#define MEMBENCH_RING_SIZE      64
+#define MEMBENCH_BURST_SIZE     64
+#define MEMBENCH_STACK_SIZE     4096
+
+#if !ISP2(MEMBENCH_RING_SIZE)
+#error "invalid ring size"
+#endif
+
+#define MEMBENCH_HIST_SIZE 32
+
+/*
+ * Latency histogram.
+ *
+ * Bucket i counts operations that took between 2^i and 2^(i+1) - 1 cycles.
+ */
+struct membench_hist {
+    unsigned long counts[MEMBENCH_HIST_SIZE];
+    unsigned long nr_ops;
+    unsigned long min;
+    unsigned long max;
+};
+
+/*
+ * Workload result.
+ *
+ * The producer/consumer workload is the only one where allocations and
+ * frees are made by different threads, which is why there is a histogram
+ * per operation type, so that each thread updates its own.
+ */
+struct membench_result {
+    struct membench_hist alloc_hist;
+    struct membench_hist free_hist;
+    unsigned long nr_failures;
+    unsigned long ticks;
+    unsigned int fragmentation;
+};
+
+struct membench_workload {
+    const char *name;
+    void (*fn)(struct membench_result *result, unsigned long nr_ops);
+};
+
+/*
+ * Benchmark state.
+ *
+ * Storage for pointers is static so that the benchmark itself doesn't
+ * use the heap. Workloads are run from a single thread at a time, i.e.
+ * the shell thread, or the main thread of the host program.
+ */
+static void *membench_slots[MEMBENCH_NR_SLOTS];
+static void *membench_long_lived[MEMBENCH_NR_SLOTS];
+static uint32_t membench_rand_state;
+
+/*
+ * Single-producer single-consumer ring used by the prodcons workload.
+ *
+ * The producer only writes the head index, and the consumer only writes
+ * the tail index, so that no lock is needed. Memory barriers order the
+ * accesses to an entry with regard to the publication of the matching
+ * index.
+ */
+static void *membench_ring[MEMBENCH_RING_SIZE];
+static unsigned long membench_ring_head;
+static unsigned long membench_ring_tail;
+
+static void
+membench_srand(void)
+{
+    membench_rand_state = 0x2545f491;
+}
+
+static uint32_t
+membench_rand(void)
+{
+    uint32_t x;
+
+    /* Marsaglia's xorshift32 generator */
+    x = membench_rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    membench_rand_state = x;
+    return x;
+}
+
+static size_t
+membench_rand_size(size_t min, size_t max)
+{
+    return min + (membench_rand() % (max - min + 1));
+}
+
+static inline uint64_t
+membench_cycles(void)
+{
+    return __builtin_ia32_rdtsc();
+}
+
+static void
+membench_hist_init(struct membench_hist *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+    hist->min = (unsigned long)-1;
+}
+
+static void
+membench_hist_add(struct membench_hist *hist, uint64_t cycles)
+{
+    unsigned long value;
+    unsigned int index;
+
+    value = (cycles > (unsigned long)-1) ? (unsigned long)-1 : cycles;
+    index = (value == 0) ? 0 : (sizeof(value) * 8) - __builtin_clzl(value) - 1;
+
+    if (index >= ARRAY_SIZE(hist->counts)) {
+        index = ARRAY_SIZE(hist->counts) - 1;
+    }
+
+    hist->counts[index]++;
+    hist->nr_ops++;
+
+    if (value < hist->min) {
+        hist->min = value;
+    }
+
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+static void
+membench_hist_merge(struct membench_hist *dest, const struct membench_hist *src)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(dest->counts); i++) {
+        dest->counts[i] += src->counts[i];
+    }
+
+    dest->nr_ops += src->nr_ops;
+    dest->min = MIN(dest->min, src->min);
+    dest->max = MAX(dest->max, src->max);
+}
+
+/*
+ * Return the upper bound of the bucket containing the given percentile.
+ */
+static unsigned long
+membench_hist_percentile(const struct membench_hist *hist, unsigned int pct)
+{
+    unsigned long threshold, sum;
+
+    threshold = ((hist->nr_ops / 100) * pct)
+                + (((hist->nr_ops % 100) * pct) / 100);
+    sum = 0;
+
+    for (size_t i = 0; i < ARRAY_SIZE(hist->counts); i++) {
+        sum += hist->counts[i];
+
+        if (sum >= threshold) {
+            return (2UL << i) - 1;
+        }
+    }
+
+    return hist->max;
+}
+
+static void *
+membench_alloc(struct membench_result *result, struct membench_hist *hist,
+               size_t size)
+{
+    uint64_t start;
+    void *ptr;
+
+    start = membench_cycles();
+    ptr = mem_alloc(size);
+    membench_hist_add(hist, membench_cycles() - start);
+
+    if (!ptr) {
+        result->nr_failures++;
+    }
+
+    return ptr;
+}
+
+static void
+membench_free(struct membench_hist *hist, void *ptr)
+{
+    uint64_t start;
+
+    start = membench_cycles();
+    mem_free(ptr);
+    membench_hist_add(hist, membench_cycles() - start);
+}
+
+static void
+membench_release(void **ptrs, size_t nr_ptrs)
+{
+    for (size_t i = 0; i < nr_ptrs; i++) {
+        mem_free(ptrs[i]);
+        ptrs[i] = NULL;
+    }
+}
+
+static unsigned int
+membench_fragmentation(void)
+{
+    struct mem_usage usage;
+
+    mem_get_usage(&usage);
+    return usage.fragmentation;
+}
+
+static void
+membench_churn_slots(struct membench_result *result, unsigned long nr_ops,
+                     size_t min_size, size_t max_size)
+{
+    size_t index;
+
+    for (unsigned long i = 0; i < nr_ops; i++) {
+        index = membench_rand() % ARRAY_SIZE(membench_slots);
+
+        if (membench_slots[index]) {
+            membench_free(&result->free_hist, membench_slots[index]);
+            membench_slots[index] = NULL;
+        } else {
+            membench_slots[index] = membench_alloc(result, &result->alloc_hist,
+                membench_rand_size(min_size, max_size));
+        }
+    }
+}
+
+static void
+membench_churn(struct membench_result *result, unsigned long nr_ops)
+{
+    membench_churn_slots(result, nr_ops, 1, 1024);
+    result->fragmentation = membench_fragmentation();
+    membench_release(membench_slots, ARRAY_SIZE(membench_slots));
+}
+
+static void
+membench_ring_push(void *ptr)
+{
+    unsigned long head;
+
+    head = membench_ring_head;
+
+    while ((head - __atomic_load_n(&membench_ring_tail, __ATOMIC_ACQUIRE))
+           == MEMBENCH_RING_SIZE) {
+        thread_yield();
+    }
+
+    membench_ring[head & (MEMBENCH_RING_SIZE - 1)] = ptr;
+    __atomic_store_n(&membench_ring_head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void *
+membench_ring_pop(void)
+{
+    unsigned long tail;
+    void *ptr;
+
+    tail = membench_ring_tail;
+
+    while (__atomic_load_n(&membench_ring_head, __ATOMIC_ACQUIRE) == tail) {
+        thread_yield();
+    }
+
+    ptr = membench_ring[tail & (MEMBENCH_RING_SIZE - 1)];
+    __atomic_store_n(&membench_ring_tail, tail + 1, __ATOMIC_RELEASE);
+    return ptr;
+}
+
+static void
+membench_consume(void *arg)
+{
+    struct membench_hist *hist;
+    void *ptr;
+
+    hist = arg;
+
+    /* A null pointer marks the end of the workload */
+    for (;;) {
+        ptr = membench_ring_pop();
+
+        if (!ptr) {
+            break;
+        }
+
+        membench_free(hist, ptr);
+    }
+}
+
+static void
+membench_prodcons(struct membench_result *result, unsigned long nr_ops)
+{
+    struct membench_hist free_hist;
+    struct thread *consumer;
+    void *ptr;
+    int error;
+
+    membench_ring_head = 0;
+    membench_ring_tail = 0;
+    membench_hist_init(&free_hist);
+
+    error = thread_create(&consumer, membench_consume, &free_hist,
+                          "membench", MEMBENCH_STACK_SIZE,
+                          THREAD_MIN_PRIORITY);
+
+    if (error) {
+        printf("membench: error: unable to create consumer thread\n");
+        return;
+    }
+
+    for (unsigned long i = 0; i < (nr_ops / 2); i++) {
+        ptr = membench_alloc(result, &result->alloc_hist,
+                             membench_rand_size(16, 512));
+
+        if (ptr) {
+            membench_ring_push(ptr);
+        }
+    }
+
+    membench_ring_push(NULL);
+    thread_join(consumer);
+
+    membench_hist_merge(&result->free_hist, &free_hist);
+    result->fragmentation = membench_fragmentation();
+}
+
+static void
+membench_pow2(struct membench_result *result, unsigned long nr_ops)
+{
+    unsigned int order;
+    size_t size;
+
+    order = 4;
+
+    for (unsigned long i = 0; i < nr_ops; i += MEMBENCH_BURST_SIZE * 2) {
+        size = (size_t)1 << order;
+
+        for (size_t j = 0; j < MEMBENCH_BURST_SIZE; j++) {
+            membench_slots[j] = membench_alloc(result, &result->alloc_hist,
+                                               size);
+        }
+
+        for (size_t j = 0; j < MEMBENCH_BURST_SIZE; j++) {
+            membench_free(&result->free_hist, membench_slots[j]);
+            membench_slots[j] = NULL;
+        }
+
+        order = (order == 12) ? 4 : (order + 1);
+    }
+
+    result->fragmentation = membench_fragmentation();
+}
+
+static void
+membench_frag(struct membench_result *result, unsigned long nr_ops)
+{
+    /*
+     * Interleave long-lived small blocks with short-lived medium ones,
+     * and release the latter, leaving holes that are too small for most
+     * of the following requests.
+     */
+    for (size_t i = 0; i < ARRAY_SIZE(membench_long_lived); i++) {
+        membench_slots[i] = mem_alloc(membench_rand_size(64, 256));
+        membench_long_lived[i] = mem_alloc(membench_rand_size(16, 64));
+    }
+
+    membench_release(membench_slots, ARRAY_SIZE(membench_slots));
+    membench_churn_slots(result, nr_ops, 256, 4096);
+    result->fragmentation = membench_fragmentation();
+    membench_release(membench_slots, ARRAY_SIZE(membench_slots));
+    membench_release(membench_long_lived, ARRAY_SIZE(membench_long_lived));
+}
+
+static const struct membench_workload membench_workloads[] = {
+    { "churn", membench_churn },
+    { "prodcons", membench_prodcons },
+    { "pow2", membench_pow2 },
+    { "frag", membench_frag },
+};
+
+static void
+membench_print_hist(const char *name, const struct membench_hist *hist)
+{
+    if (hist->nr_ops == 0) {
+        return;
+    }
+
+    printf("membench:   %s cycles: min: %lu p50: <%lu p99: <%lu max: %lu\n",
+           name, hist->min, membench_hist_percentile(hist, 50),
+           membench_hist_percentile(hist, 99), hist->max);
+
+    for (size_t i = 0; i < ARRAY_SIZE(hist->counts); i++) {
+        if (hist->counts[i] == 0) {
+            continue;
+        }
+
+        printf("membench:     %10lu - %-10lu %lu\n",
+               1UL << i, (2UL << i) - 1, hist->counts[i]);
+    }
+}
+
+static void
+membench_report(const struct membench_workload *workload,
+                const struct membench_result *result)
+{
+    unsigned long nr_ops, ticks;
+
+    nr_ops = result->alloc_hist.nr_ops + result->free_hist.nr_ops;
+
+    /*
+     * The tick resolution is coarse, make sure there is no division
+     * by zero for very short runs. Use enough operations to make
+     * the throughput meaningful.
+     */
+    ticks = (result->ticks == 0) ? 1 : result->ticks;
+
+    printf("membench: %s: %lu ops in %lu ms, %lu ops/s, "
+           "%lu failure(s), fragmentation: %u%%\n",
+           workload->name, nr_ops, (ticks * 1000) / tick_get_freq(),
+           (nr_ops / ticks) * tick_get_freq(), result->nr_failures,
+           result->fragmentation);
+    membench_print_hist("alloc", &result->alloc_hist);
+    membench_print_hist("free", &result->free_hist);
+}
+
+static void
+membench_run_workload(const struct membench_workload *workload,
+                      unsigned long nr_ops)
+{
+    struct membench_result result;
+    unsigned long start;
+
+    membench_hist_init(&result.alloc_hist);
+    membench_hist_init(&result.free_hist);
+    result.nr_failures = 0;
+    result.fragmentation = 0;
+
+    membench_srand();
+    start = timer_now();
+    workload->fn(&result, nr_ops);
+    result.ticks = timer_now() - start;
+
+    membench_report(workload, &result);
+}
+
+int
+membench_run(const char *name, unsigned long nr_ops)
+{
+    const struct membench_workload *workload;
+    bool all;
+    int error;
+
+    all = (strcmp(name, "all") == 0);
+    error = EINVAL;
+
+    for (size_t i = 0; i < ARRAY_SIZE(membench_workloads); i++) {
+        workload = &membench_workloads[i];
+
+        if (all || (strcmp(name, workload->name) == 0)) {
+            membench_run_workload(workload, nr_ops);
+            error = 0;
+        }
+    }
+
+    return error;
+}
+
+static void
+membench_shell_run(struct shell *shell, int argc, char **argv)
+{
+    const char *name;
+    unsigned long nr_ops;
+    int ret, error;
+
+    name = "all";
+    nr_ops = MEMBENCH_DEFAULT_NR_OPS;
+
+    if (argc > 3) {
+        goto error;
+    }
+
+    if (argc >= 2) {
+        name = argv[1];
+    }
+
+    if (argc == 3) {
+        ret = sscanf(argv[2], "%lu", &nr_ops);
+
+        if ((ret != 1) || (nr_ops == 0)) {
+            goto error;
+        }
+    }
+
+    error = membench_run(name, nr_ops);
+
+    if (error) {
+        goto error;
+    }
+
+    return;
+
+error:
+    shell_printf(shell, "membench: error: invalid arguments\n");
+}
+
+static struct shell_cmd membench_shell_cmds[] = {
+    SHELL_CMD_INITIALIZER2("membench", membench_shell_run,
+        "membench [workload [nr_ops]]",
+        "run memory allocator benchmarks",
+        "Workloads: all (default), churn, prodcons, pow2, frag.\n"
+        "The default number of operations is 100000."),
+};
+
+void
+membench_setup(void)
+{
+    SHELL_REGISTER_CMDS(membench_shell_cmds, main_get_shell_cmd_set());
+}
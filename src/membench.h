@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * Memory allocator benchmark.
+ *
+ * This module runs synthetic workloads against mem_alloc() and mem_free(),
+ * and reports their throughput, the distribution of the latency of each
+ * operation, in processor cycles, and the fragmentation of the heap at the
+ * end of each workload. The workloads are :
+ *  - churn : random-size allocations and frees on a fixed set of slots,
+ *    which keeps the heap in a steady state
+ *  - prodcons : a producer thread allocates blocks that a consumer thread
+ *    frees, which is a common pattern for messages passed between threads
+ *  - pow2 : bursts of allocations of the same power-of-two size, all
+ *    released at once, which stresses splitting and merging
+ *  - frag : churn of large blocks around long-lived small ones, which
+ *    measures how well free blocks are reused when the heap is fragmented
+ *
+ * Random sizes are obtained from a pseudo-random generator reseeded at the
+ * start of each workload, so that runs are reproducible and comparable.
+ *
+ * Latencies are measured with the time-stamp counter, and stored in
+ * histograms with power-of-two buckets, which keeps recording cheap and
+ * the results readable across many orders of magnitude. Note that, in
+ * a virtual machine, cycle counts may include time spent in the host.
+ *
+ * This module only depends on the allocator, thread creation and a few
+ * standard functions. It is also built as a regular Linux program (see
+ * membench_host.c), so that allocator changes can be compared without
+ * booting the kernel.
+ */
+
+#ifndef MEMBENCH_H
+#define MEMBENCH_H
+
+/*
+ * Default number of operations per workload.
+ */
+#define MEMBENCH_DEFAULT_NR_OPS 100000
+
+/*
+ * Register the shell commands of the membench module.
+ *
+ * This function may only be called once the main shell command set is
+ * initialized.
+ */
+void membench_setup(void);
+
+/*
+ * Run a workload, or all of them if name is "all".
+ *
+ * The number of operations is approximate, since workloads operate in
+ * steps that may include several operations.
+ *
+ * Return EINVAL if there is no workload with the given name.
+ */
+int membench_run(const char *name, unsigned long nr_ops);
+
+#endif /* MEMBENCH_H */
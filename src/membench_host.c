@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * Host program for the memory allocator benchmark.
+ *
+ * This file isn't part of the kernel. Along with the host environment
+ * (see host.c), it allows building the allocator and the benchmark as
+ * a regular Linux program with the membench_host Makefile target :
+ *
+ * $ make membench_host
+ * $ ./membench_host [workload [nr_ops]]
+ *
+ * Note that the host is a 64-bits system, where pointers and sizes are
+ * larger, and the allocator only guarantees 4-byte alignment, which x86
+ * tolerates. Absolute numbers therefore differ from the kernel, but
+ * relative comparisons between allocator versions remain meaningful.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mem.h"
+#include "membench.h"
+
+int
+main(int argc, char *argv[])
+{
+    const char *name;
+    unsigned long nr_ops;
+    int error;
+
+    name = (argc >= 2) ? argv[1] : "all";
+    nr_ops = (argc >= 3) ? strtoul(argv[2], NULL, 10)
+                         : MEMBENCH_DEFAULT_NR_OPS;
+
+    if ((argc > 3) || (nr_ops == 0)) {
+        goto error;
+    }
+
+    mem_setup();
+    error = membench_run(name, nr_ops);
+
+    if (error) {
+        goto error;
+    }
+
+    return EXIT_SUCCESS;
+
+error:
+    fprintf(stderr, "usage: %s [all|churn|prodcons|pow2|frag [nr_ops]]\n",
+            argv[0]);
+    return EXIT_FAILURE;
+}
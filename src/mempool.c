@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cpu.h"
+#include "mempool.h"
+#include "panic.h"
+#include "thread.h"
+
+#define MEMPOOL_STACK_SIZE 4096
+
+/*
+ * Pool watermarks.
+ *
+ * When the number of free buffers drops below the low watermark, the pool
+ * thread refills the pool up to the high watermark. Buffers released while
+ * the pool is at its high watermark are returned to the heap.
+ */
+#define MEMPOOL_LOW_WATERMARK   8
+#define MEMPOOL_HIGH_WATERMARK  32
+
+/*
+ * Free buffer.
+ *
+ * Free buffers are linked using their own storage. A singly-linked list
+ * is used since buffers are only ever pushed and popped at the head, and
+ * because a zeroed list is valid, which makes the pool usable, although
+ * always empty, before the module is initialized.
+ */
+struct mempool_buf {
+    struct mempool_buf *next;
+};
+
+/*
+ * Data shared between threads and interrupt handlers.
+ *
+ * Interrupts must be disabled when accessing these data.
+ */
+static struct mempool_buf *mempool_free_list;
+static unsigned int mempool_nr_free;
+static struct mempool_buf *mempool_deferred_list;
+static bool mempool_refill_needed;
+
+/*
+ * The pool thread, which provides context for heap operations.
+ */
+static struct thread *mempool_thread;
+
+static void
+mempool_push(struct mempool_buf **listp, struct mempool_buf *buf)
+{
+    assert(!cpu_intr_enabled());
+
+    buf->next = *listp;
+    *listp = buf;
+}
+
+static struct mempool_buf *
+mempool_pop(struct mempool_buf **listp)
+{
+    struct mempool_buf *buf;
+
+    assert(!cpu_intr_enabled());
+
+    buf = *listp;
+
+    if (buf) {
+        *listp = buf->next;
+    }
+
+    return buf;
+}
+
+static bool
+mempool_work_pending(void)
+{
+    assert(!cpu_intr_enabled());
+
+    return mempool_refill_needed || mempool_deferred_list;
+}
+
+static void
+mempool_free_deferred(struct mempool_buf *list)
+{
+    struct mempool_buf *buf;
+
+    while (list) {
+        buf = list;
+        list = list->next;
+        free(buf);
+    }
+}
+
+static void
+mempool_refill(void)
+{
+    struct mempool_buf *buf;
+    uint32_t eflags;
+
+    for (;;) {
+        eflags = cpu_intr_save();
+
+        if (mempool_nr_free >= MEMPOOL_HIGH_WATERMARK) {
+            cpu_intr_restore(eflags);
+            break;
+        }
+
+        cpu_intr_restore(eflags);
+
+        buf = malloc(MEMPOOL_BUF_SIZE);
+
+        /*
+         * If the heap is exhausted, give up until the next time the level
+         * of the pool crosses the low watermark, instead of retrying in a
+         * loop that would starve lower priority threads.
+         */
+        if (!buf) {
+            break;
+        }
+
+        eflags = cpu_intr_save();
+        mempool_push(&mempool_free_list, buf);
+        mempool_nr_free++;
+        cpu_intr_restore(eflags);
+    }
+}
+
+static void
+mempool_run(void *arg)
+{
+    struct mempool_buf *deferred_list;
+    bool refill_needed;
+    uint32_t eflags;
+
+    (void)arg;
+
+    for (;;) {
+        thread_preempt_disable();
+        eflags = cpu_intr_save();
+
+        while (!mempool_work_pending()) {
+            thread_sleep();
+        }
+
+        deferred_list = mempool_deferred_list;
+        mempool_deferred_list = NULL;
+        refill_needed = mempool_refill_needed;
+        mempool_refill_needed = false;
+
+        cpu_intr_restore(eflags);
+        thread_preempt_enable();
+
+        mempool_free_deferred(deferred_list);
+
+        if (refill_needed) {
+            mempool_refill();
+        }
+    }
+}
+
+void
+mempool_setup(void)
+{
+    int error;
+
+    mempool_refill();
+
+    error = thread_create(&mempool_thread, mempool_run, NULL, "mempool",
+                          MEMPOOL_STACK_SIZE, THREAD_MAX_PRIORITY - 1);
+
+    if (error) {
+        panic("mempool: unable to create thread");
+    }
+}
+
+void *
+mempool_alloc(void)
+{
+    struct mempool_buf *buf;
+    uint32_t eflags;
+
+    thread_preempt_disable();
+    eflags = cpu_intr_save();
+
+    buf = mempool_pop(&mempool_free_list);
+
+    if (buf) {
+        mempool_nr_free--;
+    }
+
+    if (!mempool_refill_needed
+        && (mempool_nr_free < MEMPOOL_LOW_WATERMARK)) {
+        mempool_refill_needed = true;
+        thread_wakeup(mempool_thread);
+    }
+
+    cpu_intr_restore(eflags);
+    thread_preempt_enable();
+
+    return buf;
+}
+
+void
+mempool_free(void *ptr)
+{
+    struct mempool_buf *buf;
+    uint32_t eflags;
+
+    buf = ptr;
+
+    thread_preempt_disable();
+    eflags = cpu_intr_save();
+
+    if (mempool_nr_free < MEMPOOL_HIGH_WATERMARK) {
+        mempool_push(&mempool_free_list, buf);
+        mempool_nr_free++;
+    } else {
+        mempool_push(&mempool_deferred_list, buf);
+        thread_wakeup(mempool_thread);
+    }
+
+    cpu_intr_restore(eflags);
+    thread_preempt_enable();
+}
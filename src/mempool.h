@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * Interrupt-safe memory pool.
+ *
+ * The general purpose allocator (see mem.h) serializes access to the heap
+ * with a mutex, which makes it unusable from interrupt context, where
+ * sleeping is impossible. Drivers that must store data from their
+ * interrupt handler are therefore limited to what they preallocated,
+ * and usually drop data when that storage is exhausted.
+ *
+ * This module provides a pool of fixed-size buffers that may be allocated
+ * and released from any context, including interrupt handlers. The pool
+ * is a simple list of free buffers, protected by disabling interrupts for
+ * the few instructions needed to push or pop a buffer. Its level is
+ * maintained between two watermarks by a dedicated thread, which
+ * allocates buffers from the heap when the level drops below the low
+ * watermark, and returns buffers to the heap when too many of them are
+ * released. Since the heap can only be accessed from thread context,
+ * buffers released in excess are queued and actually freed later by that
+ * thread, a technique called deferred freeing.
+ *
+ * The pool is meant to absorb bursts. If buffers are allocated faster than
+ * the pool thread can refill it, the pool eventually runs empty, and
+ * allocation fails.
+ */
+
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+/*
+ * Size of the buffers provided by the pool.
+ */
+#define MEMPOOL_BUF_SIZE 256
+
+/*
+ * Initialize the mempool module.
+ *
+ * This function fills the pool and creates the thread that maintains its
+ * level. It must be called once the heap and the thread module are
+ * initialized. Until then, allocating from the pool always fails.
+ */
+void mempool_setup(void);
+
+/*
+ * Allocate a buffer from the pool.
+ *
+ * The size of the returned buffer is MEMPOOL_BUF_SIZE, and it's aligned
+ * like memory returned by mem_alloc().
+ *
+ * This function may be called from interrupt context.
+ *
+ * Return NULL if the pool is empty.
+ */
+void * mempool_alloc(void);
+
+/*
+ * Release a buffer to the pool.
+ *
+ * The buffer must have been allocated with mempool_alloc().
+ *
+ * This function may be called from interrupt context.
+ */
+void mempool_free(void *ptr);
+
+#endif /* MEMPOOL_H */
@@ -0,0 +1,535 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <lib/hash.h>
+#include <lib/macros.h>
+#include <lib/shell.h>
+
+#include "main.h"
+#include "memprof.h"
+#include "panic.h"
+#include "thread.h"
+#include "tick.h"
+#include "timer.h"
+
+/*
+ * Default sampling rate, in bytes.
+ */
+#define MEMPROF_DEFAULT_RATE    4096
+
+/*
+ * Number of return addresses stored per backtrace.
+ */
+#define MEMPROF_BT_SIZE         4
+
+/*
+ * Maximum number of live samples.
+ *
+ * Samples are allocated out of a static pool since the profiler can't
+ * use the allocator it's profiling. When the pool is exhausted, new
+ * samples are dropped.
+ */
+#define MEMPROF_MAX_SAMPLES     256
+
+/*
+ * Binary exponent and size of the hash table of live samples.
+ */
+#define MEMPROF_HTABLE_BITS     7
+#define MEMPROF_HTABLE_SIZE     (1 << MEMPROF_HTABLE_BITS)
+
+/*
+ * Binary exponent and size of the table of call sites.
+ */
+#define MEMPROF_SITES_BITS      6
+#define MEMPROF_SITES_SIZE      (1 << MEMPROF_SITES_BITS)
+
+/*
+ * Call site.
+ *
+ * The backtrace is the one of the first sample recorded for the site.
+ * Different call chains may lead to the same call site.
+ */
+struct memprof_site {
+    uintptr_t bt[MEMPROF_BT_SIZE];
+    unsigned int nr_frames;
+    unsigned long nr_samples;
+    uint64_t bytes;
+    unsigned long nr_live_samples;
+    size_t live_bytes;
+    unsigned long max_age;
+};
+
+/*
+ * Sample of a live allocation.
+ *
+ * The next member links the sample either in a hash table bucket, or in
+ * the list of free samples.
+ */
+struct memprof_sample {
+    struct memprof_sample *next;
+    const void *ptr;
+    size_t weight;
+    unsigned long ticks;
+    struct memprof_site *site;
+};
+
+/*
+ * Profiler state.
+ *
+ * Preemption must be disabled when accessing these variables. Since the
+ * allocator can't be used from interrupt context, there is no need to
+ * disable interrupts.
+ *
+ * A sampling rate of 0 means the profiler is disabled.
+ */
+static size_t memprof_rate;
+static size_t memprof_countdown;
+static uint32_t memprof_seed;
+static struct memprof_sample memprof_samples[MEMPROF_MAX_SAMPLES];
+static struct memprof_sample *memprof_free_samples;
+static struct memprof_sample *memprof_htable[MEMPROF_HTABLE_SIZE];
+static struct memprof_site memprof_sites[MEMPROF_SITES_SIZE];
+static unsigned int memprof_nr_live_samples;
+static unsigned long memprof_nr_dropped;
+
+/*
+ * Buffer used to take a snapshot of the call sites when dumping.
+ *
+ * It's statically allocated because thread stacks are small. Dumping
+ * is only done from the shell thread.
+ */
+static struct memprof_site memprof_dump_sites[MEMPROF_SITES_SIZE];
+
+/*
+ * Return a pseudo-random number.
+ *
+ * This is the xorshift32 generator by George Marsaglia, which is cheap
+ * and more than good enough to avoid aliasing effects between the
+ * sampling rate and periodic allocation patterns.
+ */
+static uint32_t
+memprof_random(void)
+{
+    memprof_seed ^= memprof_seed << 13;
+    memprof_seed ^= memprof_seed >> 17;
+    memprof_seed ^= memprof_seed << 5;
+    return memprof_seed;
+}
+
+static void
+memprof_reset_countdown(void)
+{
+    /*
+     * Draw the next sampling point uniformly in [rate / 2, rate * 3 / 2),
+     * so that the average interval between samples is the sampling rate.
+     */
+    memprof_countdown = (memprof_rate / 2) + (memprof_random() % memprof_rate);
+
+    if (memprof_countdown == 0) {
+        memprof_countdown = 1;
+    }
+}
+
+static bool
+memprof_consume(size_t size)
+{
+    if (size < memprof_countdown) {
+        memprof_countdown -= size;
+        return false;
+    }
+
+    memprof_reset_countdown();
+    return true;
+}
+
+/*
+ * Fill the given array with the return addresses found in the chain of
+ * stack frames, skipping the given number of frames first.
+ *
+ * With frame pointers, the EBP register points to the saved EBP of the
+ * caller, immediately followed by the return address. The chain ends
+ * with a null frame pointer or return address, which is how the stacks
+ * of new threads are forged (see thread_stack_forge() in thread.c), or
+ * when a frame isn't above the previous one, since stacks grow down.
+ *
+ * This function must never be inlined so that the number of frames to
+ * skip is reliable.
+ */
+static __noinline unsigned int
+memprof_backtrace(uintptr_t *bt, unsigned int max_frames, unsigned int skip)
+{
+    const uintptr_t *frame, *next;
+    unsigned int i;
+
+    frame = __builtin_frame_address(0);
+    i = 0;
+
+    while ((frame != NULL) && (i < max_frames)) {
+        if (frame[1] == 0) {
+            break;
+        }
+
+        if (skip != 0) {
+            skip--;
+        } else {
+            bt[i] = frame[1];
+            i++;
+        }
+
+        next = (const uintptr_t *)frame[0];
+
+        if (next <= frame) {
+            break;
+        }
+
+        frame = next;
+    }
+
+    return i;
+}
+
+static struct memprof_sample **
+memprof_get_bucket(const void *ptr)
+{
+    return &memprof_htable[hash_ptr(ptr, MEMPROF_HTABLE_BITS)];
+}
+
+static struct memprof_site *
+memprof_lookup_site(const uintptr_t *bt, unsigned int nr_frames)
+{
+    struct memprof_site *site;
+    uintptr_t addr;
+    size_t index;
+
+    addr = (nr_frames == 0) ? 0 : bt[0];
+    index = hash_long(addr, MEMPROF_SITES_BITS);
+
+    /*
+     * Open addressing with linear probing. Sites are never removed, except
+     * when the profiler is restarted.
+     */
+    for (size_t i = 0; i < ARRAY_SIZE(memprof_sites); i++) {
+        site = &memprof_sites[(index + i) & (ARRAY_SIZE(memprof_sites) - 1)];
+
+        if (site->nr_samples == 0) {
+            memcpy(site->bt, bt, nr_frames * sizeof(bt[0]));
+            site->nr_frames = nr_frames;
+            return site;
+        }
+
+        if (((site->nr_frames == 0) ? 0 : site->bt[0]) == addr) {
+            return site;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+memprof_record(const void *ptr, size_t size,
+               const uintptr_t *bt, unsigned int nr_frames)
+{
+    struct memprof_sample *sample, **bucket;
+    struct memprof_site *site;
+
+    site = memprof_lookup_site(bt, nr_frames);
+    sample = memprof_free_samples;
+
+    if (!site || !sample) {
+        memprof_nr_dropped++;
+        return;
+    }
+
+    memprof_free_samples = sample->next;
+
+    sample->ptr = ptr;
+    sample->weight = MAX(size, memprof_rate);
+    sample->ticks = timer_now();
+    sample->site = site;
+
+    bucket = memprof_get_bucket(ptr);
+    sample->next = *bucket;
+    *bucket = sample;
+    memprof_nr_live_samples++;
+
+    site->nr_samples++;
+    site->bytes += sample->weight;
+    site->nr_live_samples++;
+    site->live_bytes += sample->weight;
+}
+
+__noinline void
+memprof_alloc(const void *ptr, size_t size)
+{
+    uintptr_t bt[MEMPROF_BT_SIZE];
+    unsigned int nr_frames;
+
+    /*
+     * This unsynchronized check is the only cost when the profiler is
+     * disabled.
+     */
+    if (likely(memprof_rate == 0) || !ptr) {
+        return;
+    }
+
+    thread_preempt_disable();
+
+    if ((memprof_rate != 0) && memprof_consume(size)) {
+        /*
+         * Skip the frames of this function and the allocator. This is
+         * why this function must never be inlined.
+         */
+        nr_frames = memprof_backtrace(bt, ARRAY_SIZE(bt), 2);
+        memprof_record(ptr, size, bt, nr_frames);
+    }
+
+    thread_preempt_enable();
+}
+
+void
+memprof_free(const void *ptr)
+{
+    struct memprof_sample *sample, **prevp;
+    struct memprof_site *site;
+
+    /*
+     * A block being freed is owned by the caller, so if it was sampled,
+     * this unsynchronized check can't miss it.
+     */
+    if (likely(memprof_nr_live_samples == 0) || !ptr) {
+        return;
+    }
+
+    thread_preempt_disable();
+
+    prevp = memprof_get_bucket(ptr);
+
+    for (sample = *prevp; sample != NULL; sample = sample->next) {
+        if (sample->ptr == ptr) {
+            break;
+        }
+
+        prevp = &sample->next;
+    }
+
+    if (sample) {
+        *prevp = sample->next;
+        memprof_nr_live_samples--;
+
+        site = sample->site;
+        assert(site->nr_live_samples != 0);
+        site->nr_live_samples--;
+        site->live_bytes -= sample->weight;
+
+        sample->next = memprof_free_samples;
+        memprof_free_samples = sample;
+    }
+
+    thread_preempt_enable();
+}
+
+static void
+memprof_start(size_t rate)
+{
+    assert(rate != 0);
+
+    thread_preempt_disable();
+
+    memset(memprof_htable, 0, sizeof(memprof_htable));
+    memset(memprof_sites, 0, sizeof(memprof_sites));
+    memprof_free_samples = NULL;
+
+    for (size_t i = 0; i < ARRAY_SIZE(memprof_samples); i++) {
+        memprof_samples[i].next = memprof_free_samples;
+        memprof_free_samples = &memprof_samples[i];
+    }
+
+    memprof_nr_live_samples = 0;
+    memprof_nr_dropped = 0;
+    memprof_seed = (uint32_t)timer_now() | 1;
+    memprof_rate = rate;
+    memprof_reset_countdown();
+
+    thread_preempt_enable();
+}
+
+static void
+memprof_stop(void)
+{
+    /*
+     * Samples are kept so that they can still be dumped. Live samples
+     * are still removed when freed.
+     */
+    thread_preempt_disable();
+    memprof_rate = 0;
+    thread_preempt_enable();
+}
+
+static void
+memprof_sort_sites(struct memprof_site *sites, size_t nr_sites)
+{
+    struct memprof_site tmp;
+    size_t j;
+
+    /*
+     * Insertion sort, by decreasing number of bytes allocated. The number
+     * of sites is small, and this is only done when dumping.
+     */
+    for (size_t i = 1; i < nr_sites; i++) {
+        tmp = sites[i];
+
+        for (j = i; (j > 0) && (sites[j - 1].bytes < tmp.bytes); j--) {
+            sites[j] = sites[j - 1];
+        }
+
+        sites[j] = tmp;
+    }
+}
+
+static void
+memprof_dump(void)
+{
+    const struct memprof_sample *sample;
+    struct memprof_site *site;
+    unsigned long now, age, nr_dropped;
+    unsigned int nr_live_samples;
+    size_t rate;
+
+    thread_preempt_disable();
+
+    now = timer_now();
+    rate = memprof_rate;
+    nr_live_samples = memprof_nr_live_samples;
+    nr_dropped = memprof_nr_dropped;
+    memcpy(memprof_dump_sites, memprof_sites, sizeof(memprof_dump_sites));
+
+    for (size_t i = 0; i < ARRAY_SIZE(memprof_htable); i++) {
+        for (sample = memprof_htable[i]; sample; sample = sample->next) {
+            site = &memprof_dump_sites[sample->site - memprof_sites];
+            age = now - sample->ticks;
+
+            if (age > site->max_age) {
+                site->max_age = age;
+            }
+        }
+    }
+
+    thread_preempt_enable();
+
+    memprof_sort_sites(memprof_dump_sites, ARRAY_SIZE(memprof_dump_sites));
+
+    printf("memprof: rate: %zu, live samples: %u, dropped samples: %lu\n"
+           "memprof: samples      bytes   live bytes  max age (ms)  backtrace\n",
+           rate, nr_live_samples, nr_dropped);
+
+    for (size_t i = 0; i < ARRAY_SIZE(memprof_dump_sites); i++) {
+        site = &memprof_dump_sites[i];
+
+        if (site->nr_samples == 0) {
+            break;
+        }
+
+        printf("memprof: %7lu %10llu %12zu %13lu",
+               site->nr_samples, (unsigned long long)site->bytes,
+               site->live_bytes, (site->max_age * 1000) / tick_get_freq());
+
+        for (unsigned int j = 0; j < site->nr_frames; j++) {
+            printf(" %08lx", (unsigned long)site->bt[j]);
+        }
+
+        printf("\n");
+    }
+}
+
+static void
+memprof_shell_start(struct shell *shell, int argc, char **argv)
+{
+    size_t rate;
+    int ret;
+
+    if (argc == 1) {
+        rate = MEMPROF_DEFAULT_RATE;
+    } else if (argc == 2) {
+        ret = sscanf(argv[1], "%zu", &rate);
+
+        if ((ret != 1) || (rate == 0)) {
+            goto error;
+        }
+    } else {
+        goto error;
+    }
+
+    memprof_start(rate);
+    return;
+
+error:
+    shell_printf(shell, "memprof_start: error: invalid arguments\n");
+}
+
+static void
+memprof_shell_stop(struct shell *shell, int argc, char **argv)
+{
+    (void)shell;
+    (void)argc;
+    (void)argv;
+
+    memprof_stop();
+}
+
+static void
+memprof_shell_dump(struct shell *shell, int argc, char **argv)
+{
+    (void)shell;
+    (void)argc;
+    (void)argv;
+
+    memprof_dump();
+}
+
+static struct shell_cmd memprof_shell_cmds[] = {
+    SHELL_CMD_INITIALIZER("memprof_start", memprof_shell_start,
+        "memprof_start [rate]",
+        "start sampling allocations, one every rate bytes on average "
+        "(default " QUOTE(MEMPROF_DEFAULT_RATE) ")"),
+    SHELL_CMD_INITIALIZER("memprof_stop", memprof_shell_stop,
+        "memprof_stop",
+        "stop sampling allocations"),
+    SHELL_CMD_INITIALIZER2("memprof_dump", memprof_shell_dump,
+        "memprof_dump",
+        "dump sampled allocations per call site",
+        "Call sites are sorted by decreasing estimated number of bytes\n"
+        "allocated. Use addr2line to convert backtrace addresses into\n"
+        "source locations."),
+};
+
+void
+memprof_setup(void)
+{
+    SHELL_REGISTER_CMDS(memprof_shell_cmds, main_get_shell_cmd_set());
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * Sampling memory allocation profiler.
+ *
+ * Profiling every allocation is expensive, both in time and memory.
+ * Instead, this module samples allocations, on average one every N bytes
+ * allocated, N being the sampling rate. Each sample records the size of
+ * the allocation, the time at which it was made, and a short backtrace,
+ * obtained by walking the chain of frame pointers, which the kernel keeps
+ * (see -fno-omit-frame-pointer in the Makefile).
+ *
+ * Sampling by bytes rather than by allocations means that large
+ * allocations are more likely to be sampled than small ones, which is
+ * what matters when looking for the code paths that consume the most
+ * memory. Each sample is weighted by the number of bytes it represents,
+ * i.e. the largest of the sampling rate and the allocation size, so that
+ * the total weight of samples estimates the number of bytes allocated.
+ *
+ * Samples of live allocations are kept in a hash table keyed by address,
+ * so that they can be removed when freed. Samples are also aggregated per
+ * call site, the return address into the caller of the allocator, which
+ * may be converted into a source location with addr2line.
+ *
+ * The profiler is disabled by default. When disabled, or when sampling is
+ * sparse, its overhead is a few instructions per allocation.
+ */
+
+#ifndef MEMPROF_H
+#define MEMPROF_H
+
+#include <stddef.h>
+
+/*
+ * Initialize the memprof module.
+ *
+ * This function registers shell commands, and may only be called once the
+ * main shell command set is initialized.
+ */
+void memprof_setup(void);
+
+/*
+ * Report an allocation/free to the profiler.
+ *
+ * These functions are called by the mem module, from thread context,
+ * without holding the allocator lock.
+ */
+void memprof_alloc(const void *ptr, size_t size);
+void memprof_free(const void *ptr);
+
+#endif /* MEMPROF_H */
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * Host tests for the memory allocator and the modules built on top of it.
+ *
+ * This file isn't part of the kernel. Along with the host environment
+ * (see host.c), it allows building the allocator as a regular Linux
+ * program that checks behaviors which are hard to observe from the
+ * kernel, such as the handling of requests near SIZE_MAX, with the
+ * memtest_host Makefile target :
+ *
+ * $ make memtest_host
+ * $ ./memtest_host
+ *
+ * Each test panics on failure, which makes the program abort.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <lib/macros.h>
+
+#include "arena.h"
+#include "mem.h"
+#include "panic.h"
+
+#define MEMTEST_CHECK(expr)                                         \
+MACRO_BEGIN                                                         \
+    if (!(expr)) {                                                  \
+        panic("memtest: %s:%d: check failed: %s",                  \
+              __func__, __LINE__, #expr);                           \
+    }                                                               \
+MACRO_END
+
+struct memtest {
+    const char *name;
+    void (*fn)(void);
+};
+
+/*
+ * Products that fit in a size_t, but not once rounded up and increased
+ * by the block overhead, must fail, like products that overflow.
+ */
+static void
+memtest_calloc_overflow(void)
+{
+    char *ptr;
+
+    MEMTEST_CHECK(mem_calloc(2, (SIZE_MAX / 2) + 1) == NULL);
+    MEMTEST_CHECK(mem_calloc(1, SIZE_MAX) == NULL);
+    MEMTEST_CHECK(mem_calloc(1, SIZE_MAX - 1) == NULL);
+    MEMTEST_CHECK(mem_calloc(SIZE_MAX - 1, 1) == NULL);
+
+    ptr = mem_calloc(4, 4);
+    MEMTEST_CHECK(ptr != NULL);
+
+    for (size_t i = 0; i < 16; i++) {
+        MEMTEST_CHECK(ptr[i] == 0);
+    }
+
+    mem_free(ptr);
+}
+
+/*
+ * Sizes near SIZE_MAX must fail, whether they wrap around when rounded
+ * up by the arena, or when increased by the chunk header and the block
+ * overhead of the allocator, and leave the arena usable.
+ */
+static void
+memtest_arena_overflow(void)
+{
+    struct arena arena;
+    char *ptr;
+
+    arena_init(&arena, 64);
+
+    for (size_t i = 0; i <= 64; i++) {
+        MEMTEST_CHECK(arena_alloc(&arena, SIZE_MAX - i) == NULL);
+    }
+
+    MEMTEST_CHECK(arena_alloc(&arena, SIZE_MAX / 2) == NULL);
+
+    ptr = arena_alloc(&arena, 16);
+    MEMTEST_CHECK(ptr != NULL);
+
+    for (size_t i = 0; i < 16; i++) {
+        ptr[i] = (char)i;
+    }
+
+    arena_destroy(&arena);
+}
+
+static const struct memtest memtest_tests[] = {
+    { "calloc_overflow", memtest_calloc_overflow },
+    { "arena_overflow", memtest_arena_overflow },
+};
+
+int
+main(void)
+{
+    mem_setup();
+
+    for (size_t i = 0; i < ARRAY_SIZE(memtest_tests); i++) {
+        memtest_tests[i].fn();
+        printf("memtest: %s: ok\n", memtest_tests[i].name);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -117,6 +117,7 @@
 #define MUTEX_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #include <lib/list.h>
 
@@ -133,6 +134,15 @@ struct mutex {
     bool locked;
 };
 
+/*
+ * Static mutex initializer.
+ *
+ * This is equivalent to mutex_init(), for mutexes that may be used before
+ * the module owning them could initialize them.
+ */
+#define MUTEX_INITIALIZER(mutex) \
+    { LIST_INITIALIZER((mutex).waiters), NULL, false }
+
 /*
  * Initialize a mutex.
  */
@@ -26,6 +26,7 @@
 #include "cpu.h"
 #include "panic.h"
 #include "thread.h"
+#include "uart.h"
 
 void
 panic(const char *format, ...)
@@ -34,6 +35,13 @@ panic(const char *format, ...)
 
     thread_preempt_disable();
     cpu_intr_disable();
+
+    /*
+     * Interrupts are never enabled again, so queued output must be flushed,
+     * and the rest written with polling.
+     */
+    uart_set_polled(true);
+
     printf("\npanic: ");
     va_start(ap, format);
     vprintf(format, ap);
@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lib/macros.h>
+
+#include "cpu.h"
+#include "panic.h"
+#include "pmap.h"
+
+/*
+ * Page directory and page table entry flags.
+ *
+ * See Intel 64 and IA-32 Architecture Software Developer's Manual, Volume 3
+ * System Programming Guide, 4.3 32-Bit Paging, Table 4-4 to Table 4-6.
+ */
+#define PMAP_PTE_P          0x001   /* Present */
+#define PMAP_PTE_RW         0x002   /* Writable */
+#define PMAP_PTE_PWT        0x008   /* Page-level write-through */
+#define PMAP_PTE_PCD        0x010   /* Page-level cache disable */
+#define PMAP_PDE_PS         0x080   /* Page size (large page) */
+
+#define PMAP_PTE_ADDR_MASK  0xfffff000
+
+/*
+ * Number of entries in a page directory or page table.
+ */
+#define PMAP_NR_ENTRIES     1024
+
+/*
+ * Number of large pages used by the identity mapping.
+ */
+#define PMAP_NR_LARGE_PAGES (PMAP_MEM_SIZE / PMAP_LARGE_PAGE_SIZE)
+
+/*
+ * Number of page tables covering the stack area.
+ */
+#define PMAP_NR_STACK_PTABLES (PMAP_STACK_AREA_SIZE / PMAP_LARGE_PAGE_SIZE)
+
+#if !P2ALIGNED(PMAP_MEM_SIZE, PMAP_LARGE_PAGE_SIZE)
+#error "invalid physical memory size"
+#endif
+
+#if !P2ALIGNED(PMAP_STACK_AREA_SIZE, PMAP_LARGE_PAGE_SIZE)
+#error "invalid stack area size"
+#endif
+
+/*
+ * Number of physical pages in the page pool.
+ *
+ * With the default 64 KB stack slots (see thread.c), there are as many
+ * pages as there are stack slots, so that every thread may commit at
+ * least one page.
+ */
+#define PMAP_NR_PAGES       2048
+
+/*
+ * Extract page directory/table indexes from a virtual address.
+ */
+#define PMAP_PDE_SHIFT      22
+#define PMAP_PTE_SHIFT      12
+#define PMAP_PTE_INDEX_MASK (PMAP_NR_ENTRIES - 1)
+
+/*
+ * The page directory.
+ *
+ * Like page tables, it must be page-aligned.
+ */
+static uint32_t pmap_pdir[PMAP_NR_ENTRIES] __aligned(PMAP_PAGE_SIZE);
+
+/*
+ * Page tables of the stack area.
+ *
+ * They're statically allocated since the memory allocator isn't able to
+ * return page-aligned memory, and because their number is small and known
+ * at compile time.
+ */
+static uint32_t pmap_stack_ptables[PMAP_NR_STACK_PTABLES][PMAP_NR_ENTRIES]
+    __aligned(PMAP_PAGE_SIZE);
+
+/*
+ * Page pool.
+ *
+ * Physical pages backing the stack area are allocated from this pool.
+ * Free pages are linked through their first word. Since physical memory
+ * is identity mapped, pages can be accessed through their physical
+ * address.
+ *
+ * Interrupts must be disabled when accessing the free list.
+ */
+static char pmap_pages[PMAP_NR_PAGES][PMAP_PAGE_SIZE] __aligned(PMAP_PAGE_SIZE);
+static uintptr_t pmap_free_pages;
+
+static unsigned int
+pmap_pde_index(uintptr_t va)
+{
+    return va >> PMAP_PDE_SHIFT;
+}
+
+static unsigned int
+pmap_pte_index(uintptr_t va)
+{
+    return (va >> PMAP_PTE_SHIFT) & PMAP_PTE_INDEX_MASK;
+}
+
+static uint32_t *
+pmap_lookup_pte(uintptr_t va)
+{
+    unsigned int index;
+
+    assert(P2ALIGNED(va, PMAP_PAGE_SIZE));
+    assert(va >= PMAP_STACK_AREA_START);
+    assert((va - PMAP_STACK_AREA_START) < PMAP_STACK_AREA_SIZE);
+
+    index = pmap_pde_index(va - PMAP_STACK_AREA_START);
+    return &pmap_stack_ptables[index][pmap_pte_index(va)];
+}
+
+uintptr_t
+pmap_page_alloc(void)
+{
+    uint32_t eflags;
+    uintptr_t pa;
+
+    eflags = cpu_intr_save();
+
+    pa = pmap_free_pages;
+
+    if (pa != 0) {
+        pmap_free_pages = *(uintptr_t *)pa;
+    }
+
+    cpu_intr_restore(eflags);
+
+    return pa;
+}
+
+void
+pmap_page_free(uintptr_t pa)
+{
+    uint32_t eflags;
+
+    assert(P2ALIGNED(pa, PMAP_PAGE_SIZE));
+    assert((pa >= (uintptr_t)pmap_pages)
+           && (pa < (uintptr_t)&pmap_pages[PMAP_NR_PAGES]));
+
+    eflags = cpu_intr_save();
+    *(uintptr_t *)pa = pmap_free_pages;
+    pmap_free_pages = pa;
+    cpu_intr_restore(eflags);
+}
+
+void
+pmap_enter(uintptr_t va, uintptr_t pa)
+{
+    uint32_t *pte, eflags;
+
+    eflags = cpu_intr_save();
+
+    pte = pmap_lookup_pte(va);
+    assert(!(*pte & PMAP_PTE_P));
+    *pte = pa | PMAP_PTE_RW | PMAP_PTE_P;
+
+    /*
+     * The processor never caches translations for non-present pages, so
+     * there is no need to invalidate the TLB here.
+     */
+
+    cpu_intr_restore(eflags);
+}
+
+uintptr_t
+pmap_remove(uintptr_t va)
+{
+    uint32_t *pte, eflags;
+    uintptr_t pa;
+
+    eflags = cpu_intr_save();
+
+    pte = pmap_lookup_pte(va);
+    assert(*pte & PMAP_PTE_P);
+    pa = *pte & PMAP_PTE_ADDR_MASK;
+    *pte = 0;
+    cpu_tlb_flush(va);
+
+    cpu_intr_restore(eflags);
+
+    return pa;
+}
+
+void
+pmap_map_device(uintptr_t pa)
+{
+    uint32_t *pde, eflags;
+
+    assert(pa >= (PMAP_STACK_AREA_START + PMAP_STACK_AREA_SIZE));
+
+    eflags = cpu_intr_save();
+
+    /*
+     * Device registers must never be cached, since reading and writing
+     * them has side effects, and their content may change at any time.
+     * Devices are usually packed in the same region, near the end of the
+     * physical address space, which is why a whole large page is mapped.
+     */
+    pde = &pmap_pdir[pmap_pde_index(pa)];
+
+    if (!(*pde & PMAP_PTE_P)) {
+        *pde = P2ALIGN(pa, PMAP_LARGE_PAGE_SIZE) | PMAP_PDE_PS
+               | PMAP_PTE_PCD | PMAP_PTE_PWT | PMAP_PTE_RW | PMAP_PTE_P;
+    }
+
+    cpu_intr_restore(eflags);
+}
+
+void
+pmap_setup(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    cpu_cpuid(CPU_CPUID_LEAF_FEATURES, &eax, &ebx, &ecx, &edx);
+
+    if (!(edx & CPU_CPUID_EDX_PSE)) {
+        panic("pmap: error: page size extension not supported");
+    }
+
+    for (size_t i = 0; i < PMAP_NR_LARGE_PAGES; i++) {
+        pmap_pdir[i] = (i * PMAP_LARGE_PAGE_SIZE)
+                       | PMAP_PDE_PS | PMAP_PTE_RW | PMAP_PTE_P;
+    }
+
+    for (size_t i = 0; i < PMAP_NR_STACK_PTABLES; i++) {
+        pmap_pdir[pmap_pde_index(PMAP_STACK_AREA_START) + i]
+            = (uintptr_t)pmap_stack_ptables[i] | PMAP_PTE_RW | PMAP_PTE_P;
+    }
+
+    for (size_t i = 0; i < PMAP_NR_PAGES; i++) {
+        pmap_page_free((uintptr_t)pmap_pages[i]);
+    }
+
+    cpu_enable_paging((uintptr_t)pmap_pdir);
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * Physical map module.
+ *
+ * X1 is a single address space operating system, and was originally run
+ * with paging disabled, i.e. with addresses used by software directly
+ * referring to physical memory. This module enables paging, for two
+ * purposes : memory protection, and demand paging of thread stacks.
+ *
+ * Physical memory is identity mapped, i.e. virtual addresses are equal
+ * to physical addresses, so that the rest of the kernel doesn't need to
+ * care about translation. The identity mapping uses 4 MB large pages,
+ * made available by the page size extension (PSE). Each large page
+ * only consumes one entry in the TLB (translation lookaside buffer),
+ * the cache of translations maintained by the processor, which keeps the
+ * cost of address translation close to zero.
+ *
+ * Above physical memory, a range of virtual addresses called the stack
+ * area is reserved for thread stacks. Unlike the identity mapping, pages
+ * in the stack area are only mapped on request, to physical pages
+ * allocated from a dedicated pool. Unmapped pages in that area raise a
+ * page fault exception (#PF) when accessed, which is how stacks are
+ * grown on demand, and how stack overflows are detected (see thread.c).
+ *
+ * This module uses classic 32-bits paging, with a two-level hierarchy
+ * made of a page directory and page tables.
+ *
+ * Page tables and the page pool are shared with the page fault handler,
+ * so interrupts are disabled when accessing them. All functions may be
+ * called from the page fault handler.
+ *
+ * See Intel 64 and IA-32 Architecture Software Developer's Manual, Volume 3
+ * System Programming Guide, 4.3 32-Bit Paging.
+ */
+
+#ifndef PMAP_H
+#define PMAP_H
+
+#include <stdint.h>
+
+/*
+ * Size of a regular page.
+ */
+#define PMAP_PAGE_SIZE          4096
+
+/*
+ * Size of a large page.
+ */
+#define PMAP_LARGE_PAGE_SIZE    (4 * 1024 * 1024)
+
+/*
+ * Size of the identity mapped physical memory.
+ *
+ * This must match the amount of memory described in the linker script,
+ * including the first MB skipped by the kernel, and the memory size
+ * passed to QEMU in qemu.sh.
+ */
+#define PMAP_MEM_SIZE           (64 * 1024 * 1024)
+
+/*
+ * Virtual range reserved for thread stacks, right above physical memory.
+ */
+#define PMAP_STACK_AREA_START   PMAP_MEM_SIZE
+#define PMAP_STACK_AREA_SIZE    (128 * 1024 * 1024)
+
+/*
+ * Initialize the pmap module.
+ *
+ * On return, paging is enabled.
+ */
+void pmap_setup(void);
+
+/*
+ * Allocate/release a physical page from/to the page pool.
+ *
+ * The allocation function returns the physical address of the page, or 0
+ * if the pool is empty.
+ */
+uintptr_t pmap_page_alloc(void);
+void pmap_page_free(uintptr_t pa);
+
+/*
+ * Map/unmap a page in the stack area.
+ *
+ * The given virtual address must be page-aligned and inside the stack area.
+ * The unmap function returns the physical address of the page that was
+ * mapped at the given virtual address.
+ */
+void pmap_enter(uintptr_t va, uintptr_t pa);
+uintptr_t pmap_remove(uintptr_t va);
+
+/*
+ * Identity map the registers of a memory-mapped device.
+ *
+ * The given physical address must be above the stack area. On return,
+ * the large page containing it is mapped, with caching disabled, and the
+ * registers may be accessed at the same virtual address.
+ */
+void pmap_map_device(uintptr_t pa);
+
+#endif /* PMAP_H */
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+
+#include <lib/macros.h>
+
+#include "cpu.h"
+#include "seqlock.h"
+
+/*
+ * On this uniprocessor system, readers and writers only need to agree on
+ * the order of their memory accesses from the point of view of a single
+ * processor, which is always the program order at the machine level.
+ * Preventing the compiler from reordering accesses, with barriers, and
+ * from splitting or merging accesses to the sequence number, with atomic
+ * loads and stores, is therefore enough. A multiprocessor implementation
+ * would need actual memory barriers.
+ */
+
+void
+seqlock_init(struct seqlock *seqlock)
+{
+    seqlock->seq = 0;
+}
+
+unsigned long
+seqlock_read_begin(const struct seqlock *seqlock)
+{
+    unsigned long seq;
+
+    seq = __atomic_load_n(&seqlock->seq, __ATOMIC_RELAXED);
+    barrier();
+    return seq;
+}
+
+bool
+seqlock_read_retry(const struct seqlock *seqlock, unsigned long seq)
+{
+    barrier();
+
+    /*
+     * An odd sequence number means the reader interrupted a writer,
+     * which can't happen as long as writers run with interrupts disabled,
+     * but the check costs nothing.
+     */
+    return (seq & 1)
+           || (seq != __atomic_load_n(&seqlock->seq, __ATOMIC_RELAXED));
+}
+
+void
+seqlock_write_begin(struct seqlock *seqlock)
+{
+    assert(!cpu_intr_enabled());
+    assert(!(seqlock->seq & 1));
+
+    __atomic_store_n(&seqlock->seq, seqlock->seq + 1, __ATOMIC_RELAXED);
+    barrier();
+}
+
+void
+seqlock_write_end(struct seqlock *seqlock)
+{
+    assert(seqlock->seq & 1);
+
+    barrier();
+    __atomic_store_n(&seqlock->seq, seqlock->seq + 1, __ATOMIC_RELAXED);
+}
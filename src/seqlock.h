@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * Sequence lock module.
+ *
+ * A sequence lock, or seqlock, protects data that is often read and
+ * rarely written, without ever making readers block writers, disable
+ * interrupts, or write shared memory. The writer increments a sequence
+ * number before and after updating the data, which makes the sequence
+ * number odd while an update is in progress. Readers sample the sequence
+ * number, copy the data, and retry if the sequence number was odd, or
+ * has changed in the meantime.
+ *
+ * This makes seqlocks well suited for data such as the current time,
+ * which is written by an interrupt handler, and read very frequently
+ * from any context. Compared to disabling interrupts around the read,
+ * the cost is a couple of loads of the sequence number, and a retry in
+ * the rare case where the read is interrupted by the writer. It also
+ * scales to data larger than a word, which can't be read atomically.
+ *
+ * Since readers never block writers, the protected data may change at
+ * any time during a read, and readers must only copy it, without acting
+ * on it, until the copy is validated. Conversely, a writer must never be
+ * interrupted by a reader, or the reader would retry forever. On this
+ * uniprocessor system, this means writers must run with interrupts
+ * disabled, which is always the case for interrupt handlers. Writers
+ * must also be serialized, normally by that same condition.
+ *
+ * Usage :
+ *
+ * do {
+ *     seq = seqlock_read_begin(&seqlock);
+ *     copy = data;
+ * } while (seqlock_read_retry(&seqlock, seq));
+ *
+ * seqlock_write_begin(&seqlock);
+ * data = new_data;
+ * seqlock_write_end(&seqlock);
+ */
+
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <stdbool.h>
+
+struct seqlock {
+    unsigned long seq;
+};
+
+/*
+ * Initialize a sequence lock.
+ */
+void seqlock_init(struct seqlock *seqlock);
+
+/*
+ * Begin/end a read-side critical section.
+ *
+ * The value returned by seqlock_read_begin() must be passed to
+ * seqlock_read_retry(), which returns true if the data read in between
+ * may be inconsistent, in which case the read must be restarted.
+ *
+ * These functions imply a compiler barrier.
+ */
+unsigned long seqlock_read_begin(const struct seqlock *seqlock);
+bool seqlock_read_retry(const struct seqlock *seqlock, unsigned long seq);
+
+/*
+ * Begin/end a write-side critical section.
+ *
+ * Interrupts must be disabled.
+ *
+ * These functions imply a compiler barrier.
+ */
+void seqlock_write_begin(struct seqlock *seqlock);
+void seqlock_write_end(struct seqlock *seqlock);
+
+#endif /* SEQLOCK_H */
@@ -25,16 +25,27 @@
 #include <stdio.h>
 
 #include "cpu.h"
+#include "mutex.h"
 #include "thread.h"
 #include "uart.h"
 
 #define PRINTF_BUFFER_SIZE 1024
 
 /*
- * This implementation uses a global buffer in order to avoid allocating
+ * This implementation uses global buffers in order to avoid allocating
  * from the stack, since stacks may be very small.
+ *
+ * Threads format into the first buffer, with its mutex locked, so that
+ * they may sleep while the UART driver waits for room to queue output,
+ * without disabling interrupts or preemption. Other callers, i.e. interrupt
+ * handlers and code running with interrupts or preemption disabled, use
+ * the second buffer, with interrupts disabled, since they may interrupt
+ * a thread using the first one. They never wait for long, since the UART
+ * driver doesn't make them sleep.
  */
 static char printf_buffer[PRINTF_BUFFER_SIZE];
+static struct mutex printf_mutex = MUTEX_INITIALIZER(printf_mutex);
+static char printf_atomic_buffer[PRINTF_BUFFER_SIZE];
 
 void
 putchar(unsigned char c)
@@ -65,23 +76,36 @@ printf(const char *format, ...)
     return length;
 }
 
+static void
+printf_write(const char *buffer)
+{
+    for (const char *ptr = buffer; *ptr != '\0'; ptr++) {
+        uart_write((uint8_t)*ptr);
+    }
+}
+
 int
 vprintf(const char *format, va_list ap)
 {
     uint32_t eflags;
     int length;
 
-    thread_preempt_disable();
-    eflags = cpu_intr_save();
-
-    length = vsnprintf(printf_buffer, sizeof(printf_buffer), format, ap);
-
-    for (const char *ptr = printf_buffer; *ptr != '\0'; ptr++) {
-        uart_write((uint8_t)*ptr);
+    if (thread_preempt_enabled() && cpu_intr_enabled()) {
+        mutex_lock(&printf_mutex);
+        length = vsnprintf(printf_buffer, sizeof(printf_buffer), format, ap);
+        printf_write(printf_buffer);
+        mutex_unlock(&printf_mutex);
+    } else {
+        thread_preempt_disable();
+        eflags = cpu_intr_save();
+
+        length = vsnprintf(printf_atomic_buffer, sizeof(printf_atomic_buffer),
+                           format, ap);
+        printf_write(printf_atomic_buffer);
+
+        cpu_intr_restore(eflags);
+        thread_preempt_enable();
     }
 
-    cpu_intr_restore(eflags);
-    thread_preempt_enable();
-
     return length;
 }
@@ -203,6 +203,8 @@ strerror(int errnum)
         return "resource busy";
     case EEXIST:
         return "entry exist";
+    case ENODEV:
+        return "no such device";
     default:
         return "unknown error";
     }
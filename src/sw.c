@@ -21,25 +21,43 @@
  *
  *
  * Stopwatch demo application.
+ *
+ * Stopwatches are identified by name, and created when first started.
+ * Their time is measured with the monotonic clock, and stored as the
+ * time accumulated while previously running, and the clock value when
+ * last started or resumed, from which the current time is computed
+ * lazily, when read. As a result, stopwatches have sub-tick resolution,
+ * and their cost doesn't depend on how long they run.
+ *
+ * Timers are only used to periodically display the time of running
+ * stopwatches, and to wake up threads waiting for a stopwatch to reach
+ * a given time. Each stopwatch has a single one-shot timer, scheduled
+ * for the earliest of these events, and rescheduled by its callback.
+ * A stopped stopwatch has no scheduled timer, and costs no processor
+ * time at all.
  */
 
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <stdlib.h>
+#include <string.h>
 
 #include <lib/macros.h>
 #include <lib/shell.h>
 
+#include "clock.h"
 #include "condvar.h"
+#include "cpu.h"
 #include "main.h"
 #include "mutex.h"
-#include "panic.h"
 #include "sw.h"
-#include "thread.h"
+#include "tick.h"
 #include "timer.h"
 
+#define SW_NS_PER_SEC 1000000000UL
+
 /*
  * Display interval, in seconds.
  */
@@ -50,136 +68,368 @@
  */
 #define SW_MAX_WAIT 30
 
+/*
+ * Maximum number of stopwatches, and of laps per stopwatch.
+ */
+#define SW_MAX_STOPWATCHES  8
+#define SW_MAX_LAPS         16
+
+/*
+ * Name used by commands when no stopwatch name is given.
+ */
+#define SW_DEFAULT_NAME "sw"
+
+#define SW_NAME_SIZE 16
+
 /*
  * Stopwatch type.
  *
- * The mutex must be locked before accessing any member.
+ * All times are in nanoseconds. The wait and display times, as well as
+ * laps, are expressed as stopwatch times, i.e. as values of the elapsed
+ * time of the stopwatch, which only advances while it's running.
+ *
+ * The timer is armed if it's scheduled, or if its callback is about to
+ * run. In both cases, the callback reschedules it if needed, so there is
+ * no need to schedule it again.
+ *
+ * The sw mutex must be locked before accessing any member.
  */
 struct sw {
-    struct mutex mutex;
+    char name[SW_NAME_SIZE];
     struct condvar cv;
     struct timer timer;
-    unsigned long ticks;
-    bool timer_scheduled;
+    uint64_t start;
+    uint64_t accumulated;
+    uint64_t display_time;
+    uint64_t wait_time;
+    uint64_t laps[SW_MAX_LAPS];
+    unsigned int nr_laps;
+    bool running;
+    bool timer_armed;
     bool thread_waiting;
-    unsigned long wait_ticks;
 };
 
+static struct sw sw_stopwatches[SW_MAX_STOPWATCHES];
+static unsigned int sw_nr_stopwatches;
+static struct mutex sw_mutex;
+
+static uint64_t
+sw_get_time(const struct sw *sw, uint64_t now)
+{
+    if (!sw->running) {
+        return sw->accumulated;
+    }
+
+    return sw->accumulated + (now - sw->start);
+}
+
+static void
+sw_print_time(uint64_t time)
+{
+    unsigned long seconds;
+
+    seconds = cpu_div64(time, SW_NS_PER_SEC);
+    printf("%lu.%09lu\n", seconds,
+           (unsigned long)(time - ((uint64_t)seconds * SW_NS_PER_SEC)));
+}
+
 /*
- * Singleton instance.
+ * Schedule the timer of a stopwatch for its next event, if it's running
+ * and its timer isn't already armed.
+ *
+ * The delay is rounded up to whole ticks, and one tick is added, because
+ * the current tick has already partially elapsed, so that the timer never
+ * expires before the event. A timer armed before the stopwatch was
+ * restarted may expire before the new events, in which case it's simply
+ * rescheduled.
  */
-static struct sw *sw_instance;
+static void
+sw_arm(struct sw *sw, uint64_t now)
+{
+    uint64_t time, event;
+    unsigned long ticks;
 
-static struct sw *
-sw_get_instance(void)
+    if (!sw->running || sw->timer_armed) {
+        return;
+    }
+
+    time = sw_get_time(sw, now);
+    event = sw->display_time;
+
+    if (sw->thread_waiting && (sw->wait_time < event)) {
+        event = sw->wait_time;
+    }
+
+    ticks = (event > time)
+            ? cpu_div64(((event - time) * tick_get_freq()) + SW_NS_PER_SEC - 1,
+                        SW_NS_PER_SEC)
+            : 0;
+
+    sw->timer_armed = true;
+    timer_schedule(&sw->timer, timer_now() + ticks + 1, 0);
+}
+
+/*
+ * Cancel the timer of a stopwatch.
+ *
+ * Cancelling may wait for the timer callback to complete, and the callback
+ * locks the sw mutex, so it must be released while cancelling. The state
+ * of the stopwatch may change in the meantime, which is why the timer is
+ * rearmed if needed on return.
+ */
+static void
+sw_disarm(struct sw *sw)
 {
-    assert(sw_instance);
-    return sw_instance;
+    bool cancelled;
+
+    mutex_unlock(&sw_mutex);
+    cancelled = timer_cancel(&sw->timer);
+    mutex_lock(&sw_mutex);
+
+    /*
+     * If the timer wasn't cancelled, its callback ran and cleared the
+     * armed flag, unless it rescheduled the timer in the meantime.
+     */
+    if (cancelled) {
+        sw->timer_armed = false;
+    }
+
+    sw_arm(sw, clock_monotonic_ns());
 }
 
 static void
 sw_timer_run(void *arg)
 {
+    uint64_t now, time, interval;
     struct sw *sw;
 
     sw = arg;
 
-    mutex_lock(&sw->mutex);
+    mutex_lock(&sw_mutex);
 
-    if (!sw->timer_scheduled) {
+    sw->timer_armed = false;
+
+    if (!sw->running) {
         goto out;
     }
 
-    sw->ticks++;
+    now = clock_monotonic_ns();
+    time = sw_get_time(sw, now);
+
+    if (time >= sw->display_time) {
+        printf("%s: ", sw->name);
+        sw_print_time(time);
 
-    if ((sw->ticks % (THREAD_SCHED_FREQ * SW_DISPLAY_INTERVAL)) == 0) {
-        printf("%lu\n", sw->ticks);
+        /*
+         * Skip the display times missed if the timer thread was delayed.
+         */
+        interval = (uint64_t)SW_DISPLAY_INTERVAL * SW_NS_PER_SEC;
+        sw->display_time += interval
+                            * (cpu_div64(time - sw->display_time, interval) + 1);
     }
 
-    if (sw->thread_waiting && timer_ticks_occurred(sw->wait_ticks, sw->ticks)) {
+    if (sw->thread_waiting && (time >= sw->wait_time)) {
         sw->thread_waiting = false;
         condvar_signal(&sw->cv);
     }
 
-    timer_schedule(&sw->timer, timer_get_time(&sw->timer) + 1);
+    sw_arm(sw, now);
 
 out:
-    mutex_unlock(&sw->mutex);
+    mutex_unlock(&sw_mutex);
 }
 
 static struct sw *
-sw_create(void)
+sw_lookup(const char *name)
 {
-    struct sw *sw;
+    for (unsigned int i = 0; i < sw_nr_stopwatches; i++) {
+        if (strcmp(sw_stopwatches[i].name, name) == 0) {
+            return &sw_stopwatches[i];
+        }
+    }
+
+    return NULL;
+}
 
-    sw = malloc(sizeof(*sw));
+static struct sw *
+sw_create(const char *name)
+{
+    struct sw *sw;
 
-    if (!sw) {
+    if ((strlen(name) >= SW_NAME_SIZE)
+        || (sw_nr_stopwatches == ARRAY_SIZE(sw_stopwatches))) {
         return NULL;
     }
 
-    mutex_init(&sw->mutex);
+    sw = &sw_stopwatches[sw_nr_stopwatches];
+    sw_nr_stopwatches++;
+
+    strcpy(sw->name, name);
     condvar_init(&sw->cv);
-    timer_init(&sw->timer, sw_timer_run, sw);
-    sw->timer_scheduled = false;
+    timer_init(&sw->timer, sw_timer_run, sw, 0);
+    sw->accumulated = 0;
+    sw->nr_laps = 0;
+    sw->running = false;
+    sw->timer_armed = false;
     sw->thread_waiting = false;
     return sw;
 }
 
+static struct sw *
+sw_get(const char *name)
+{
+    struct sw *sw;
+
+    sw = sw_lookup(name);
+
+    if (!sw) {
+        printf("sw: error: %s: stopwatch not found\n", name);
+    }
+
+    return sw;
+}
+
 static void
-sw_schedule(struct sw *sw)
+sw_start(const char *name)
 {
-    if (sw->timer_scheduled) {
-        return;
+    struct sw *sw;
+    uint64_t now;
+
+    mutex_lock(&sw_mutex);
+
+    sw = sw_lookup(name);
+
+    if (!sw) {
+        sw = sw_create(name);
+
+        if (!sw) {
+            printf("sw_start: error: unable to create stopwatch\n");
+            goto out;
+        }
     }
 
-    sw->timer_scheduled = true;
-    timer_schedule(&sw->timer, timer_now() + 1);
+    now = clock_monotonic_ns();
+    sw->start = now;
+    sw->accumulated = 0;
+    sw->display_time = (uint64_t)SW_DISPLAY_INTERVAL * SW_NS_PER_SEC;
+    sw->nr_laps = 0;
+    sw->running = true;
+    sw_arm(sw, now);
+
+out:
+    mutex_unlock(&sw_mutex);
 }
 
 static void
-sw_start(struct sw *sw)
+sw_stop(const char *name)
 {
-    mutex_lock(&sw->mutex);
-    sw->ticks = 0;
-    sw_schedule(sw);
-    mutex_unlock(&sw->mutex);
+    struct sw *sw;
+
+    mutex_lock(&sw_mutex);
+
+    sw = sw_get(name);
+
+    if (sw && sw->running) {
+        sw->accumulated = sw_get_time(sw, clock_monotonic_ns());
+        sw->running = false;
+        sw_disarm(sw);
+    }
+
+    mutex_unlock(&sw_mutex);
 }
 
 static void
-sw_stop(struct sw *sw)
+sw_resume(const char *name)
 {
-    mutex_lock(&sw->mutex);
-    sw->timer_scheduled = false;
-    mutex_unlock(&sw->mutex);
+    struct sw *sw;
+    uint64_t now;
+
+    mutex_lock(&sw_mutex);
+
+    sw = sw_get(name);
+
+    if (sw && !sw->running) {
+        now = clock_monotonic_ns();
+        sw->start = now;
+        sw->running = true;
+        sw_arm(sw, now);
+    }
+
+    mutex_unlock(&sw_mutex);
 }
 
 static void
-sw_resume(struct sw *sw)
+sw_read(const char *name)
 {
-    mutex_lock(&sw->mutex);
-    sw_schedule(sw);
-    mutex_unlock(&sw->mutex);
+    struct sw *sw;
+    uint64_t prev;
+
+    mutex_lock(&sw_mutex);
+
+    sw = sw_get(name);
+
+    if (!sw) {
+        goto out;
+    }
+
+    sw_print_time(sw_get_time(sw, clock_monotonic_ns()));
+
+    prev = 0;
+
+    for (unsigned int i = 0; i < sw->nr_laps; i++) {
+        printf("lap %2u: ", i + 1);
+        sw_print_time(sw->laps[i] - prev);
+        prev = sw->laps[i];
+    }
+
+out:
+    mutex_unlock(&sw_mutex);
 }
 
-static unsigned long
-sw_read(struct sw *sw)
+static void
+sw_lap(const char *name)
 {
-    unsigned long ticks;
+    struct sw *sw;
+    uint64_t time, prev;
+
+    mutex_lock(&sw_mutex);
+
+    sw = sw_get(name);
+
+    if (!sw) {
+        goto out;
+    } else if (!sw->running) {
+        printf("sw_lap: error: stopwatch not running\n");
+        goto out;
+    } else if (sw->nr_laps == ARRAY_SIZE(sw->laps)) {
+        printf("sw_lap: error: too many laps\n");
+        goto out;
+    }
 
-    mutex_lock(&sw->mutex);
-    ticks = sw->ticks;
-    mutex_unlock(&sw->mutex);
+    time = sw_get_time(sw, clock_monotonic_ns());
+    prev = (sw->nr_laps == 0) ? 0 : sw->laps[sw->nr_laps - 1];
+    sw->laps[sw->nr_laps] = time;
+    sw->nr_laps++;
 
-    return ticks;
+    printf("lap %2u: ", sw->nr_laps);
+    sw_print_time(time - prev);
+
+out:
+    mutex_unlock(&sw_mutex);
 }
 
 static void
-sw_wait(struct sw *sw, unsigned long seconds)
+sw_wait(const char *name, unsigned long seconds)
 {
-    mutex_lock(&sw->mutex);
+    struct sw *sw;
+
+    mutex_lock(&sw_mutex);
+
+    sw = sw_get(name);
 
-    if (!sw->timer_scheduled) {
+    if (!sw) {
+        goto out;
+    } else if (!sw->running) {
         printf("sw_wait: error: stopwatch disabled\n");
         goto out;
     } else if (sw->thread_waiting) {
@@ -188,54 +438,91 @@ sw_wait(struct sw *sw, unsigned long seconds)
     }
 
     sw->thread_waiting = true;
-    sw->wait_ticks = sw->ticks + (seconds * THREAD_SCHED_FREQ);
+    sw->wait_time = sw_get_time(sw, clock_monotonic_ns())
+                    + ((uint64_t)seconds * SW_NS_PER_SEC);
+
+    /*
+     * The wait time may be earlier than the next display time, for which
+     * the timer may currently be scheduled.
+     */
+    sw_disarm(sw);
 
     do {
-        condvar_wait(&sw->cv, &sw->mutex);
+        condvar_wait(&sw->cv, &sw_mutex);
     } while (sw->thread_waiting);
 
 out:
-    mutex_unlock(&sw->mutex);
+    mutex_unlock(&sw_mutex);
+}
+
+static void
+sw_list(void)
+{
+    const struct sw *sw;
+    uint64_t now;
+
+    mutex_lock(&sw_mutex);
+
+    now = clock_monotonic_ns();
+
+    for (unsigned int i = 0; i < sw_nr_stopwatches; i++) {
+        sw = &sw_stopwatches[i];
+        printf("%-*s %-7s ", SW_NAME_SIZE, sw->name,
+               sw->running ? "running" : "stopped");
+        sw_print_time(sw_get_time(sw, now));
+    }
+
+    mutex_unlock(&sw_mutex);
+}
+
+/*
+ * Return the stopwatch name passed as the argument at the given index,
+ * or the default name if there is none.
+ */
+static const char *
+sw_shell_get_name(int argc, char **argv, int index)
+{
+    return (argc > index) ? argv[index] : SW_DEFAULT_NAME;
 }
 
 static void
 sw_shell_start(struct shell *shell, int argc, char **argv)
 {
     (void)shell;
-    (void)argc;
-    (void)argv;
 
-    sw_start(sw_get_instance());
+    sw_start(sw_shell_get_name(argc, argv, 1));
 }
 
 static void
 sw_shell_stop(struct shell *shell, int argc, char **argv)
 {
     (void)shell;
-    (void)argc;
-    (void)argv;
 
-    sw_stop(sw_get_instance());
+    sw_stop(sw_shell_get_name(argc, argv, 1));
 }
 
 static void
 sw_shell_resume(struct shell *shell, int argc, char **argv)
 {
     (void)shell;
-    (void)argc;
-    (void)argv;
 
-    sw_resume(sw_get_instance());
+    sw_resume(sw_shell_get_name(argc, argv, 1));
 }
 
 static void
 sw_shell_read(struct shell *shell, int argc, char **argv)
 {
     (void)shell;
-    (void)argc;
-    (void)argv;
 
-    printf("%lu\n", sw_read(sw_get_instance()));
+    sw_read(sw_shell_get_name(argc, argv, 1));
+}
+
+static void
+sw_shell_lap(struct shell *shell, int argc, char **argv)
+{
+    (void)shell;
+
+    sw_lap(sw_shell_get_name(argc, argv, 1));
 }
 
 static void
@@ -246,7 +533,7 @@ sw_shell_wait(struct shell *shell, int argc, char **argv)
 
     (void)shell;
 
-    if (argc != 2) {
+    if ((argc < 2) || (argc > 3)) {
         goto error;
     }
 
@@ -256,39 +543,52 @@ sw_shell_wait(struct shell *shell, int argc, char **argv)
         goto error;
     }
 
-    sw_wait(sw_get_instance(), seconds);
+    sw_wait(sw_shell_get_name(argc, argv, 2), seconds);
     return;
 
 error:
     shell_printf(shell, "sw_wait: error: invalid arguments\n");
 }
 
+static void
+sw_shell_list(struct shell *shell, int argc, char **argv)
+{
+    (void)shell;
+    (void)argc;
+    (void)argv;
+
+    sw_list();
+}
+
 static struct shell_cmd sw_shell_cmds[] = {
     SHELL_CMD_INITIALIZER("sw_start", sw_shell_start,
-        "sw_start",
-        "start the stopwatch"),
+        "sw_start [<name>]",
+        "start a stopwatch, creating it if needed"),
     SHELL_CMD_INITIALIZER("sw_stop", sw_shell_stop,
-        "sw_stop",
-        "stop the stopwatch"),
+        "sw_stop [<name>]",
+        "stop a stopwatch"),
     SHELL_CMD_INITIALIZER("sw_resume", sw_shell_resume,
-        "sw_resume",
-        "resume the stopwatch"),
+        "sw_resume [<name>]",
+        "resume a stopwatch"),
     SHELL_CMD_INITIALIZER("sw_read", sw_shell_read,
-        "sw_read",
-        "read the stopwatch time"),
+        "sw_read [<name>]",
+        "read the time and laps of a stopwatch"),
+    SHELL_CMD_INITIALIZER("sw_lap", sw_shell_lap,
+        "sw_lap [<name>]",
+        "record a lap, up to " QUOTE(SW_MAX_LAPS) " per stopwatch"),
     SHELL_CMD_INITIALIZER("sw_wait", sw_shell_wait,
-        "sw_wait <seconds>",
-        "wait for up to " QUOTE(SW_MAX_WAIT) " seconds"),
+        "sw_wait <seconds> [<name>]",
+        "wait for up to " QUOTE(SW_MAX_WAIT) " seconds of stopwatch time"),
+    SHELL_CMD_INITIALIZER("sw_list", sw_shell_list,
+        "sw_list",
+        "list stopwatches"),
 };
 
 void
 sw_setup(void)
 {
-    sw_instance = sw_create();
-
-    if (!sw_instance) {
-        panic("sw: error: unable to create stopwatch");
-    }
+    mutex_init(&sw_mutex);
+    sw_nr_stopwatches = 0;
 
     SHELL_REGISTER_CMDS(sw_shell_cmds, main_get_shell_cmd_set());
 }
@@ -32,9 +32,13 @@
 #include <lib/macros.h>
 #include <lib/list.h>
 
+#include "bootmem.h"
 #include "cpu.h"
+#include "mem.h"
 #include "panic.h"
+#include "pmap.h"
 #include "thread.h"
+#include "tick.h"
 #include "timer.h"
 
 /*
@@ -131,9 +135,74 @@ struct thread {
     unsigned int priority;
     struct thread *joiner;
     char name[THREAD_NAME_MAX_SIZE];
-    void *stack;
+    uintptr_t stack_top;
+    uintptr_t stack_floor;
+    uintptr_t stack_commit;
+    struct list stack_node;
+    unsigned long last_run;
 };
 
+/*
+ * Stack slots.
+ *
+ * The stack area (see pmap.h) is divided into fixed-size slots, and each
+ * thread is given a slot for its stack. A stack starts at the top of its
+ * slot, and may grow down to its floor, computed from the size requested
+ * at creation time. Pages between the floor and the lowest committed page
+ * are committed by the page fault handler, when the stack first grows into
+ * them. Pages below the floor are never committed, which makes them guard
+ * pages. Since the maximum stack size is a page less than the slot size,
+ * there is always at least one.
+ *
+ * Accessing the stack fields of a thread and the slot table is done with
+ * interrupts disabled, since they're shared with the page fault handler.
+ * Stack fields are also protected by the scheduler lock, since they're
+ * accessed by the idle thread to reclaim pages.
+ */
+#define THREAD_STACK_SLOT_SIZE  (THREAD_STACK_MAX_SIZE + PMAP_PAGE_SIZE)
+#define THREAD_NR_STACK_SLOTS   (PMAP_STACK_AREA_SIZE / THREAD_STACK_SLOT_SIZE)
+
+static struct thread *thread_stack_slots[THREAD_NR_STACK_SLOTS];
+
+/*
+ * List of threads with a stack, and next thread to examine when reclaiming
+ * stack pages.
+ *
+ * The scheduler lock is released between threads while reclaiming, so
+ * freeing the stack of the next thread to examine advances the cursor.
+ *
+ * The scheduler lock must be held when accessing these variables.
+ */
+static struct list thread_stack_list;
+static struct thread *thread_reclaim_next;
+
+/*
+ * Size, in bytes, of the stack region below the stack pointer of a thread
+ * that is always committed.
+ *
+ * Interrupt handlers run on a dedicated stack (see cpu_asm.S), but the
+ * interrupted thread stack still holds the frame pushed by the processor
+ * and the low level handler, as well as the call chain of cpu_intr_exit(),
+ * up to the context switch it may trigger. A page fault raised while the
+ * processor pushes the frame of an external interrupt occurs after the
+ * i8259 acknowledged it, so the vector is lost and never EOI'd, which,
+ * for IRQ0, stops the tick. The margin must therefore cover that stack
+ * usage, so that it never faults. It's small enough that a thread which
+ * doesn't use its stack only keeps its top page committed.
+ */
+#define THREAD_STACK_COMMIT_MARGIN 512
+
+/*
+ * Stack reclaiming parameters, in ticks.
+ *
+ * Every reclaim interval, the idle thread looks for threads that haven't
+ * run for at least the reclaim delay, and releases the pages below their
+ * current stack depth, except for the commit margin. Reclaimed pages are
+ * committed again on demand if the thread needs them later.
+ */
+#define THREAD_STACK_RECLAIM_INTERVAL   tick_get_freq()
+#define THREAD_STACK_RECLAIM_DELAY      (tick_get_freq() * 5)
+
 /*
  * Run queue singleton.
  */
@@ -154,15 +223,36 @@ void thread_load_context(struct thread *thread) __attribute__((noreturn));
 void thread_switch_context(struct thread *prev, struct thread *next);
 void thread_main(thread_fn_t fn, void *arg);
 
+static void thread_reclaim_stacks(unsigned long now);
+
 /*
  * Function implementing the idle thread.
+ *
+ * The idle thread runs when there is nothing else to do, which makes it
+ * a good place for background work, here reclaiming stack pages and zeroing
+ * free memory. The processor is only idled when there is no work left.
  */
 static void
 thread_idle(void *arg)
 {
+    unsigned long now, reclaim_ticks;
+
     (void)arg;
 
+    reclaim_ticks = timer_now() + THREAD_STACK_RECLAIM_INTERVAL;
+
     for (;;) {
+        now = timer_now();
+
+        if (timer_ticks_occurred(reclaim_ticks, now)) {
+            thread_reclaim_stacks(now);
+            reclaim_ticks = now + THREAD_STACK_RECLAIM_INTERVAL;
+        }
+
+        if (mem_idle_zero()) {
+            continue;
+        }
+
         cpu_idle();
     }
 }
@@ -405,6 +495,8 @@ thread_runq_schedule(struct thread_runq *runq)
     next = thread_runq_get_next(runq);
 
     if (prev != next) {
+        prev->last_run = timer_now();
+
         /*
          * When switching context, it is extremely important that no
          * data access generated by the compiler "leak" across the switch.
@@ -658,12 +750,256 @@ thread_stack_forge(char *stack_addr, size_t stack_size,
     return stack;
 }
 
+/*
+ * Allocate memory for a thread.
+ *
+ * Threads created at boot time, i.e. before the scheduler is enabled, are
+ * permanent, and their resources are obtained from the boot allocator.
+ * Such threads may not be joined.
+ *
+ * Boot memory can't be released, which is why it's silently leaked if
+ * passed to thread_free(), e.g. when creating a thread fails at boot time.
+ */
+static void *
+thread_alloc(size_t size)
+{
+    if (!bootmem_sealed()) {
+        return bootmem_alloc(size);
+    }
+
+    return malloc(size);
+}
+
 static void
-thread_init(struct thread *thread, thread_fn_t fn, void *arg,
-            const char *name, char *stack, size_t stack_size,
-            unsigned int priority)
+thread_free(void *ptr)
 {
-    assert(P2ALIGNED((uintptr_t)stack, THREAD_STACK_ALIGN));
+    if (bootmem_contains(ptr)) {
+        return;
+    }
+
+    free(ptr);
+}
+
+static uintptr_t
+thread_stack_slot_top(size_t i)
+{
+    return PMAP_STACK_AREA_START + ((i + 1) * THREAD_STACK_SLOT_SIZE);
+}
+
+static struct thread *
+thread_stack_slot_lookup(uintptr_t addr)
+{
+    if ((addr < PMAP_STACK_AREA_START)
+        || (addr >= (PMAP_STACK_AREA_START + PMAP_STACK_AREA_SIZE))) {
+        return NULL;
+    }
+
+    return thread_stack_slots[(addr - PMAP_STACK_AREA_START)
+                              / THREAD_STACK_SLOT_SIZE];
+}
+
+/*
+ * Commit stack pages down to the given page-aligned address.
+ *
+ * Return false if the page pool is exhausted.
+ */
+static bool
+thread_stack_commit(struct thread *thread, uintptr_t va)
+{
+    uintptr_t pa;
+
+    assert(!cpu_intr_enabled());
+    assert(va >= thread->stack_floor);
+
+    while (thread->stack_commit > va) {
+        pa = pmap_page_alloc();
+
+        if (pa == 0) {
+            return false;
+        }
+
+        thread->stack_commit -= PMAP_PAGE_SIZE;
+        pmap_enter(thread->stack_commit, pa);
+    }
+
+    return true;
+}
+
+/*
+ * Return the lowest address of the committed region required for the
+ * given stack pointer, i.e. the page containing the commit margin below
+ * it, bounded by the stack floor.
+ */
+static uintptr_t
+thread_stack_margin(const struct thread *thread, uintptr_t sp)
+{
+    if ((sp - thread->stack_floor) < THREAD_STACK_COMMIT_MARGIN) {
+        return thread->stack_floor;
+    }
+
+    return P2ALIGN(sp - THREAD_STACK_COMMIT_MARGIN, PMAP_PAGE_SIZE);
+}
+
+/*
+ * Release committed stack pages below the given page-aligned address.
+ */
+static void
+thread_stack_decommit(struct thread *thread, uintptr_t va)
+{
+    assert(!cpu_intr_enabled());
+
+    while (thread->stack_commit < va) {
+        pmap_page_free(pmap_remove(thread->stack_commit));
+        thread->stack_commit += PMAP_PAGE_SIZE;
+    }
+}
+
+/*
+ * Allocate a stack.
+ *
+ * A free slot is reserved for the given thread, and only the top page of
+ * the stack, immediately used to forge the initial state of the thread,
+ * and which also contains the commit margin, is committed. The given size
+ * must be page-aligned.
+ *
+ * Return the lowest address of the stack, or NULL if the top page can't
+ * be committed, in which case thread creation fails with ENOMEM.
+ */
+static void *
+thread_alloc_stack(struct thread *thread, size_t stack_size)
+{
+    uintptr_t top;
+    uint32_t eflags;
+    bool committed;
+
+    assert(P2ALIGNED(stack_size, PMAP_PAGE_SIZE));
+    assert(stack_size <= THREAD_STACK_MAX_SIZE);
+
+    eflags = thread_lock_scheduler();
+
+    for (size_t i = 0; i < ARRAY_SIZE(thread_stack_slots); i++) {
+        if (thread_stack_slots[i]) {
+            continue;
+        }
+
+        top = thread_stack_slot_top(i);
+        thread->stack_top = top;
+        thread->stack_floor = top - stack_size;
+        thread->stack_commit = top;
+
+        committed = thread_stack_commit(thread,
+                                        thread_stack_margin(thread, top));
+
+        if (!committed) {
+            thread_stack_decommit(thread, top);
+            break;
+        }
+
+        thread_stack_slots[i] = thread;
+        list_insert_tail(&thread_stack_list, &thread->stack_node);
+        thread_unlock_scheduler(eflags, false);
+        return (void *)thread->stack_floor;
+    }
+
+    thread_unlock_scheduler(eflags, false);
+    return NULL;
+}
+
+/*
+ * Return the thread following the given one in the list of threads with
+ * a stack, or NULL if it's the last one.
+ */
+static struct thread *
+thread_stack_list_next(struct thread *thread)
+{
+    struct list *node;
+
+    node = list_next(&thread->stack_node);
+
+    if (list_end(&thread_stack_list, node)) {
+        return NULL;
+    }
+
+    return list_entry(node, struct thread, stack_node);
+}
+
+static void
+thread_free_stack(struct thread *thread)
+{
+    uintptr_t top;
+    uint32_t eflags;
+
+    top = thread->stack_top;
+
+    eflags = thread_lock_scheduler();
+    assert(thread_stack_slot_lookup(top - 1) == thread);
+    thread_stack_decommit(thread, top);
+    thread_stack_slots[(top - 1 - PMAP_STACK_AREA_START)
+                       / THREAD_STACK_SLOT_SIZE] = NULL;
+
+    if (thread_reclaim_next == thread) {
+        thread_reclaim_next = thread_stack_list_next(thread);
+    }
+
+    list_remove(&thread->stack_node);
+    thread_unlock_scheduler(eflags, false);
+}
+
+/*
+ * Reclaim the stack pages of threads that haven't run for a long time.
+ *
+ * The scheduler lock is acquired and released for each thread, to keep
+ * interrupt and scheduling latencies low.
+ */
+static void
+thread_reclaim_stacks(unsigned long now)
+{
+    struct thread *thread;
+    uint32_t eflags;
+
+    eflags = thread_lock_scheduler();
+
+    thread = list_empty(&thread_stack_list)
+             ? NULL
+             : list_first_entry(&thread_stack_list, struct thread, stack_node);
+
+    while (thread) {
+        if ((thread->state == THREAD_STATE_SLEEPING)
+            && timer_ticks_expired(thread->last_run
+                                   + THREAD_STACK_RECLAIM_DELAY, now)) {
+            thread_stack_decommit(thread,
+                                  thread_stack_margin(thread,
+                                                      (uintptr_t)thread->sp));
+        }
+
+        thread_reclaim_next = thread_stack_list_next(thread);
+
+        thread_unlock_scheduler(eflags, false);
+        eflags = thread_lock_scheduler();
+
+        thread = thread_reclaim_next;
+    }
+
+    thread_reclaim_next = NULL;
+    thread_unlock_scheduler(eflags, false);
+}
+
+static void
+thread_init(struct thread *thread, const char *name, unsigned int priority)
+{
+    thread->state = THREAD_STATE_RUNNING;
+    thread->priority = priority;
+    thread->joiner = NULL;
+    thread_set_name(thread, name);
+    thread->stack_top = 0;
+    thread->last_run = 0;
+}
+
+static int
+thread_init_stack(struct thread *thread, thread_fn_t fn, void *arg,
+                  size_t stack_size)
+{
+    void *stack;
 
     /*
      * New threads are created in a state that is similar to preempted threads,
@@ -679,15 +1015,15 @@ thread_init(struct thread *thread, thread_fn_t fn, void *arg,
      * the new thread has been preempted.
      */
 
-    if (stack) {
-        thread->sp = thread_stack_forge(stack, stack_size, fn, arg);
+    stack = thread_alloc_stack(thread, stack_size);
+
+    if (!stack) {
+        return ENOMEM;
     }
 
-    thread->state = THREAD_STATE_RUNNING;
-    thread->priority = priority;
-    thread->joiner = NULL;
-    thread_set_name(thread, name);
-    thread->stack = stack;
+    assert(P2ALIGNED((uintptr_t)stack, THREAD_STACK_ALIGN));
+    thread->sp = thread_stack_forge(stack, stack_size, fn, arg);
+    return 0;
 }
 
 int
@@ -696,28 +1032,33 @@ thread_create(struct thread **threadp, thread_fn_t fn, void *arg,
 {
     struct thread *thread;
     uint32_t eflags;
-    void *stack;
+    int error;
 
     assert(fn);
 
-    thread = malloc(sizeof(*thread));
-
-    if (!thread) {
-        return ENOMEM;
-    }
-
     if (stack_size < THREAD_STACK_MIN_SIZE) {
         stack_size = THREAD_STACK_MIN_SIZE;
     }
 
-    stack = malloc(stack_size);
+    stack_size = P2ROUND(stack_size, PMAP_PAGE_SIZE);
 
-    if (!stack) {
-        free(thread);
+    if (stack_size > THREAD_STACK_MAX_SIZE) {
+        return EINVAL;
+    }
+
+    thread = thread_alloc(sizeof(*thread));
+
+    if (!thread) {
         return ENOMEM;
     }
 
-    thread_init(thread, fn, arg, name, stack, stack_size, priority);
+    thread_init(thread, name, priority);
+    error = thread_init_stack(thread, fn, arg, stack_size);
+
+    if (error) {
+        thread_free(thread);
+        return error;
+    }
 
     eflags = thread_lock_scheduler();
     thread_runq_add(&thread_runq, thread);
@@ -735,8 +1076,8 @@ thread_destroy(struct thread *thread)
 {
     assert(thread_is_dead(thread));
 
-    free(thread->stack);
-    free(thread);
+    thread_free_stack(thread);
+    thread_free(thread);
 }
 
 void
@@ -781,26 +1122,67 @@ thread_self(void)
     return thread_runq_get_current(&thread_runq);
 }
 
+bool
+thread_handle_stack_fault(uintptr_t addr)
+{
+    struct thread *thread;
+
+    assert(!cpu_intr_enabled());
+
+    thread = thread_stack_slot_lookup(addr);
+
+    if (!thread
+        || (addr < thread->stack_floor)
+        || (addr >= thread->stack_commit)) {
+        return false;
+    }
+
+    if (!thread_stack_commit(thread, P2ALIGN(addr, PMAP_PAGE_SIZE))) {
+        return false;
+    }
+
+    /*
+     * Also restore the commit margin below the new stack depth, so that
+     * interrupts never fault. This is only best effort, since failing
+     * doesn't prevent the thread from resuming.
+     */
+    thread_stack_commit(thread, thread_stack_margin(thread, addr));
+    return true;
+}
+
+bool
+thread_stack_guard_contains(uintptr_t addr)
+{
+    struct thread *thread;
+
+    thread = thread_stack_slot_lookup(addr);
+    return thread && (addr < thread->stack_floor);
+}
+
 static struct thread *
 thread_create_idle(void)
 {
     struct thread *idle;
-    void *stack;
+    int error;
 
-    idle = malloc(sizeof(*idle));
+    idle = thread_alloc(sizeof(*idle));
 
     if (!idle) {
         panic("thread: unable to allocate idle thread");
     }
 
-    stack = malloc(THREAD_STACK_MIN_SIZE);
+    /*
+     * Since stack pages are committed on demand, there is no reason to
+     * restrict the stack of the idle thread, which also reclaims stack
+     * pages, and is interrupted more than any other thread.
+     */
+    thread_init(idle, "idle", THREAD_IDLE_PRIORITY);
+    error = thread_init_stack(idle, thread_idle, NULL, THREAD_STACK_MAX_SIZE);
 
-    if (!stack) {
+    if (error) {
         panic("thread: unable to allocate idle thread stack");
     }
 
-    thread_init(idle, thread_idle, NULL, "idle",
-                stack, THREAD_STACK_MIN_SIZE, THREAD_IDLE_PRIORITY);
     return idle;
 }
 
@@ -812,7 +1194,7 @@ thread_runq_init(struct thread_runq *runq)
      * scheduling functions called before the scheduler is running from
      * triggering a context switch.
      */
-    thread_init(&thread_dummy, NULL, NULL, "dummy", NULL, 0, 0);
+    thread_init(&thread_dummy, "dummy", 0);
     runq->current = &thread_dummy;
     runq->yield = false;
     runq->preempt_level = 1;
@@ -832,6 +1214,7 @@ thread_runq_init_idle(struct thread_runq *runq)
 void
 thread_bootstrap(void)
 {
+    list_init(&thread_stack_list);
     thread_runq_init(&thread_runq);
 }
 
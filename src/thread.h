@@ -61,6 +61,16 @@
  * of the stack. On systems with virtual memory, guard pages can be used to
  * achieve an even more reliable effect, although at greater cost.
  *
+ * In X1, stacks are demand-paged. Creating a thread reserves a range of
+ * virtual addresses for its stack, large enough for the requested size,
+ * but only the top page is actually backed by physical memory. Deeper
+ * pages are committed by the page fault handler as the stack grows, and
+ * accessing memory below the requested size, which is never committed,
+ * is reported as a stack overflow. Pages below the current depth of
+ * threads that haven't run for a long time are reclaimed by the idle
+ * thread. As a result, a thread only costs as much memory as it actually
+ * uses, which makes generous stack sizes affordable.
+ *
  * A major concept around (kernel) threads is preemption. Disabling preemption
  * means that the current thread may not be preempted, i.e. it will keep
  * running until preemption is reenabled. Therefore, it's not possible for a
@@ -85,17 +95,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
-
-/*
- * The scheduling frequency is the rate at which the clock used for scheduling
- * ticks. On each tick, the scheduler may mark the currently running thread to
- * yield.
- *
- * This implementation uses periodic ticks, but if the underlying hardware
- * supports reprogramming without losing track of time, a dynamic tick
- * implementation could be used.
- */
-#define THREAD_SCHED_FREQ 100
+#include <stdint.h>
 
 /*
  * Maximum size of thread names, including the null terminating character.
@@ -107,6 +107,14 @@
  */
 #define THREAD_STACK_MIN_SIZE 512
 
+/*
+ * Maximum size of thread stacks.
+ *
+ * This is the size of the virtual range reserved for each stack, minus
+ * a page that is never committed, and always acts as a guard page.
+ */
+#define THREAD_STACK_MAX_SIZE (60 * 1024)
+
 /*
  * Total number of thread priorities.
  */
@@ -168,6 +176,14 @@ void thread_setup(void);
  *
  * A pointer to the new thread is returned into *threadp, if the latter isn't
  * NULL.
+ *
+ * The stack size is rounded up to the page size. Since stack pages are
+ * committed on demand, it should be chosen for the worst case. If it is
+ * larger than THREAD_STACK_MAX_SIZE, EINVAL is returned.
+ *
+ * Threads created at boot time, before the scheduler is enabled, are
+ * permanent. Their thread structure is allocated from the boot allocator,
+ * and they may not be joined.
  */
 int thread_create(struct thread **threadp, thread_fn_t fn, void *arg,
                   const char *name, size_t stack_size, unsigned int priority);
@@ -200,6 +216,25 @@ struct thread * thread_self(void);
  */
 const char * thread_name(const struct thread *thread);
 
+/*
+ * Handle a page fault on a thread stack.
+ *
+ * If the given address is inside the stack of a thread, but below the pages
+ * already committed, commit the missing pages and return true. Otherwise,
+ * i.e. if the fault isn't caused by stack growth, return false.
+ *
+ * This function is called by the page fault handler, with interrupts
+ * disabled.
+ */
+bool thread_handle_stack_fault(uintptr_t addr);
+
+/*
+ * Check whether the given address is below the stack limit of a thread.
+ *
+ * This function is used by the fault handlers to report stack overflows.
+ */
+bool thread_stack_guard_contains(uintptr_t addr);
+
 /*
  * Yield the processor.
  *
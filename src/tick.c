@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <lib/macros.h>
+#include <lib/shell.h>
+
+#include "boot.h"
+#include "cpu.h"
+#include "hpet.h"
+#include "i8254.h"
+#include "lapic.h"
+#include "main.h"
+#include "mutex.h"
+#include "panic.h"
+#include "thread.h"
+#include "tick.h"
+#include "timer.h"
+
+enum tick_source {
+    TICK_SOURCE_I8254,
+    TICK_SOURCE_LAPIC,
+    TICK_SOURCE_HPET,
+};
+
+static enum tick_source tick_source;
+
+/*
+ * Tick frequency.
+ *
+ * Reading the frequency is atomic, and requires no synchronization. The
+ * mutex serializes frequency changes.
+ */
+static unsigned int tick_freq;
+static struct mutex tick_mutex;
+
+static bool
+tick_freq_valid(unsigned int freq)
+{
+    return (freq >= TICK_MIN_FREQ) && (freq <= TICK_MAX_FREQ);
+}
+
+static void
+tick_program(unsigned int freq)
+{
+    switch (tick_source) {
+    case TICK_SOURCE_LAPIC:
+        lapic_start_tick(freq);
+        break;
+    case TICK_SOURCE_HPET:
+        hpet_start_tick(freq);
+        break;
+    default:
+        i8254_set_freq(freq);
+    }
+}
+
+unsigned int
+tick_get_freq(void)
+{
+    return tick_freq;
+}
+
+int
+tick_set_freq(unsigned int freq)
+{
+    unsigned int old_freq;
+    uint32_t eflags;
+
+    if (!tick_freq_valid(freq)) {
+        return EINVAL;
+    }
+
+    mutex_lock(&tick_mutex);
+
+    old_freq = tick_freq;
+
+    if (freq == old_freq) {
+        goto out;
+    }
+
+    /*
+     * Preemption is disabled until timers are rescaled, so that they can't
+     * be processed relative to the new frequency in the meantime. Ticks
+     * may still be reported, but processing them is then deferred to the
+     * timer thread, which runs once preemption is enabled again.
+     */
+    thread_preempt_disable();
+
+    eflags = cpu_intr_save();
+    tick_program(freq);
+    tick_freq = freq;
+    cpu_intr_restore(eflags);
+
+    timer_rescale(old_freq, freq);
+
+    thread_preempt_enable();
+
+out:
+    mutex_unlock(&tick_mutex);
+    return 0;
+}
+
+static void
+tick_shell_freq(struct shell *shell, int argc, char **argv)
+{
+    unsigned int freq;
+    int ret, error;
+
+    if (argc == 1) {
+        printf("tick: frequency: %u Hz\n", tick_get_freq());
+        return;
+    } else if (argc != 2) {
+        goto error;
+    }
+
+    ret = sscanf(argv[1], "%u", &freq);
+
+    if (ret != 1) {
+        goto error;
+    }
+
+    error = tick_set_freq(freq);
+
+    if (error) {
+        goto error;
+    }
+
+    return;
+
+error:
+    shell_printf(shell, "tick_freq: error: invalid arguments\n");
+}
+
+static struct shell_cmd tick_shell_cmds[] = {
+    SHELL_CMD_INITIALIZER("tick_freq", tick_shell_freq,
+        "tick_freq [<hz>]",
+        "display or set the tick frequency, between "
+        QUOTE(TICK_MIN_FREQ) " and " QUOTE(TICK_MAX_FREQ) " Hz"),
+};
+
+void
+tick_setup(void)
+{
+    unsigned int freq;
+    const char *value;
+
+    mutex_init(&tick_mutex);
+    tick_freq = TICK_DEFAULT_FREQ;
+
+    value = boot_get_option("tick_freq");
+
+    if (value) {
+        if ((sscanf(value, "%u", &freq) == 1) && tick_freq_valid(freq)) {
+            tick_freq = freq;
+        } else {
+            printf("tick: warning: invalid frequency, using default\n");
+        }
+    }
+
+    /*
+     * The local APIC timer is preferred, since it's the cheapest to program
+     * and acknowledge, followed by the HPET, which is more accurate than
+     * the i8254. The i8254 remains the tick source if neither is available.
+     */
+    if (lapic_start_tick(tick_freq) == 0) {
+        tick_source = TICK_SOURCE_LAPIC;
+    } else if (hpet_start_tick(tick_freq) == 0) {
+        tick_source = TICK_SOURCE_HPET;
+    } else {
+        tick_source = TICK_SOURCE_I8254;
+        i8254_set_freq(tick_freq);
+    }
+}
+
+void
+tick_setup_shell(void)
+{
+    SHELL_REGISTER_CMDS(tick_shell_cmds, main_get_shell_cmd_set());
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * Tick management.
+ *
+ * The tick is a periodic interrupt, raised at the scheduling frequency.
+ * On each tick, the scheduler may mark the currently running thread to
+ * yield, and the timer module advances its time, which is counted in
+ * ticks. The tick frequency therefore determines both the length of time
+ * slices and the resolution of timers.
+ *
+ * This implementation uses periodic ticks, but if the underlying hardware
+ * supports reprogramming without losing track of time, a dynamic tick
+ * implementation could be used.
+ *
+ * The tick source is selected at boot, among the local APIC timer, the
+ * HPET and the i8254, by order of preference. The frequency may be set
+ * at boot with the tick_freq=<hz> kernel command line option, and changed
+ * at runtime with the tick_freq shell command. Higher frequencies improve
+ * resolution and latencies, at the cost of more interrupt processing.
+ */
+
+#ifndef TICK_H
+#define TICK_H
+
+/*
+ * Default and allowed tick frequencies, in Hz.
+ *
+ * The minimum frequency is bounded by the range of the i8254 counter.
+ */
+#define TICK_DEFAULT_FREQ   100
+#define TICK_MIN_FREQ       20
+#define TICK_MAX_FREQ       10000
+
+/*
+ * Return the tick frequency, in Hz.
+ *
+ * This function may be called from any context.
+ */
+unsigned int tick_get_freq(void);
+
+/*
+ * Change the tick frequency.
+ *
+ * The tick source is reprogrammed, and the expiration times of scheduled
+ * timers are rescaled, so that they still expire after about the same
+ * amount of time, but never earlier.
+ *
+ * Return EINVAL if the frequency is out of range.
+ */
+int tick_set_freq(unsigned int freq);
+
+/*
+ * Initialize the tick module.
+ *
+ * This function selects the tick source, and starts it. The boot, i8254,
+ * hpet and lapic modules must be initialized.
+ */
+void tick_setup(void);
+
+/*
+ * Register the shell commands of the tick module.
+ *
+ * This function may only be called once the main shell command set is
+ * initialized.
+ */
+void tick_setup_shell(void);
+
+#endif /* TICK_H */
@@ -24,23 +24,33 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include <lib/list.h>
 #include <lib/macros.h>
+#include <lib/shell.h>
 
+#include "clock.h"
+#include "condvar.h"
 #include "cpu.h"
+#include "main.h"
 #include "mutex.h"
 #include "panic.h"
+#include "seqlock.h"
 #include "thread.h"
+#include "tick.h"
 #include "timer.h"
 
 #define TIMER_STACK_SIZE 4096
 
+#define TIMER_NS_PER_SEC 1000000000
+
 /*
  * When determining whether a point in time is in the future or the past,
  * it's important to remember that the value is always finite. Here,
  * the ticks use a 32-bits type (unsigned long on i386), so, assuming
- * a 100Hz frequency, time wraps around about every 497 days. Therefore,
+ * a 100Hz frequency, time wraps around about every 497 days (and about
+ * every 49 days at 1000Hz). Therefore,
  * the implementation needs a way to partition time between the future
  * and the past. To do so, it considers that all values from a reference
  * up to a threshold are in the future (except the present), and all other
@@ -55,37 +65,209 @@
 #define TIMER_THRESHOLD (((unsigned long)-1) / 2)
 
 /*
- * The current time, in ticks.
+ * Timing wheel parameters.
+ *
+ * Timers are stored in a hierarchical timing wheel, as described in
+ * "Hashed and Hierarchical Timing Wheels: Data Structures for the Efficient
+ * Implementation of a Timer Facility" by Varghese and Lauck. The wheel is
+ * made of levels, each with an array of slots, also called buckets. Each
+ * slot of the first level covers a single tick, and each slot of the next
+ * levels covers all the slots of the previous level. A timer is stored in
+ * the lowest level able to hold its scheduled time, relative to the current
+ * time of the wheel, in the slot selected by the corresponding bits of its
+ * scheduled time. Inserting and removing a timer is therefore done in
+ * constant time, unlike with a sorted list.
+ *
+ * When the wheel time reaches the start of the range covered by a slot of
+ * a higher level, the timers it contains are moved, or cascaded, to lower
+ * levels, where they eventually reach the first level, from which they're
+ * processed at their scheduled time. Cascading is linear in the number of
+ * timers in the slot, but each timer is cascaded at most once per level,
+ * and many timers, e.g. timeouts, are usually removed before that happens.
+ *
+ * Here, there are 4 levels of 256 slots, so that 32 bits of time are
+ * covered, i.e. the whole range of the ticks type.
+ */
+#define TIMER_WHEEL_BITS        8
+#define TIMER_WHEEL_SIZE        (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK        (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_NR_LEVELS   4
+
+#if (TIMER_WHEEL_BITS * TIMER_WHEEL_NR_LEVELS) != 32
+#error "timing wheel doesn't cover the range of ticks"
+#endif
+
+/*
+ * Number of bits in a bitmap word.
+ */
+#define TIMER_BITMAP_WORD_BITS  32
+
+/*
+ * Number of buckets in latency histograms.
+ */
+#define TIMER_STATS_HIST_SIZE   32
+
+/*
+ * Timing wheel level.
+ *
+ * The bitmap has a bit set for each slot that may contain timers. It
+ * allows finding the next timers without walking all slots. Bits are
+ * cleared lazily, when an empty slot is found during a bitmap lookup.
+ */
+struct timer_level {
+    struct list slots[TIMER_WHEEL_SIZE];
+    uint32_t bitmap[TIMER_WHEEL_SIZE / TIMER_BITMAP_WORD_BITS];
+};
+
+/*
+ * Timer classes, for the purpose of statistics.
+ */
+enum timer_class {
+    TIMER_CLASS_SOFTIRQ,
+    TIMER_CLASS_THREAD,
+    TIMER_NR_CLASSES,
+};
+
+/*
+ * Expiration latency statistics.
+ *
+ * The latency is the time between the expiration time of a timer and
+ * the moment its callback function is called, in nanoseconds. Bucket i
+ * of the histogram counts latencies between 2^i and 2^(i+1) - 1, except
+ * for the first bucket, which also counts null latencies, and the last
+ * one, which also counts all higher latencies.
+ */
+struct timer_stats {
+    unsigned long hist[TIMER_STATS_HIST_SIZE];
+    unsigned long nr_timers;
+    uint64_t max_latency;
+};
+
+/*
+ * The current time, in ticks, and the value of the monotonic clock when
+ * the current tick was reported.
+ *
+ * The latter is the reference from which the expiration time of timers
+ * is converted to nanoseconds.
+ *
+ * These variables are written by the tick interrupt handler. They may be
+ * read with interrupts disabled, or through the timer seqlock, so that
+ * reading the time never requires disabling interrupts.
  */
+static struct seqlock timer_seqlock;
 static unsigned long timer_ticks;
+static uint64_t timer_tick_ns;
 
 /*
- * List of timers, sorted by time.
+ * The timing wheel.
+ *
+ * The wheel time is the next tick to process. It lags behind the current
+ * time while timers are being processed, and jumps forward over ticks
+ * where there is nothing to do.
  *
- * The timer mutex must be locked when accessing the timer list.
+ * The number of timers only accounts for timers on the wheel, or about to
+ * be processed, and excludes timers deferred to the timer thread.
+ *
+ * The timing wheel is processed either on interrupt exit, in softirq
+ * context, or by the timer thread with preemption disabled. Softirq
+ * processing only occurs if the interrupted context had preemption
+ * enabled, which makes disabling preemption enough to serialize access
+ * to the wheel. Since cascading is linear in the number of timers of a
+ * slot, this may slightly increase scheduling latencies, but it allows
+ * timer callbacks to schedule and cancel timers from softirq context,
+ * where locking a mutex is impossible.
+ *
+ * Preemption must be disabled when accessing the timing wheel.
  */
-static struct list timer_list;
-static struct mutex timer_mutex;
+static struct timer_level timer_levels[TIMER_WHEEL_NR_LEVELS];
+static unsigned long timer_wheel_ticks;
+static unsigned long timer_nr_timers;
+
+/*
+ * True while the timing wheel is processed.
+ *
+ * While processing, the wheel time is that of the event being processed,
+ * and the wheel may temporarily be empty while the expired timers are
+ * handled, so it must not be resynchronized with the current time.
+ *
+ * Preemption must be disabled when accessing this variable.
+ */
+static bool timer_wheel_processing;
+
+/*
+ * True while timers are processed in softirq context.
+ *
+ * Interrupts must be disabled when accessing this variable.
+ */
+static bool timer_softirq_active;
 
 /*
- * The timer thread, which provides context for all timer callbacks.
+ * The timer thread, which provides context for the callbacks of timers
+ * that may sleep, i.e. timers not created with TIMER_SOFTIRQ.
  */
 static struct thread *timer_thread;
 
 /*
- * True if the timer list is empty.
+ * Expired timers deferred to the timer thread, in expiration order.
+ *
+ * Preemption must be disabled when accessing this list.
+ */
+static struct list timer_deferred_list;
+
+/*
+ * Timers scheduled with interrupts disabled, waiting to be inserted in the
+ * timing wheel.
+ *
+ * Interrupt handlers may interrupt a context accessing the timing wheel,
+ * since the wheel is only protected by disabling preemption, which means
+ * they can't directly insert timers. Instead, these timers are queued on
+ * this list, which only takes a few instructions, and the list is drained
+ * into the timing wheel the next time it is processed, normally on exit
+ * from the same interrupt.
+ *
+ * Interrupts must be disabled when accessing this list.
+ */
+static struct list timer_pending_list;
+
+/*
+ * Timer whose callback is currently running in the timer thread, if any.
+ *
+ * The condition variable is signalled when the callback returns, so that
+ * threads cancelling that timer may wait for its completion. There is no
+ * need for such tracking in softirq context, since softirq processing
+ * completes before the interrupted thread resumes.
+ *
+ * The timer mutex must be locked when accessing these variables.
+ */
+static struct timer *timer_current;
+static struct mutex timer_mutex;
+static struct condvar timer_cv;
+
+/*
+ * True if there are no timers.
  *
- * This is a copy of list_empty(&timer_list) which may be used from
+ * This is a copy of (timer_nr_timers == 0) which may be used from
  * interrupt context, where locking a mutex is impossible.
  *
  * Interrupts must be disabled when accessing this variable.
  */
-static bool timer_list_empty;
+static bool timer_wheel_empty;
 
 /*
- * Time in ticks of the first timer on the timer list.
+ * Statistics, per timer class, and largest number of timers expired in
+ * a single pass over the timing wheel.
  *
- * Only valid if the list isn't empty.
+ * Preemption must be disabled when accessing these variables.
+ */
+static struct timer_stats timer_stats[TIMER_NR_CLASSES];
+static unsigned long timer_max_batch;
+
+/*
+ * Time in ticks at which the timing wheel must be processed next.
+ *
+ * This is the time of the next event on the timing wheel, which may be
+ * earlier than the time of the first timer. Only valid if the wheel isn't
+ * empty.
  *
  * Interrupts must be disabled when accessing this variable.
  */
@@ -108,7 +290,11 @@ timer_work_pending(void)
 {
     assert(!cpu_intr_enabled());
 
-    return !timer_list_empty
+    if (!list_empty(&timer_pending_list)) {
+        return true;
+    }
+
+    return !timer_wheel_empty
            && timer_ticks_occurred(timer_wakeup_ticks, timer_ticks);
 }
 
@@ -118,204 +304,1145 @@ timer_scheduled(const struct timer *timer)
     return !list_node_unlinked(&timer->node);
 }
 
-static bool
-timer_expired(const struct timer *timer, unsigned long ref)
-{
-    return timer_ticks_expired(timer->ticks, ref);
-}
-
 static bool
 timer_occurred(const struct timer *timer, unsigned long ref)
 {
     return timer_ticks_occurred(timer->ticks, ref);
 }
 
-static void
-timer_process(struct timer *timer)
+/*
+ * Return the time elapsed since the given time in ticks, in nanoseconds.
+ *
+ * The given time must not be in the future.
+ */
+static uint64_t
+timer_ns_since(unsigned long ticks)
 {
-    timer->fn(timer->arg);
+    unsigned long elapsed, seq;
+    uint64_t tick_ns, now;
+
+    do {
+        seq = seqlock_read_begin(&timer_seqlock);
+        tick_ns = timer_tick_ns;
+        elapsed = timer_ticks - ticks;
+    } while (seqlock_read_retry(&timer_seqlock, seq));
+
+    now = clock_monotonic_ns();
+    return ((now > tick_ns) ? (now - tick_ns) : 0)
+           + ((uint64_t)elapsed * (TIMER_NS_PER_SEC / tick_get_freq()));
 }
 
 static void
-timer_process_list(unsigned long now)
+timer_stats_record(struct timer_stats *stats, uint64_t latency)
 {
-    struct timer *timer;
-    uint32_t eflags;
+    unsigned int index;
+    uint32_t value;
 
-    mutex_lock(&timer_mutex);
+    /*
+     * Computing the index from a 32-bits value avoids calling a libgcc
+     * routine to count the leading zeroes of a 64-bits value.
+     */
+    value = (latency > (uint32_t)-1) ? (uint32_t)-1 : latency;
+    index = (value == 0) ? 0 : (sizeof(value) * 8) - __builtin_clz(value) - 1;
 
-    while (!list_empty(&timer_list)) {
-        timer = list_first_entry(&timer_list, typeof(*timer), node);
+    if (index >= ARRAY_SIZE(stats->hist)) {
+        index = ARRAY_SIZE(stats->hist) - 1;
+    }
 
-        if (!timer_occurred(timer, now)) {
-            break;
-        }
+    stats->hist[index]++;
+    stats->nr_timers++;
 
-        list_remove(&timer->node);
-        list_node_init(&timer->node);
-        mutex_unlock(&timer_mutex);
+    if (latency > stats->max_latency) {
+        stats->max_latency = latency;
+    }
+}
+
+/*
+ * Run the callback function of an expired timer.
+ *
+ * The given time is the expiration time of the timer, which may differ
+ * from its current time if it's periodic, and was already rearmed.
+ */
+static void
+timer_process(struct timer *timer, unsigned long ticks)
+{
+    enum timer_class class;
+    uint64_t latency;
 
-        timer_process(timer);
+    class = (timer->flags & TIMER_SOFTIRQ)
+            ? TIMER_CLASS_SOFTIRQ
+            : TIMER_CLASS_THREAD;
+    latency = timer_ns_since(ticks);
 
-        mutex_lock(&timer_mutex);
-    }
+    thread_preempt_disable();
+    timer_stats_record(&timer_stats[class], latency);
+    thread_preempt_enable();
 
-    eflags = cpu_intr_save();
+    timer->fn(timer->arg);
+}
 
-    timer_list_empty = list_empty(&timer_list);
+static unsigned int
+timer_level_index(unsigned long ticks, unsigned int level)
+{
+    return (ticks >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+}
 
-    if (!timer_list_empty) {
-        timer = list_first_entry(&timer_list, typeof(*timer), node);
-        timer_wakeup_ticks = timer->ticks;
+static void
+timer_level_init(struct timer_level *level)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(level->slots); i++) {
+        list_init(&level->slots[i]);
     }
 
-    cpu_intr_restore(eflags);
+    for (size_t i = 0; i < ARRAY_SIZE(level->bitmap); i++) {
+        level->bitmap[i] = 0;
+    }
+}
 
-    mutex_unlock(&timer_mutex);
+static void
+timer_level_add(struct timer_level *level, unsigned int index,
+                struct timer *timer)
+{
+    list_insert_tail(&level->slots[index], &timer->node);
+    level->bitmap[index / TIMER_BITMAP_WORD_BITS]
+        |= (uint32_t)1 << (index % TIMER_BITMAP_WORD_BITS);
 }
 
 static void
-timer_run(void *arg)
+timer_level_clear(struct timer_level *level, unsigned int index)
 {
-    unsigned long now;
-    uint32_t eflags;
+    level->bitmap[index / TIMER_BITMAP_WORD_BITS]
+        &= ~((uint32_t)1 << (index % TIMER_BITMAP_WORD_BITS));
+}
 
-    (void)arg;
+/*
+ * Find the first non-empty slot of a level, starting from the given index.
+ *
+ * Return the index of the slot if found, TIMER_WHEEL_SIZE otherwise.
+ */
+static unsigned int
+timer_level_find(struct timer_level *level, unsigned int index)
+{
+    unsigned int word, bit;
+    uint32_t bits;
 
-    for (;;) {
-        thread_preempt_disable();
-        eflags = cpu_intr_save();
+    while (index < TIMER_WHEEL_SIZE) {
+        word = index / TIMER_BITMAP_WORD_BITS;
+        bit = index % TIMER_BITMAP_WORD_BITS;
+        bits = level->bitmap[word] & ~(((uint32_t)1 << bit) - 1);
 
-        for (;;) {
-            now = timer_ticks;
+        if (bits == 0) {
+            index = (word + 1) * TIMER_BITMAP_WORD_BITS;
+            continue;
+        }
 
-            if (timer_work_pending()) {
-                break;
-            }
+        /*
+         * The builtin function counts trailing zeroes, and is normally
+         * implemented with a single instruction (BSF on x86).
+         */
+        index = (word * TIMER_BITMAP_WORD_BITS) + __builtin_ctz(bits);
 
-            thread_sleep();
+        if (!list_empty(&level->slots[index])) {
+            return index;
         }
 
-        cpu_intr_restore(eflags);
-        thread_preempt_enable();
-
-        timer_process_list(now);
+        timer_level_clear(level, index);
+        index++;
     }
+
+    return TIMER_WHEEL_SIZE;
 }
 
-void
-timer_setup(void)
+static bool
+timer_level_empty(struct timer_level *level)
 {
-    int error;
+    return timer_level_find(level, 0) == TIMER_WHEEL_SIZE;
+}
 
-    timer_ticks = 0;
-    timer_list_empty = true;
+/*
+ * Insert a timer in the timing wheel.
+ *
+ * The level is selected from the distance between the scheduled time and
+ * the wheel time, and the slot from the bits of the scheduled time that
+ * correspond to that level. Timers scheduled in the past are inserted in
+ * the slot of the wheel time, so that they're processed next.
+ *
+ * Return the time at which the timing wheel must be processed for the timer.
+ */
+static unsigned long
+timer_wheel_add(struct timer *timer)
+{
+    unsigned long ticks, delta;
+    unsigned int level;
 
-    list_init(&timer_list);
-    mutex_init(&timer_mutex);
+    ticks = timer->ticks;
 
-    error = thread_create(&timer_thread, timer_run, NULL,
-                          "timer", TIMER_STACK_SIZE, THREAD_MAX_PRIORITY);
+    if (timer_ticks_expired(ticks, timer_wheel_ticks)) {
+        ticks = timer_wheel_ticks;
+    }
 
-    if (error) {
-        panic("timer: unable to create thread");
+    delta = ticks - timer_wheel_ticks;
+    level = 0;
+
+    while ((level < (TIMER_WHEEL_NR_LEVELS - 1))
+           && ((delta >> ((level + 1) * TIMER_WHEEL_BITS)) != 0)) {
+        level++;
     }
+
+    timer_level_add(&timer_levels[level], timer_level_index(ticks, level),
+                    timer);
+    return ticks;
 }
 
-unsigned long
-timer_now(void)
+/*
+ * Move the timers of a slot to lower levels.
+ *
+ * The slot is first detached, since timers may be inserted back into it,
+ * when their scheduled time is far enough in the future.
+ */
+static void
+timer_wheel_cascade(unsigned int level, unsigned int index)
 {
-    unsigned long ticks;
-    uint32_t eflags;
+    struct timer *timer;
+    struct list timers;
 
-    eflags = cpu_intr_save();
-    ticks = timer_ticks;
-    cpu_intr_restore(eflags);
+    list_set_head(&timers, &timer_levels[level].slots[index]);
+    list_init(&timer_levels[level].slots[index]);
+    timer_level_clear(&timer_levels[level], index);
 
-    return ticks;
+    while (!list_empty(&timers)) {
+        timer = list_first_entry(&timers, typeof(*timer), node);
+        list_remove(&timer->node);
+        timer_wheel_add(timer);
+    }
 }
 
-void
-timer_init(struct timer *timer, timer_fn_t fn, void *arg)
+static bool
+timer_wheel_cascade_pending(void)
 {
-    list_node_init(&timer->node);
-    timer->fn = fn;
-    timer->arg = arg;
+    for (size_t i = 1; i < ARRAY_SIZE(timer_levels); i++) {
+        if (!timer_level_empty(&timer_levels[i])) {
+            return true;
+        }
+    }
+
+    return false;
 }
 
-unsigned long
-timer_get_time(const struct timer *timer)
+/*
+ * Compute the time of the next event on the timing wheel.
+ *
+ * An event is either a non-empty slot in the first level, or the start
+ * of a new revolution of the first level, if cascading may be needed.
+ * The wheel must not be empty.
+ */
+static unsigned long
+timer_wheel_next_event(void)
 {
-    unsigned long ticks;
+    unsigned long revolution;
+    unsigned int index, next;
+    bool cascade;
 
-    mutex_lock(&timer_mutex);
-    ticks = timer->ticks;
-    mutex_unlock(&timer_mutex);
+    assert(timer_nr_timers != 0);
 
-    return ticks;
-}
+    index = timer_level_index(timer_wheel_ticks, 0);
+    cascade = timer_wheel_cascade_pending();
 
-void
-timer_schedule(struct timer *timer, unsigned long ticks)
-{
-    struct timer *tmp;
-    uint32_t eflags;
+    if ((index == 0) && cascade) {
+        return timer_wheel_ticks;
+    }
 
-    mutex_lock(&timer_mutex);
+    next = timer_level_find(&timer_levels[0], index);
 
-    assert(!timer_scheduled(timer));
+    if (next != TIMER_WHEEL_SIZE) {
+        return timer_wheel_ticks + (next - index);
+    }
 
-    timer->ticks = ticks;
+    revolution = timer_wheel_ticks + (TIMER_WHEEL_SIZE - index);
+
+    if (cascade) {
+        return revolution;
+    }
+
+    next = timer_level_find(&timer_levels[0], 0);
+    assert(next < index);
+    return revolution + next;
+}
+
+/*
+ * Advance the timing wheel to the given time, which must be the time of
+ * the next event.
+ *
+ * The wheel time remains at the given time while the expired timers are
+ * processed, so that timers scheduled in the past by their callbacks are
+ * processed in the same pass.
+ */
+static void
+timer_wheel_advance(unsigned long ticks)
+{
+    timer_wheel_ticks = ticks;
 
     /*
-     * Find the insertion point,
-     *
-     * This makes timer scheduling an O(n) operation, and assumes a low
-     * number of timers. This is also why a mutex is used instead of
-     * disabling preemption, since preemption then remains enabled,
-     * allowing higher priority threads to run.
-     *
-     * [1] https://en.wikipedia.org/wiki/Big_O_notation
+     * Cascade from the highest level that starts a new revolution, so that
+     * timers move down as many levels as needed at once.
      */
-    list_for_each_entry(&timer_list, tmp, node) {
-        if (!timer_expired(tmp, ticks)) {
-            break;
+    if (timer_level_index(ticks, 0) == 0) {
+        for (unsigned int i = TIMER_WHEEL_NR_LEVELS - 1; i != 0; i--) {
+            if ((ticks & ((1UL << (i * TIMER_WHEEL_BITS)) - 1)) == 0) {
+                timer_wheel_cascade(i, timer_level_index(ticks, i));
+            }
         }
     }
+}
+
+/*
+ * Move the timers expiring at the wheel time to the given list.
+ *
+ * Return false if there are none.
+ */
+static bool
+timer_wheel_get_expired(struct list *expired)
+{
+    unsigned int index;
 
-    list_insert_before(&timer->node, &tmp->node);
+    index = timer_level_index(timer_wheel_ticks, 0);
+    list_set_head(expired, &timer_levels[0].slots[index]);
+    list_init(&timer_levels[0].slots[index]);
+    timer_level_clear(&timer_levels[0], index);
+    return !list_empty(expired);
+}
 
-    timer = list_first_entry(&timer_list, typeof(*timer), node);
+/*
+ * Update the copies of the timing wheel state used from interrupt context.
+ *
+ * Since preemption is disabled while updating these variables, softirq
+ * processing can't observe them in an inconsistent state, and potential
+ * spurious wake-ups of the timer thread are completely avoided.
+ */
+static void
+timer_wheel_update_wakeup(void)
+{
+    unsigned long ticks;
+    uint32_t eflags;
+
+    ticks = (timer_nr_timers == 0) ? 0 : timer_wheel_next_event();
 
-    /*
-     * This interrupt-based critical section could be moved outside the
-     * mutex-based one, which would make the latter shorter. The downside
-     * of this approach is that a timer interrupt occurring after unlocking
-     * the mutex but before disabling interrupts will wake up the timer
-     * thread, if there was work pending already. The timer thread may
-     * preempt the current thread and process all timers before the current
-     * thread resumes and clears the list empty flag. At the next timer
-     * interrupt, the handler will determine that there is work pending and
-     * wake up the timer thread, despite the fact that there is actually no
-     * timer in the list.
-     *
-     * By holding the mutex while clearing the list empty flag, potential
-     * spurious wake-ups are completely avoided.
-     */
     eflags = cpu_intr_save();
-    timer_list_empty = false;
-    timer_wakeup_ticks = timer->ticks;
+    timer_wheel_empty = (timer_nr_timers == 0);
+    timer_wakeup_ticks = ticks;
     cpu_intr_restore(eflags);
+}
 
-    mutex_unlock(&timer_mutex);
+/*
+ * Set the time of an empty timing wheel to the current time.
+ *
+ * The wheel time only advances when the wheel is processed, which doesn't
+ * happen while there are no timers. Inserting relative to a stale time
+ * would make the next processing walk all the events in between, and
+ * beyond the future/past threshold, make a timer be considered expired
+ * relative to the wheel time, or conversely. Since there are no timers,
+ * there is nothing to cascade, and the wheel time can safely jump.
+ *
+ * The stale time can't be compared with the current time, since it may
+ * be more than the threshold behind. It may also be one tick ahead, if
+ * the wheel was processed up to the current time, in which case moving
+ * it back only makes the current tick be processed again, with no timer
+ * that already expired in it.
+ */
+static void
+timer_wheel_resync(void)
+{
+    assert(timer_nr_timers == 0);
+    assert(!timer_wheel_processing);
+
+    timer_wheel_ticks = timer_now();
 }
 
-void
-timer_report_tick(void)
+/*
+ * Insert a timer in the timing wheel, and make sure the wheel is processed
+ * in time for it.
+ */
+static void
+timer_wheel_insert(struct timer *timer)
 {
-    timer_ticks++;
+    unsigned long ticks;
+    uint32_t eflags;
 
-    if (timer_work_pending()) {
-        thread_wakeup(timer_thread);
+    if ((timer_nr_timers == 0) && !timer_wheel_processing) {
+        timer_wheel_resync();
+    }
+
+    /*
+     * Inserting into the timing wheel is a constant time operation, which
+     * means the cost of scheduling a timer doesn't depend on the number
+     * of timers.
+     */
+    ticks = timer_wheel_add(timer);
+    timer_nr_timers++;
+
+    /*
+     * All the events of the wheel up to the current time are processed
+     * at once, so processing only needs to occur in time for the new
+     * timer. See timer_wheel_update_wakeup() about why this is done with
+     * preemption disabled.
+     */
+    eflags = cpu_intr_save();
+
+    if (timer_wheel_empty || timer_ticks_expired(ticks, timer_wakeup_ticks)) {
+        timer_wakeup_ticks = ticks;
     }
+
+    timer_wheel_empty = false;
+    cpu_intr_restore(eflags);
+}
+
+/*
+ * Queue a timer scheduled with interrupts disabled for insertion in the
+ * timing wheel.
+ */
+static void
+timer_queue_pending(struct timer *timer)
+{
+    assert(!cpu_intr_enabled());
+
+    timer->pending = true;
+    list_insert_tail(&timer_pending_list, &timer->node);
+}
+
+/*
+ * Insert the timers queued with interrupts disabled in the timing wheel.
+ *
+ * The list is detached at once, so that interrupts are only disabled for
+ * a constant time, whatever the number of timers.
+ */
+static void
+timer_drain_pending(void)
+{
+    struct timer *timer;
+    struct list timers;
+    uint32_t eflags;
+
+    assert(!thread_preempt_enabled());
+
+    eflags = cpu_intr_save();
+    list_set_head(&timers, &timer_pending_list);
+    list_init(&timer_pending_list);
+    cpu_intr_restore(eflags);
+
+    while (!list_empty(&timers)) {
+        timer = list_first_entry(&timers, typeof(*timer), node);
+        list_remove(&timer->node);
+        timer->pending = false;
+        timer_wheel_insert(timer);
+    }
+}
+
+/*
+ * Rearm a periodic timer that just expired, relative to the given current
+ * time.
+ *
+ * The next expiration time is the first one in the future, among those
+ * separated from the previous one by a whole number of periods, so that
+ * the timer never drifts. The periods skipped are accounted as missed.
+ */
+static void
+timer_rearm(struct timer *timer, unsigned long now)
+{
+    unsigned long ticks, missed;
+
+    ticks = timer->ticks + timer->period;
+    missed = 0;
+
+    if (timer_ticks_occurred(ticks, now)) {
+        missed = ((now - ticks) / timer->period) + 1;
+        ticks += missed * timer->period;
+    }
+
+    timer->ticks = ticks;
+    timer->missed = missed;
+    timer_wheel_insert(timer);
+}
+
+/*
+ * Process the timing wheel up to the given time.
+ *
+ * The callbacks of softirq timers are directly run, whereas other timers
+ * are deferred to the timer thread.
+ */
+static void
+timer_process_wheel(unsigned long now)
+{
+    unsigned long ticks, expiry, batch;
+    struct timer *timer;
+    struct list expired;
+
+    assert(!thread_preempt_enabled());
+
+    /*
+     * Only process the ticks where there is something to do, i.e. the
+     * events of the timing wheel, up to the current time.
+     *
+     * Timers queued from interrupt context, possibly by the callbacks
+     * just run, are inserted before looking for expired timers, so that
+     * those which already expired are processed in the same pass.
+     */
+    batch = 0;
+
+    /*
+     * The pending timers are drained before processing starts, so that
+     * the wheel time is resynchronized if the wheel is empty.
+     */
+    timer_drain_pending();
+    timer_wheel_processing = true;
+
+    for (;;) {
+        timer_drain_pending();
+
+        if (timer_nr_timers == 0) {
+            break;
+        }
+
+        ticks = timer_wheel_next_event();
+
+        if (!timer_ticks_occurred(ticks, now)) {
+            break;
+        }
+
+        timer_wheel_advance(ticks);
+
+        for (;;) {
+            timer_drain_pending();
+
+            if (!timer_wheel_get_expired(&expired)) {
+                break;
+            }
+
+            do {
+                timer = list_first_entry(&expired, typeof(*timer), node);
+                assert(timer_occurred(timer, ticks));
+                list_remove(&timer->node);
+                timer_nr_timers--;
+                batch++;
+
+                if (timer->flags & TIMER_SOFTIRQ) {
+                    list_node_init(&timer->node);
+                    expiry = timer->ticks;
+
+                    if (timer->period != 0) {
+                        timer_rearm(timer, now);
+                    }
+
+                    timer_process(timer, expiry);
+                } else {
+                    timer->deferred = true;
+                    list_insert_tail(&timer_deferred_list, &timer->node);
+                }
+            } while (!list_empty(&expired));
+        }
+
+        timer_wheel_ticks = ticks + 1;
+    }
+
+    timer_wheel_processing = false;
+
+    if (batch > timer_max_batch) {
+        timer_max_batch = batch;
+    }
+
+    /*
+     * There is nothing left to do up to the current time, so it's safe
+     * to make the wheel time jump, which avoids inserting new timers
+     * relative to a stale time.
+     */
+    if (timer_ticks_occurred(timer_wheel_ticks, now)) {
+        timer_wheel_ticks = now + 1;
+    }
+
+    timer_wheel_update_wakeup();
+
+    if (!list_empty(&timer_deferred_list)) {
+        thread_wakeup(timer_thread);
+    }
+}
+
+/*
+ * Run the callbacks of the timers deferred to the timer thread.
+ *
+ * The callbacks are run with the timer mutex unlocked, so that they may
+ * sleep, and schedule or cancel timers.
+ */
+static void
+timer_process_deferred(void)
+{
+    struct timer *timer;
+    unsigned long expiry;
+
+    mutex_lock(&timer_mutex);
+
+    for (;;) {
+        thread_preempt_disable();
+
+        if (list_empty(&timer_deferred_list)) {
+            timer = NULL;
+        } else {
+            timer = list_first_entry(&timer_deferred_list,
+                                     typeof(*timer), node);
+            list_remove(&timer->node);
+            list_node_init(&timer->node);
+            timer->deferred = false;
+            expiry = timer->ticks;
+
+            /*
+             * Deferred periodic timers are rearmed when their callback
+             * is about to run, so that the periods during which they
+             * waited for the timer thread are accounted as missed.
+             */
+            if (timer->period != 0) {
+                timer_rearm(timer, timer_now());
+            }
+        }
+
+        thread_preempt_enable();
+
+        if (!timer) {
+            break;
+        }
+
+        timer_current = timer;
+        mutex_unlock(&timer_mutex);
+
+        timer_process(timer, expiry);
+
+        mutex_lock(&timer_mutex);
+        timer_current = NULL;
+        condvar_broadcast(&timer_cv);
+    }
+
+    mutex_unlock(&timer_mutex);
+}
+
+/*
+ * Timer thread.
+ *
+ * In addition to running the callbacks of deferred timers, the timer
+ * thread processes the timing wheel when softirq processing couldn't
+ * take place, because the interrupted context had preemption disabled.
+ */
+static void
+timer_run(void *arg)
+{
+    unsigned long now;
+    uint32_t eflags;
+    bool pending;
+
+    (void)arg;
+
+    for (;;) {
+        thread_preempt_disable();
+        eflags = cpu_intr_save();
+
+        for (;;) {
+            now = timer_ticks;
+            pending = timer_work_pending();
+
+            if (pending || !list_empty(&timer_deferred_list)) {
+                break;
+            }
+
+            thread_sleep();
+        }
+
+        cpu_intr_restore(eflags);
+
+        if (pending) {
+            timer_process_wheel(now);
+        }
+
+        thread_preempt_enable();
+
+        timer_process_deferred();
+    }
+}
+
+void
+timer_setup(void)
+{
+    int error;
+
+    seqlock_init(&timer_seqlock);
+    timer_ticks = 0;
+    timer_tick_ns = clock_monotonic_ns();
+    timer_wheel_ticks = 0;
+    timer_nr_timers = 0;
+    timer_wheel_processing = false;
+    timer_max_batch = 0;
+    timer_wheel_empty = true;
+    timer_softirq_active = false;
+
+    for (size_t i = 0; i < ARRAY_SIZE(timer_levels); i++) {
+        timer_level_init(&timer_levels[i]);
+    }
+
+    list_init(&timer_deferred_list);
+    list_init(&timer_pending_list);
+    mutex_init(&timer_mutex);
+    condvar_init(&timer_cv);
+    timer_current = NULL;
+
+    error = thread_create(&timer_thread, timer_run, NULL,
+                          "timer", TIMER_STACK_SIZE, THREAD_MAX_PRIORITY);
+
+    if (error) {
+        panic("timer: unable to create thread");
+    }
+}
+
+unsigned long
+timer_now(void)
+{
+    unsigned long ticks, seq;
+
+    do {
+        seq = seqlock_read_begin(&timer_seqlock);
+        ticks = timer_ticks;
+    } while (seqlock_read_retry(&timer_seqlock, seq));
+
+    return ticks;
+}
+
+void
+timer_init(struct timer *timer, timer_fn_t fn, void *arg, int flags)
+{
+    list_node_init(&timer->node);
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->period = 0;
+    timer->missed = 0;
+    timer->flags = flags;
+    timer->deferred = false;
+    timer->pending = false;
+}
+
+unsigned long
+timer_get_time(const struct timer *timer)
+{
+    /*
+     * The expiration time is a single word, only written by the context
+     * scheduling the timer, or when a periodic timer is rearmed, so it
+     * can be read without any synchronization, even from interrupt
+     * context.
+     */
+    return ((const volatile struct timer *)timer)->ticks;
+}
+
+/*
+ * Select the expiration time of a timer among the given scheduled time
+ * and up to slack ticks later.
+ *
+ * If the timing wheel is already going to be processed within that window,
+ * the timer is made to expire at that time, so that it shares the wakeup.
+ * Otherwise, the time is rounded to the largest power-of-two boundary in
+ * the window, so that timers with overlapping windows are likely to end
+ * up with the same expiration time, and expire together. This makes the
+ * number of wakeups decrease as the slack increases, which is especially
+ * useful when the processor could otherwise remain idle.
+ */
+static unsigned long
+timer_apply_slack(unsigned long ticks, unsigned long slack)
+{
+    unsigned long limit, mask;
+    uint32_t eflags;
+    bool coalesced;
+
+    assert(slack < TIMER_THRESHOLD);
+
+    if (slack == 0) {
+        return ticks;
+    }
+
+    limit = ticks + slack;
+
+    /*
+     * Don't let the slack push a timer scheduled near the end of the
+     * time range into the past.
+     *
+     * When called from interrupt context, the wheel time may be concurrently
+     * advanced by the interrupted context. Since it only moves forward, a
+     * stale value only makes this check more conservative.
+     */
+    if (timer_ticks_expired(limit, timer_wheel_ticks)
+        && !timer_ticks_expired(ticks, timer_wheel_ticks)) {
+        return ticks;
+    }
+
+    eflags = cpu_intr_save();
+    coalesced = !timer_wheel_empty
+                && !timer_ticks_expired(timer_wakeup_ticks, ticks)
+                && timer_ticks_occurred(timer_wakeup_ticks, limit);
+
+    if (coalesced) {
+        ticks = timer_wakeup_ticks;
+    }
+
+    cpu_intr_restore(eflags);
+
+    if (coalesced) {
+        return ticks;
+    }
+
+    /*
+     * Keep the bits of the limit up to the most significant bit that
+     * differs between the scheduled time and the limit. That bit is set
+     * in the limit and clear in the scheduled time, which makes the
+     * result remain in the window, wrap around included.
+     */
+    mask = ticks ^ limit;
+    mask = (1UL << ((sizeof(mask) * 8) - __builtin_clzl(mask) - 1)) - 1;
+    return limit & ~mask;
+}
+
+void
+timer_schedule(struct timer *timer, unsigned long ticks, unsigned long slack)
+{
+    /*
+     * With interrupts disabled, the caller may be an interrupt handler
+     * that interrupted a context accessing the timing wheel, in which case
+     * the timer is queued instead of being inserted.
+     */
+    if (!cpu_intr_enabled()) {
+        assert(!timer_scheduled(timer));
+
+        timer->ticks = timer_apply_slack(ticks, slack);
+        timer->period = 0;
+        timer_queue_pending(timer);
+        return;
+    }
+
+    thread_preempt_disable();
+
+    assert(!timer_scheduled(timer));
+
+    timer->ticks = timer_apply_slack(ticks, slack);
+    timer->period = 0;
+    timer_wheel_insert(timer);
+
+    thread_preempt_enable();
+}
+
+void
+timer_schedule_periodic(struct timer *timer, unsigned long start,
+                        unsigned long period)
+{
+    assert((period != 0) && (period < TIMER_THRESHOLD));
+
+    if (!cpu_intr_enabled()) {
+        assert(!timer_scheduled(timer));
+
+        timer->ticks = start;
+        timer->period = period;
+        timer->missed = 0;
+        timer_queue_pending(timer);
+        return;
+    }
+
+    thread_preempt_disable();
+
+    assert(!timer_scheduled(timer));
+
+    timer->ticks = start;
+    timer->period = period;
+    timer->missed = 0;
+    timer_wheel_insert(timer);
+
+    thread_preempt_enable();
+}
+
+unsigned long
+timer_get_missed(const struct timer *timer)
+{
+    return timer->missed;
+}
+
+/*
+ * Convert a number of ticks from a frequency to another.
+ *
+ * The result is rounded up, and capped below the future/past threshold.
+ */
+static unsigned long
+timer_convert_ticks(unsigned long ticks, unsigned int old_freq,
+                    unsigned int new_freq)
+{
+    uint64_t result;
+
+    result = cpu_div64(((uint64_t)ticks * new_freq) + old_freq - 1, old_freq);
+    return (result >= TIMER_THRESHOLD) ? (TIMER_THRESHOLD - 1) : result;
+}
+
+void
+timer_rescale(unsigned int old_freq, unsigned int new_freq)
+{
+    struct timer_level *level;
+    struct timer *timer;
+    struct list timers;
+    unsigned long now;
+
+    thread_preempt_disable();
+
+    /*
+     * Queued timers are rescaled along with the others.
+     */
+    timer_drain_pending();
+
+    /*
+     * Detach all the timers from the timing wheel, since their slot
+     * depends on their expiration time.
+     */
+    list_init(&timers);
+
+    for (size_t i = 0; i < ARRAY_SIZE(timer_levels); i++) {
+        level = &timer_levels[i];
+
+        for (size_t j = 0; j < ARRAY_SIZE(level->slots); j++) {
+            list_concat(&timers, &level->slots[j]);
+            list_init(&level->slots[j]);
+        }
+
+        for (size_t j = 0; j < ARRAY_SIZE(level->bitmap); j++) {
+            level->bitmap[j] = 0;
+        }
+    }
+
+    /*
+     * The time remaining until expiration is rescaled, relative to the
+     * current time. Expired timers are left untouched, and are processed
+     * as soon as possible.
+     */
+    now = timer_now();
+
+    while (!list_empty(&timers)) {
+        timer = list_first_entry(&timers, typeof(*timer), node);
+        list_remove(&timer->node);
+
+        if (!timer_occurred(timer, now)) {
+            timer->ticks = now + timer_convert_ticks(timer->ticks - now,
+                                                     old_freq, new_freq);
+        }
+
+        if (timer->period != 0) {
+            timer->period = timer_convert_ticks(timer->period,
+                                                old_freq, new_freq);
+        }
+
+        timer_wheel_add(timer);
+    }
+
+    /*
+     * Deferred periodic timers are rearmed by the timer thread, from their
+     * period, which must also be converted.
+     */
+    list_for_each_entry(&timer_deferred_list, timer, node) {
+        if (timer->period != 0) {
+            timer->period = timer_convert_ticks(timer->period,
+                                                old_freq, new_freq);
+        }
+    }
+
+    timer_wheel_update_wakeup();
+
+    thread_preempt_enable();
+}
+
+bool
+timer_cancel(struct timer *timer)
+{
+    bool cancelled, softirq;
+    uint32_t eflags;
+
+    softirq = timer->flags & TIMER_SOFTIRQ;
+
+    /*
+     * Wait for a running callback to complete, unless called from that
+     * callback, in which case waiting would never return. This only
+     * applies to timers deferred to the timer thread, since softirq
+     * callbacks always complete before the interrupted thread resumes.
+     */
+    if (!softirq) {
+        mutex_lock(&timer_mutex);
+
+        while ((timer_current == timer) && (thread_self() != timer_thread)) {
+            condvar_wait(&timer_cv, &timer_mutex);
+        }
+    }
+
+    thread_preempt_disable();
+
+    cancelled = timer_scheduled(timer);
+
+    if (cancelled && timer->pending) {
+        /*
+         * The timer was scheduled from interrupt context, and hasn't
+         * been inserted in the timing wheel yet.
+         */
+        eflags = cpu_intr_save();
+        list_remove(&timer->node);
+        list_node_init(&timer->node);
+        timer->pending = false;
+        cpu_intr_restore(eflags);
+    } else if (cancelled) {
+        /*
+         * Removing a timer from the wheel is a constant time operation,
+         * which only unlinks it from its slot, and leaves the slot bitmap
+         * to be lazily updated. Note that this also works for timers on
+         * the list of expired timers being processed, and for timers
+         * deferred to the timer thread.
+         */
+        list_remove(&timer->node);
+        list_node_init(&timer->node);
+
+        if (timer->deferred) {
+            timer->deferred = false;
+        } else {
+            timer_nr_timers--;
+
+            /*
+             * The removed timer may have been the next to expire, in
+             * which case the wakeup time must be updated, or the wheel
+             * would uselessly be processed.
+             */
+            timer_wheel_update_wakeup();
+        }
+    }
+
+    thread_preempt_enable();
+
+    if (!softirq) {
+        mutex_unlock(&timer_mutex);
+    }
+
+    return cancelled;
+}
+
+void
+timer_report_tick(void)
+{
+    uint64_t now;
+
+    /*
+     * Read the clock before entering the write-side critical section,
+     * to keep it as short as possible.
+     */
+    now = clock_monotonic_ns();
+
+    seqlock_write_begin(&timer_seqlock);
+    timer_ticks++;
+    timer_tick_ns = now;
+    seqlock_write_end(&timer_seqlock);
+}
+
+void
+timer_softirq(bool preemptible)
+{
+    unsigned long now;
+
+    assert(!cpu_intr_enabled());
+    assert(!thread_preempt_enabled());
+
+    if (timer_softirq_active || !timer_work_pending()) {
+        return;
+    }
+
+    /*
+     * If the interrupted context had preemption disabled, it may be
+     * accessing the timing wheel, or already be processing it, in which
+     * case the work is deferred to the timer thread, which runs as soon
+     * as preemption is reenabled, since it has the highest priority.
+     */
+    if (!preemptible) {
+        thread_wakeup(timer_thread);
+        return;
+    }
+
+    /*
+     * Interrupts are enabled while processing timers, so that processing
+     * doesn't increase interrupt latencies. Preemption remains disabled,
+     * which prevents nested softirq processing, and makes softirq callbacks
+     * unable to sleep. Ticks may be reported while processing, which is
+     * why processing is repeated until there is no work left.
+     */
+    timer_softirq_active = true;
+
+    do {
+        now = timer_ticks;
+        cpu_intr_enable();
+        timer_process_wheel(now);
+        cpu_intr_disable();
+    } while (timer_work_pending());
+
+    timer_softirq_active = false;
+}
+
+static void
+timer_print_stats(const char *name, const struct timer_stats *stats)
+{
+    printf("timer: %s timers: %lu (max latency: %lluns)\n",
+           name, stats->nr_timers, (unsigned long long)stats->max_latency);
+
+    for (size_t i = 0; i < ARRAY_SIZE(stats->hist); i++) {
+        if (stats->hist[i] == 0) {
+            continue;
+        }
+
+        printf("timer:   %10lu - %-10lu %lu\n",
+               (i == 0) ? 0 : (1UL << i), (1UL << i) + ((1UL << i) - 1),
+               stats->hist[i]);
+    }
+}
+
+static void
+timer_shell_stat(struct shell *shell, int argc, char **argv)
+{
+    struct timer_stats stats[TIMER_NR_CLASSES];
+    unsigned long nr_timers, nr_deferred, max_batch;
+    struct list *node;
+
+    (void)shell;
+    (void)argc;
+    (void)argv;
+
+    nr_deferred = 0;
+
+    thread_preempt_disable();
+
+    nr_timers = timer_nr_timers;
+    max_batch = timer_max_batch;
+
+    list_for_each(&timer_deferred_list, node) {
+        nr_deferred++;
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(stats); i++) {
+        stats[i] = timer_stats[i];
+    }
+
+    thread_preempt_enable();
+
+    printf("timer: scheduled timers: %lu\n"
+           "timer: deferred timers:  %lu\n"
+           "timer: longest batch:    %lu\n"
+           "timer: expiration latencies, in nanoseconds:\n",
+           nr_timers, nr_deferred, max_batch);
+    timer_print_stats("softirq", &stats[TIMER_CLASS_SOFTIRQ]);
+    timer_print_stats("thread", &stats[TIMER_CLASS_THREAD]);
+}
+
+static struct shell_cmd timer_shell_cmds[] = {
+    SHELL_CMD_INITIALIZER("timerstat", timer_shell_stat,
+        "timerstat",
+        "display timer statistics"),
+};
+
+void
+timer_setup_shell(void)
+{
+    SHELL_REGISTER_CMDS(timer_shell_cmds, main_get_shell_cmd_set());
 }
@@ -30,18 +30,41 @@
 
 #include <lib/list.h>
 
+/*
+ * Timer flags.
+ *
+ * By default, timer callback functions run in the context of the timer
+ * thread, where they may sleep, e.g. to lock a mutex. Running a callback
+ * in the timer thread requires waking it up, which means at least two
+ * context switches, and a longer expiration latency.
+ *
+ * The callback functions of timers created with TIMER_SOFTIRQ are instead
+ * directly run on interrupt exit, in what is called softirq context, before
+ * returning to the interrupted thread. In this context, interrupts are
+ * enabled, but preemption is disabled, so these functions must not sleep.
+ * The term softirq comes from Linux, where it refers to work deferred from
+ * interrupt handlers, but still not run by a thread.
+ */
+#define TIMER_SOFTIRQ 0x1
+
 /*
  * Type for timer callback functions.
  *
- * These functions run in the context of the timer thread.
+ * These functions run in the context of the timer thread, or in softirq
+ * context if the timer was created with TIMER_SOFTIRQ.
  */
 typedef void (*timer_fn_t)(void *arg);
 
 struct timer {
     struct list node;
     unsigned long ticks;
+    unsigned long period;
+    unsigned long missed;
     timer_fn_t fn;
     void *arg;
+    int flags;
+    bool deferred;
+    bool pending;
 };
 
 /*
@@ -60,6 +83,14 @@ bool timer_ticks_occurred(unsigned long ticks, unsigned long ref);
  */
 void timer_setup(void);
 
+/*
+ * Register the shell commands of the timer module.
+ *
+ * This function may only be called once the main shell command set is
+ * initialized.
+ */
+void timer_setup_shell(void);
+
 /*
  * Return the current time, in ticks.
  */
@@ -69,8 +100,10 @@ unsigned long timer_now(void);
  * Initialize a timer.
  *
  * A timer may only be safely initialized when not scheduled.
+ *
+ * The flags argument is either 0 or TIMER_SOFTIRQ.
  */
-void timer_init(struct timer *timer, timer_fn_t fn, void *arg);
+void timer_init(struct timer *timer, timer_fn_t fn, void *arg, int flags);
 
 /*
  * Schedule a timer.
@@ -82,7 +115,8 @@ void timer_init(struct timer *timer, timer_fn_t fn, void *arg);
  * A timer may only be safely scheduled when not already scheduled. When
  * a timer expires and its callback function runs, it is not considered
  * scheduled any more, and may be safely rescheduled from within the
- * callback function. This is how periodic timers are implemented.
+ * callback function. Periodic timers are better implemented with
+ * timer_schedule_periodic(), which avoids drifting.
  *
  * Note that a timer callback function never runs immediately at its
  * scheduled time. The duration between the actual scheduled time and the
@@ -95,13 +129,15 @@ void timer_init(struct timer *timer, timer_fn_t fn, void *arg);
  * inversions, other interrupts, cache/TLB misses, contention on the system
  * bus (e.g. when the CPU and a DMA controller compete to become the bus
  * master for a transfer), and memory (DDR SDRAM) access requests being
- * reordered by the controller, to name the most common.
+ * reordered by the controller, to name the most common. The timer module
+ * keeps a histogram of the latencies it observes, per timer class, which
+ * may be displayed with the timerstat shell command.
  *
  * Also note that, in addition to latency, another parameter that affects
  * the processing of a timer is resolution. In this implementation, the
- * timer is configured to raise interrupts at the thread scheduler
- * frequency, normally 100 Hz, making the resolution 10ms, which is
- * considered a low resolution. This means that a timer cannot be
+ * timer is configured to raise interrupts at the tick frequency, 100 Hz
+ * by default, making the resolution 10ms, which is considered a low
+ * resolution. See the tick module. This means that a timer cannot be
  * scheduled to trigger at times that aren't multiples of 10ms on the
  * clock used by the timer system. Finally, note that when scheduling
  * relative timers, unless stated otherwise, the time for the timer to
@@ -116,16 +152,91 @@ void timer_init(struct timer *timer, timer_fn_t fn, void *arg);
  * What this interface guarantees is that the function never runs before
  * its scheduled time.
  *
- * Finally, for the sake of simplicity, this function doesn't provide a
- * way to cancel a timer.
+ * The slack is the number of ticks by which the timer may be delayed
+ * beyond its scheduled time. Many timers, e.g. timeouts, don't need to
+ * expire at an exact time, and giving them slack allows the timer module
+ * to make timers with overlapping windows expire together, reducing the
+ * number of wakeups. The expiration time, as returned by timer_get_time(),
+ * is then between the scheduled time and the scheduled time plus slack.
+ * A slack of 0 makes the timer expire exactly at its scheduled time.
+ *
+ * This function may be called from interrupt context, e.g. to arm a
+ * timeout from a device interrupt handler. More generally, when called
+ * with interrupts disabled, the timer is queued in constant time, and
+ * inserted in the timing wheel on interrupt exit, or by the timer thread.
  */
-void timer_schedule(struct timer *timer, unsigned long ticks);
+void timer_schedule(struct timer *timer, unsigned long ticks,
+                    unsigned long slack);
 
 /*
- * Return the scheduled time of a timer, in ticks.
+ * Schedule a periodic timer.
+ *
+ * The timer first expires at the given start time, in ticks, and then
+ * every period ticks, until cancelled. The timer is rearmed by the timer
+ * module before its callback function runs, relative to the start time,
+ * so that expiration times don't drift, whatever the latency. If the
+ * callback runs too late for one or more periods, these periods are
+ * skipped, and their number may be obtained with timer_get_missed().
+ *
+ * A periodic timer is considered scheduled, even while its callback
+ * function runs. It must not be rescheduled by its callback, but may be
+ * cancelled with timer_cancel(), from its callback or elsewhere.
+ *
+ * Like timer_schedule(), this function may be called from interrupt
+ * context.
+ */
+void timer_schedule_periodic(struct timer *timer, unsigned long start,
+                             unsigned long period);
+
+/*
+ * Return the number of periods a periodic timer missed before its last
+ * expiration.
+ *
+ * This function is meant to be called by the callback function of the
+ * timer, and returns 0 if its callback ran in time for the last period.
+ */
+unsigned long timer_get_missed(const struct timer *timer);
+
+/*
+ * Cancel a timer.
+ *
+ * If the callback function of the timer is running, this function waits
+ * for it to complete, unless called from the callback itself. Then, if the
+ * timer is scheduled, it's removed, in constant time, and true is returned.
+ * Otherwise, i.e. if the callback already ran, or if the timer was never
+ * scheduled, false is returned.
+ *
+ * On return, the timer isn't scheduled, and its callback isn't running,
+ * unless called from the callback itself. The timer may then safely be
+ * rescheduled, or released.
+ *
+ * Since this function may wait for the callback function to complete, it
+ * must not be called while holding a lock the callback function acquires.
+ * For the same reason, timers not created with TIMER_SOFTIRQ may only be
+ * cancelled from thread context. Unlike scheduling, cancelling is never
+ * allowed from interrupt context.
+ */
+bool timer_cancel(struct timer *timer);
+
+/*
+ * Return the expiration time of a timer, in ticks.
+ *
+ * Unless the timer was scheduled with slack, this is its scheduled time.
+ * For a periodic timer, this is the time of its next expiration.
+ *
+ * This function may be called from interrupt context.
  */
 unsigned long timer_get_time(const struct timer *timer);
 
+/*
+ * Rescale the expiration times and periods of scheduled timers after a
+ * change of the tick frequency.
+ *
+ * This function is called by the tick module, which must make sure timers
+ * aren't processed between the frequency change and the rescaling.
+ */
+void timer_rescale(unsigned int old_freq, unsigned int new_freq);
+
 /*
  * Report a periodic tick to the timer module.
  *
@@ -133,4 +244,14 @@ unsigned long timer_get_time(const struct timer *timer);
  */
 void timer_report_tick(void);
 
+/*
+ * Process expired timers on interrupt exit.
+ *
+ * This function is called by cpu_intr_main() before returning from an
+ * IRQ, with interrupts and preemption disabled. The preemptible argument
+ * indicates whether the interrupted context had preemption enabled. If
+ * it didn't, the timers are processed by the timer thread instead.
+ */
+void timer_softirq(bool preemptible);
+
 #endif /* TIMER_H */
@@ -29,10 +29,12 @@
 #include <stdio.h>
 
 #include <lib/cbuf.h>
+#include <lib/list.h>
 #include <lib/macros.h>
 
 #include "cpu.h"
 #include "io.h"
+#include "mempool.h"
 #include "uart.h"
 #include "thread.h"
 
@@ -44,6 +46,14 @@
 #define UART_IRQ                4
 
 #define UART_IER_DATA           0x1
+#define UART_IER_TX_EMPTY       0x2
+
+#define UART_IIR_NO_INTR        0x01
+#define UART_IIR_FIFO_ENABLED   0xc0
+
+#define UART_FCR_ENABLE         0x01
+#define UART_FCR_RX_CLEAR       0x02
+#define UART_FCR_TX_CLEAR       0x04
 
 #define UART_LCR_8BITS          0x3
 #define UART_LCR_STOP1          0
@@ -58,6 +68,8 @@
 #define UART_REG_DIVL           0
 #define UART_REG_IER            1
 #define UART_REG_DIVH           1
+#define UART_REG_IIR            2
+#define UART_REG_FCR            2
 #define UART_REG_LCR            3
 #define UART_REG_LSR            5
 
@@ -67,6 +79,43 @@
 #error "invalid buffer size"
 #endif
 
+/*
+ * Size of the transmitter FIFO of the 16550A.
+ *
+ * Older models have no FIFO, only a single holding register.
+ */
+#define UART_FIFO_SIZE          16
+
+/*
+ * Size of the transmission ring buffer.
+ *
+ * It's large enough for the output of a single printf() call, which then
+ * normally never blocks.
+ */
+#define UART_TX_BUFFER_SIZE     2048
+
+#if !ISP2(UART_TX_BUFFER_SIZE)
+#error "invalid transmission buffer size"
+#endif
+
+/*
+ * Overflow buffer.
+ *
+ * When the circular buffer is full, received bytes are stored in overflow
+ * buffers allocated from the interrupt-safe memory pool, so that bursts
+ * of input aren't lost. Overflow buffers are chained in reception order,
+ * and once the chain isn't empty, new bytes are appended to its last
+ * buffer instead of the circular buffer, which preserves ordering.
+ */
+struct uart_rx_buf {
+    struct list node;
+    unsigned int start;
+    unsigned int end;
+    uint8_t data[];
+};
+
+#define UART_RX_BUF_CAPACITY (MEMPOOL_BUF_SIZE - sizeof(struct uart_rx_buf))
+
 /*
  * Data shared between threads and the interrupt handler.
  *
@@ -74,18 +123,181 @@
  */
 static uint8_t uart_buffer[UART_BUFFER_SIZE];
 static struct cbuf uart_cbuf;
+static struct list uart_rx_bufs;
 static struct thread *uart_waiter;
 
+/*
+ * Structure used to bind a thread waiting for room in the transmission
+ * ring buffer.
+ *
+ * Like mutex waiters, it's allocated from the stack of the waiting thread.
+ */
+struct uart_tx_waiter {
+    struct list node;
+    struct thread *thread;
+};
+
+/*
+ * Transmission data.
+ *
+ * With interrupt-driven output, bytes are queued in the ring buffer, and
+ * the transmitter is active as long as the ring buffer isn't empty. While
+ * active, the "transmitter holding register empty" interrupt is enabled,
+ * and raised whenever the transmitter FIFO becomes empty, at which point
+ * the interrupt handler refills it from the ring buffer.
+ *
+ * Interrupts and preemption must be disabled when accessing these data.
+ */
+static uint8_t uart_tx_buffer[UART_TX_BUFFER_SIZE];
+static struct cbuf uart_tx_cbuf;
+static struct list uart_tx_waiters;
+static unsigned int uart_tx_fifo_size;
+static bool uart_tx_active;
+static bool uart_tx_polled;
+
+static int
+uart_rx_push(uint8_t byte)
+{
+    struct uart_rx_buf *buf;
+    int error;
+
+    if (list_empty(&uart_rx_bufs)) {
+        error = cbuf_pushb(&uart_cbuf, byte, false);
+
+        if (!error) {
+            return 0;
+        }
+
+        buf = NULL;
+    } else {
+        buf = list_last_entry(&uart_rx_bufs, struct uart_rx_buf, node);
+    }
+
+    if (!buf || (buf->end == UART_RX_BUF_CAPACITY)) {
+        buf = mempool_alloc();
+
+        if (!buf) {
+            return ENOMEM;
+        }
+
+        buf->start = 0;
+        buf->end = 0;
+        list_insert_tail(&uart_rx_bufs, &buf->node);
+    }
+
+    buf->data[buf->end] = byte;
+    buf->end++;
+    return 0;
+}
+
+static int
+uart_rx_pop(uint8_t *byte)
+{
+    struct uart_rx_buf *buf;
+    int error;
+
+    error = cbuf_popb(&uart_cbuf, byte);
+
+    if (!error) {
+        return 0;
+    }
+
+    if (list_empty(&uart_rx_bufs)) {
+        return EAGAIN;
+    }
+
+    buf = list_first_entry(&uart_rx_bufs, struct uart_rx_buf, node);
+    *byte = buf->data[buf->start];
+    buf->start++;
+
+    if (buf->start == buf->end) {
+        list_remove(&buf->node);
+        mempool_free(buf);
+    }
+
+    return 0;
+}
+
 static void
-uart_irq_handler(void *arg)
+uart_tx_wait(void)
+{
+    uint8_t byte;
+
+    for (;;) {
+        byte = io_read(UART_COM1_PORT + UART_REG_LSR);
+
+        if (byte & UART_LSR_TX_EMPTY) {
+            break;
+        }
+    }
+}
+
+static void
+uart_write_polled(uint8_t byte)
+{
+    uart_tx_wait();
+    io_write(UART_COM1_PORT + UART_REG_DAT, byte);
+}
+
+static void
+uart_tx_set_active(bool active)
+{
+    uint8_t ier;
+
+    uart_tx_active = active;
+    ier = UART_IER_DATA;
+
+    if (active) {
+        ier |= UART_IER_TX_EMPTY;
+    }
+
+    io_write(UART_COM1_PORT + UART_REG_IER, ier);
+}
+
+/*
+ * Move queued bytes to the transmitter FIFO, if it's empty.
+ */
+static void
+uart_tx_fill(void)
 {
     uint8_t byte;
     int error;
-    bool spurious;
 
-    (void)arg;
+    byte = io_read(UART_COM1_PORT + UART_REG_LSR);
+
+    if (!(byte & UART_LSR_TX_EMPTY)) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < uart_tx_fifo_size; i++) {
+        error = cbuf_popb(&uart_tx_cbuf, &byte);
+
+        if (error) {
+            break;
+        }
+
+        io_write(UART_COM1_PORT + UART_REG_DAT, byte);
+    }
+}
 
-    spurious = true;
+static void
+uart_tx_wakeup_all(void)
+{
+    struct uart_tx_waiter *waiter;
+
+    list_for_each_entry(&uart_tx_waiters, waiter, node) {
+        thread_wakeup(waiter->thread);
+    }
+}
+
+static bool
+uart_rx_intr(void)
+{
+    uint8_t byte;
+    int error;
+    bool received;
+
+    received = false;
 
     for (;;) {
         byte = io_read(UART_COM1_PORT + UART_REG_LSR);
@@ -94,9 +306,9 @@ uart_irq_handler(void *arg)
             break;
         }
 
-        spurious = false;
+        received = true;
         byte = io_read(UART_COM1_PORT + UART_REG_DAT);
-        error = cbuf_pushb(&uart_cbuf, byte, false);
+        error = uart_rx_push(byte);
 
         if (error) {
             printf("uart: error: buffer full\n");
@@ -104,7 +316,60 @@ uart_irq_handler(void *arg)
         }
     }
 
-    if (!spurious) {
+    return received;
+}
+
+static void
+uart_tx_intr(void)
+{
+    if (!uart_tx_active) {
+        return;
+    }
+
+    uart_tx_fill();
+
+    /*
+     * Once the ring buffer is empty, the interrupt is disabled, since it
+     * would otherwise keep being raised while the transmitter is idle.
+     */
+    if (cbuf_size(&uart_tx_cbuf) == 0) {
+        uart_tx_set_active(false);
+    }
+
+    uart_tx_wakeup_all();
+}
+
+static void
+uart_irq_handler(void *arg)
+{
+    uint8_t iir;
+    bool received;
+
+    (void)arg;
+
+    received = false;
+
+    /*
+     * The interrupt line remains asserted as long as any interrupt is
+     * pending, and since the i8259 is edge-triggered, interrupts raised
+     * while this handler runs would be lost if it returned before they
+     * are all serviced.
+     */
+    for (;;) {
+        iir = io_read(UART_COM1_PORT + UART_REG_IIR);
+
+        if (iir & UART_IIR_NO_INTR) {
+            break;
+        }
+
+        if (uart_rx_intr()) {
+            received = true;
+        }
+
+        uart_tx_intr();
+    }
+
+    if (received) {
         thread_wakeup(uart_waiter);
     }
 }
@@ -112,47 +377,137 @@ uart_irq_handler(void *arg)
 void
 uart_setup(void)
 {
+    uint8_t iir;
+
     cbuf_init(&uart_cbuf, uart_buffer, sizeof(uart_buffer));
+    list_init(&uart_rx_bufs);
+    cbuf_init(&uart_tx_cbuf, uart_tx_buffer, sizeof(uart_tx_buffer));
+    list_init(&uart_tx_waiters);
+    uart_tx_active = false;
+    uart_tx_polled = true;
 
     io_write(UART_COM1_PORT + UART_REG_LCR, UART_LCR_DLAB);
     io_write(UART_COM1_PORT + UART_REG_DIVL, UART_DIVISOR);
     io_write(UART_COM1_PORT + UART_REG_DIVH, UART_DIVISOR >> 8);
     io_write(UART_COM1_PORT + UART_REG_LCR, UART_LCR_8BITS | UART_LCR_STOP1
                                             | UART_LCR_PARITY_NONE);
+
+    /*
+     * Enable the FIFOs, which only exist on the 16550A and later models.
+     * The receiver FIFO is configured to raise an interrupt for every
+     * byte, which is the trigger level when the related bits are clear.
+     */
+    io_write(UART_COM1_PORT + UART_REG_FCR, UART_FCR_ENABLE | UART_FCR_RX_CLEAR
+                                            | UART_FCR_TX_CLEAR);
+    iir = io_read(UART_COM1_PORT + UART_REG_IIR);
+    uart_tx_fifo_size = ((iir & UART_IIR_FIFO_ENABLED) == UART_IIR_FIFO_ENABLED)
+                        ? UART_FIFO_SIZE
+                        : 1;
+
     io_write(UART_COM1_PORT + UART_REG_IER, UART_IER_DATA);
 
     cpu_irq_register(UART_IRQ, uart_irq_handler, NULL);
 }
 
-static void
-uart_tx_wait(void)
+void
+uart_set_polled(bool polled)
 {
+    uint32_t eflags;
     uint8_t byte;
+    int error;
 
-    for (;;) {
-        byte = io_read(UART_COM1_PORT + UART_REG_LSR);
+    thread_preempt_disable();
+    eflags = cpu_intr_save();
 
-        if (byte & UART_LSR_TX_EMPTY) {
-            break;
+    uart_tx_polled = polled;
+
+    if (polled) {
+        if (uart_tx_active) {
+            uart_tx_set_active(false);
+        }
+
+        for (;;) {
+            error = cbuf_popb(&uart_tx_cbuf, &byte);
+
+            if (error) {
+                break;
+            }
+
+            uart_write_polled(byte);
         }
+
+        /*
+         * Threads waiting for room write their byte with polling when
+         * they resume.
+         */
+        uart_tx_wakeup_all();
     }
+
+    cpu_intr_restore(eflags);
+    thread_preempt_enable();
 }
 
 static void
-uart_write_byte(uint8_t byte)
+uart_tx_push(uint8_t byte, bool sleep_allowed)
 {
-    uart_tx_wait();
-    io_write(UART_COM1_PORT + UART_REG_DAT, byte);
+    struct uart_tx_waiter waiter;
+    uint8_t oldest;
+    int error;
+
+    for (;;) {
+        if (uart_tx_polled) {
+            uart_write_polled(byte);
+            return;
+        }
+
+        error = cbuf_pushb(&uart_tx_cbuf, byte, false);
+
+        if (!error) {
+            break;
+        }
+
+        /*
+         * The ring buffer is full, which implies the transmitter is
+         * active, and that the interrupt handler wakes up waiters as
+         * soon as it makes room.
+         */
+        if (sleep_allowed) {
+            waiter.thread = thread_self();
+            list_insert_tail(&uart_tx_waiters, &waiter.node);
+            thread_sleep();
+            list_remove(&waiter.node);
+        } else {
+            error = cbuf_popb(&uart_tx_cbuf, &oldest);
+            assert(!error);
+            uart_write_polled(oldest);
+        }
+    }
+
+    if (!uart_tx_active) {
+        uart_tx_set_active(true);
+        uart_tx_fill();
+    }
 }
 
 void
 uart_write(uint8_t byte)
 {
+    uint32_t eflags;
+    bool sleep_allowed;
+
+    sleep_allowed = thread_preempt_enabled() && cpu_intr_enabled();
+
+    thread_preempt_disable();
+    eflags = cpu_intr_save();
+
     if (byte == '\n') {
-        uart_write_byte('\r');
+        uart_tx_push('\r', sleep_allowed);
     }
 
-    uart_write_byte(byte);
+    uart_tx_push(byte, sleep_allowed);
+
+    cpu_intr_restore(eflags);
+    thread_preempt_enable();
 }
 
 int
@@ -170,7 +525,7 @@ uart_read(uint8_t *byte)
     }
 
     for (;;) {
-        error = cbuf_popb(&uart_cbuf, byte);
+        error = uart_rx_pop(byte);
 
         if (!error) {
             break;